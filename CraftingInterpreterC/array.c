@@ -3,8 +3,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-Value pop();  // as defined in vm.h
-
 int calculateVarCount(int lbound, int ubound) {
 	return 1 + abs(ubound - lbound); // -5 to -3 = len 3  -3 to 2 = len 6   2 to 5 len 4
 }
@@ -12,96 +10,366 @@ int calculateVarCount(int lbound, int ubound) {
 int calculateArraySize(int dimensions, int lBounds[MAXARRAYDIMENSIONS], int uBounds[MAXARRAYDIMENSIONS]) {
 	int varCount = calculateVarCount(lBounds[0], uBounds[0]);
 	for (int i = 1; i < dimensions; i++) {
-		int dimCount = 1 + calculateVarCount(lBounds[i], lBounds[i]);
-		varCount *= dimCount;
+		varCount *= calculateVarCount(lBounds[i], uBounds[i]);
 	}
 	return varCount;
 }
 
-ArrayVariable* allocateNewArrayVar(ArrayVariables* av, int numBounds, int varCount) {
-	int currSize = av->bytesCurrAllocated;
-	
-	// we need room for the ArrayVariable definition plus 1 to n bounds
-	
-	int newVarDefnSize = sizeof(ArrayVariable) + numBounds * sizeof(ArrayBound);
-	int arrayContentsSize = varCount * sizeof(Value);
+// row-major - the last dimension has stride 1, each one before it the
+// stride times the count of the one after
+void setArrayLayout(ArrayVariable* varDefn) {
+	int stride = 1;
+	varDefn->offset = 0;
+	for (int i = varDefn->dimensions - 1; i >= 0; i--) {
+		varDefn->strides[i] = stride;
+		varDefn->offset += varDefn->bounds[i].lBound * stride;
+		stride *= calculateVarCount(varDefn->bounds[i].lBound, varDefn->bounds[i].uBound);
+	}
+	varDefn->count = stride;
+}
+
+void initArrayVariables(ArrayVariables* av) {
+	av->blocks = NULL;
+	av->large = NULL;
+	av->arrayVarCount = 0;
+	av->blockCount = 0;
+	av->largeCount = 0;
+	av->bytesAllocated = 0;
+	av->bytesReserved = 0;
+}
+
+static void freeBlocks(ArrayBlock* block) {
+	while (block != NULL) {
+		ArrayBlock* next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+void freeArrayVariables(ArrayVariables* av) {
+	freeBlocks(av->blocks);
+	freeBlocks(av->large);
+	initArrayVariables(av);
+}
+
+static ArrayBlock* newArrayBlock(ArrayVariables* av, ArrayBlock** list, size_t size) {
+	ArrayBlock* block = malloc(sizeof(ArrayBlock) + size);
+	if (!block) {
+		perror("array allocation failed");
+		exit(1);
+	}
+	block->used = 0;
+	block->size = size;
+	block->next = *list;
+	*list = block;
+	av->bytesReserved += size;
+	return block;
+}
+
+// the definition with the array contents right after it
+static size_t arrayVarSize(int varCount) {
+	size_t size = sizeof(ArrayVariable) + (size_t)varCount * sizeof(Value);
+	return (size + 7) & ~(size_t)7;  // keep the next definition aligned
+}
+
+ArrayVariable* allocateNewArrayVar(ArrayVariables* av, int varCount) {
+	size_t size = arrayVarSize(varCount);
+
+	ArrayBlock* block;
+	if (size > ARRAY_LARGE_SIZE) {
+		block = newArrayBlock(av, &av->large, size);
+		av->largeCount++;
+	}
+	else {
+		// bump allocate - whatever is left at the end of a full block stays unused
+		block = av->blocks;
+		if (block == NULL || block->size - block->used < size) {
+			block = newArrayBlock(av, &av->blocks, ARRAY_BLOCK_SIZE);
+			av->blockCount++;
+		}
+	}
+
+	ArrayVariable* ptr = (ArrayVariable*)(block->memory + block->used); 	// pointer to new variable defn
+	block->used += size;
+	av->arrayVarCount++;
+	av->bytesAllocated += size;
 
-	// grow the pool
-	av->memoryPool = realloc(av->memoryPool, currSize + newVarDefnSize + arrayContentsSize);
+	ptr->arrayValues = (Value*)((char*)ptr + sizeof(ArrayVariable));
+	ptr->count = varCount;  // setArrayLayout works it out again - markArraysStep needs it before that
+	ptr->local = 0;
+	ptr->serial = 0;
+	ptr->boundsVersion = 0;
+	for (int i = 0; i < varCount; i++) ptr->arrayValues[i] = NIL_VAL;
+	return ptr;
+}
 
-	if (!av->memoryPool) {
-		perror("realloc failed");
+static void* localArrayMemory(void* memory, size_t size) {
+	memory = realloc(memory, size);
+	if (!memory) {
+		perror("array allocation failed");
 		exit(1);
 	}
+	return memory;
+}
 
-	ArrayVariable* ptr = (ArrayVariable*)(av->memoryPool + currSize); 	// pointer to new variable defn
+static ArrayVariable* localArray(LocalArrays* la, int local) {
+	return &la->chunks[local / LOCAL_ARRAY_CHUNK][local % LOCAL_ARRAY_CHUNK];
+}
 
-	if (av->arrayVarCount > MAXARRAYVARIABLES) {
-		fprintf(stderr, "Too many ArrayVariables!\n");
-		exit(99); // TODO handle overflow better - should never happen due to Compiler and VM bytecode guards though
+void initLocalArrays(LocalArrays* la) {
+	la->chunks = NULL;
+	la->chunkCount = 0;
+	la->count = 0;
+	la->values = NULL;
+	la->spare = NULL;
+	la->serial = 0;
+}
+
+void freeLocalArrays(LocalArrays* la) {
+	for (int i = 0; i < la->chunkCount; i++) free(la->chunks[i]);
+	free(la->chunks);
+	while (la->values != NULL) {
+		LocalValueBlock* below = la->values->below;
+		free(la->values);
+		la->values = below;
 	}
+	free(la->spare);
+	initLocalArrays(la);
+}
 
-	av->arrayVars[av->arrayVarCount++] = (ArrayVariable*) ptr;
-	av->bytesCurrAllocated += newVarDefnSize + arrayContentsSize;
+// a block on top of the stack with room for varCount more elements
+static LocalValueBlock* localValueBlock(LocalArrays* la, int varCount) {
+	LocalValueBlock* block = la->values;
+	if (block != NULL && block->size - block->used >= varCount) return block;
 
+	if (la->spare != NULL && varCount <= la->spare->size) {
+		block = la->spare;
+		la->spare = NULL;
+	}
+	else {
+		int size = varCount > LOCAL_ARRAY_VALUES ? varCount : LOCAL_ARRAY_VALUES;
+		block = localArrayMemory(NULL, sizeof(LocalValueBlock) + (size_t)size * sizeof(Value));
+		block->size = size;
+	}
+	block->used = 0;
+	block->below = la->values;
+	la->values = block;
+	return block;
+}
 
-	ptr->arrayValues = (Value*)((char*)ptr + sizeof(ArrayVariable));  // the array contents are stored right after the definition
+ArrayVariable* allocateLocalArrayVar(LocalArrays* la, int varCount) {
+	if (la->count == la->chunkCount * LOCAL_ARRAY_CHUNK) {
+		la->chunks = localArrayMemory(la->chunks, (la->chunkCount + 1) * sizeof(ArrayVariable*));
+		la->chunks[la->chunkCount++] = localArrayMemory(NULL, LOCAL_ARRAY_CHUNK * sizeof(ArrayVariable));
+	}
+	LocalValueBlock* block = localValueBlock(la, varCount);
 
+	ArrayVariable* ptr = localArray(la, la->count);
+	ptr->local = la->count++;
+	ptr->serial = ++la->serial;
+	if (ptr->serial == 0) ptr->serial = ++la->serial;  // 0 is a global array
+	ptr->boundsVersion = 0;
+	ptr->arrayValues = &block->values[block->used];
+	block->used += varCount;
+	for (int i = 0; i < varCount; i++) ptr->arrayValues[i] = NIL_VAL;
 	return ptr;
 }
 
+void startArrayCursor(ArrayVariables* av, ArrayCursor* cursor) {
+	cursor->block = av->blocks;
+	cursor->large = false;
+	cursor->at = 0;
+	cursor->element = 0;
+}
+
+int markArraysStep(ArrayVariables* av, ArrayCursor* cursor, int budget) {
+	int marked = 0;
+	while (marked < budget) {
+		ArrayBlock* block = cursor->block;
+		if (block == NULL) {
+			if (cursor->large) break;
+			cursor->block = av->large;
+			cursor->large = true;
+			continue;
+		}
+		if (cursor->at >= block->used) {
+			cursor->block = block->next;
+			cursor->at = 0;
+			continue;
+		}
+
+		ArrayVariable* varDefn = (ArrayVariable*)(block->memory + cursor->at);
+		int end = varDefn->count;
+		if (end - cursor->element > budget - marked) end = cursor->element + budget - marked;
+		for (int i = cursor->element; i < end; i++) markValue(varDefn->arrayValues[i]);
+		marked += end - cursor->element;
+		cursor->element = end;
+		if (cursor->element == varDefn->count) {
+			cursor->at += arrayVarSize(varDefn->count);
+			cursor->element = 0;
+		}
+	}
+	return marked;
+}
+
+void markLocalArrays(LocalArrays* la) {
+	for (LocalValueBlock* block = la->values; block != NULL; block = block->below) {
+		for (int i = 0; i < block->used; i++) markValue(block->values[i]);
+	}
+}
+
+static bool inValueBlock(LocalValueBlock* block, Value* values) {
+	return values >= block->values && values < block->values + block->size;
+}
+
+void releaseLocalArrays(LocalArrays* la, int mark) {
+	if (mark >= la->count) return;
+	Value* first = localArray(la, mark)->arrayValues;
+	// the blocks above the one it is in go - one of the usual size is kept
+	// so a call in a loop doesn't malloc its arrays every time
+	while (!inValueBlock(la->values, first)) {
+		LocalValueBlock* block = la->values;
+		la->values = block->below;
+		if (la->spare == NULL && block->size == LOCAL_ARRAY_VALUES) la->spare = block;
+		else free(block);
+	}
+	la->values->used = (int)(first - la->values->values);
+	la->count = mark;
+}
+
+// released - or released and the place used again by another array, which has another serial
+bool arrayReleased(LocalArrays* la, ArrayVariable* varDefn) {
+	if (varDefn->serial == 0) return false;
+	return varDefn->local >= la->count || localArray(la, varDefn->local)->serial != varDefn->serial;
+}
+
 // get a value out of the array using the dimensions
 // bounds check the request and generate runtime error if invalid
 Value* getArrayValue(ArrayVariable* varDefn, Value subscripts[], char* errbuf, size_t errbuf_size) {
-	// check and process subscript 1 first
-	int subscript1 = (int) subscripts[0].as.number;
-	ArrayBound bnd = varDefn->bounds[0];
-	if (subscript1 < bnd.lBound || subscript1 > bnd.uBound) {
-		snprintf(errbuf, errbuf_size, "Subscript value %d is not in array bounds between %d and %d", subscript1, bnd.lBound, bnd.uBound);
-		return NULL;
+	int index = -varDefn->offset;
+	for (int i = 0; i < varDefn->dimensions; i++) {
+		int subscript = (int)AS_NUMBER(subscripts[i]);
+		ArrayBound bnd = varDefn->bounds[i];
+		if (subscript < bnd.lBound || subscript > bnd.uBound) {
+			snprintf(errbuf, errbuf_size, "Subscript value %d is not in array bounds between %d and %d", subscript, bnd.lBound, bnd.uBound);
+			return NULL;
+		}
+		index += subscript * varDefn->strides[i];
 	}
-	int indexInArray = (int)(subscripts[0].as.number) - bnd.lBound;
-	return &varDefn->arrayValues[indexInArray];
+	return &varDefn->arrayValues[index];
 }
 
 
-//bool setArrayValue(ArrayVariable* varDefn, Value* newvalue, Value subscripts[], char* errbuf, size_t errbuf_size) {
-bool setArrayValue(ArrayVariable* varDefn, ValueProvider provider, ValueContext* ctx, Value subscripts[], char* errbuf, size_t errbuf_size) {
+bool setArrayValue(ArrayVariable* varDefn, Value value, Value subscripts[], char* errbuf, size_t errbuf_size) {
+	Value* element = getArrayValue(varDefn, subscripts, errbuf, errbuf_size);
+	if (element == NULL) return false;
+	*element = value;
+	writeBarrier(element, value);
+	return true;
+}
 
-	// only process subscript 1 for initial implementation
+// a * or lo:hi subscript - where it starts, how many and which way it goes
+// false for a plain subscript
+static bool sectionAxis(ArrayVariable* varDefn, Value subscript, int axis, int* first, int* extent, int* direction) {
+	ArrayBound bnd = varDefn->bounds[axis];
+	if (IS_ARRAY_STAR(subscript)) {
+		*first = bnd.lBound;
+		*extent = calculateVarCount(bnd.lBound, bnd.uBound);
+		*direction = 1;
+		return true;
+	}
+	if (IS_RANGE(subscript)) {
+		*first = RANGE_LO(subscript);
+		*extent = calculateVarCount(RANGE_LO(subscript), RANGE_HI(subscript));
+		*direction = RANGE_LO(subscript) <= RANGE_HI(subscript) ? 1 : -1;
+		return true;
+	}
+	return false;
+}
 
-	Value* newvalue;
+static bool inBounds(ArrayBound bnd, int subscript, char* errbuf, size_t errbuf_size) {
+	if (subscript < bnd.lBound || subscript > bnd.uBound) {
+		snprintf(errbuf, errbuf_size, "Subscript value %d is not in array bounds between %d and %d", subscript, bnd.lBound, bnd.uBound);
+		return false;
+	}
+	return true;
+}
 
-	if (subscripts[0].type == VAL_ARRAY_STAR) {
-		int boundsSubscript1 = calculateVarCount(varDefn->bounds[0].lBound, varDefn->bounds[0].uBound);
-		for (int i = 0; i < boundsSubscript1; i++) {
-			newvalue = provider(ctx); // get another value for each array element, in case its a random value or something else dynamic
-			
-			pop(); // pop the rhs we just regenerated
-			varDefn->arrayValues[i] = *newvalue;
-			
+bool checkCrossSection(ArrayVariable* varDefn, Value subscripts[], char* errbuf, size_t errbuf_size) {
+	for (int i = 0; i < varDefn->dimensions; i++) {
+		ArrayBound bnd = varDefn->bounds[i];
+		if (IS_ARRAY_STAR(subscripts[i])) continue;
+		if (IS_RANGE(subscripts[i])) {
+			if (!inBounds(bnd, RANGE_LO(subscripts[i]), errbuf, errbuf_size) ||
+				!inBounds(bnd, RANGE_HI(subscripts[i]), errbuf, errbuf_size)) return false;
 		}
-
-	}
-	else {
-		int subscript1 = (int)subscripts[0].as.number;
-		ArrayBound bnd = varDefn->bounds[0];
-		if (subscript1 < bnd.lBound || subscript1 > bnd.uBound) {
-			snprintf(errbuf, errbuf_size, "Subscript value %d is not in array bounds between %d and %d", subscript1, bnd.lBound, bnd.uBound);
+		else if (!inBounds(bnd, (int)AS_NUMBER(subscripts[i]), errbuf, errbuf_size)) {
 			return false;
 		}
-		// TODO in some cases we already have the RHS, don't need to go get it again
-		newvalue = provider(ctx); // runs the rhs to get us a value
-		
-		int indexInArray = (int)(subscripts[0].as.number) - bnd.lBound;
-		varDefn->arrayValues[indexInArray] =  *newvalue;
+	}
+	return true;
+}
+
+int crossSectionCount(ArrayVariable* varDefn, Value subscripts[]) {
+	int count = 1;
+	int first, extent, direction;
+	for (int i = 0; i < varDefn->dimensions; i++) {
+		if (sectionAxis(varDefn, subscripts[i], i, &first, &extent, &direction)) count *= extent;
+	}
+	return count;
+}
 
-		pop(); // pop the rhs we just regenerated -- if we use provider
-		
-		
-		
+// the cursor is split into one subscript per * or range, the last one moving fastest
+Value* crossSectionElement(ArrayVariable* varDefn, Value subscripts[], int cursor) {
+	int index = -varDefn->offset;
+	for (int i = varDefn->dimensions - 1; i >= 0; i--) {
+		int subscript, extent, direction;
+		if (sectionAxis(varDefn, subscripts[i], i, &subscript, &extent, &direction)) {
+			subscript += direction * (cursor % extent);
+			cursor /= extent;
+		}
+		else {
+			subscript = (int)AS_NUMBER(subscripts[i]);
+		}
+		index += subscript * varDefn->strides[i];
 	}
+	return &varDefn->arrayValues[index];
+}
 
-	return true;
+// one after the other when, from the last * or range back, each one steps
+// (forwards) over all the elements of the ones after it - m(5,*) and
+// m(1:2,*) are, m(*,5) and a(3:1) aren't
+Value* crossSectionSpan(ArrayVariable* varDefn, Value subscripts[]) {
+	int expected = 1;
+	for (int i = varDefn->dimensions - 1; i >= 0; i--) {
+		int first, extent, direction;
+		if (!sectionAxis(varDefn, subscripts[i], i, &first, &extent, &direction) || extent == 1) continue;
+		if (direction * varDefn->strides[i] != expected) return NULL;
+		expected *= extent;
+	}
+	return crossSectionElement(varDefn, subscripts, 0);
+}
 
-}
\ No newline at end of file
+// a view has one dimension per * or range, each numbered from 1, and steps
+// through the parent's arrayValues with the parent's strides (negative for
+// a range that goes down) - so it is indexed like any other array
+void crossSectionView(ArrayVariable* varDefn, Value subscripts[], ArrayVariable* view) {
+	view->variableName = varDefn->variableName;
+	view->arrayValues = varDefn->arrayValues;
+	view->local = varDefn->local;
+	view->serial = varDefn->serial;
+	view->boundsVersion = varDefn->boundsVersion;
+	view->dimensions = 0;
+	view->count = 1;
+	view->offset = -(int)(crossSectionElement(varDefn, subscripts, 0) - varDefn->arrayValues);
+	for (int i = 0; i < varDefn->dimensions; i++) {
+		int first, extent, direction;
+		if (!sectionAxis(varDefn, subscripts[i], i, &first, &extent, &direction)) continue;
+		int axis = view->dimensions++;
+		view->bounds[axis].lBound = 1;
+		view->bounds[axis].uBound = extent;
+		view->strides[axis] = direction * varDefn->strides[i];
+		view->offset += view->strides[axis];
+		view->count *= extent;
+	}
+}
@@ -1,7 +1,12 @@
 #pragma once
 #include "value.h"
 #define MAXARRAYDIMENSIONS 3
-#define MAXARRAYVARIABLES  5
+
+// the arrays live in an arena of fixed size blocks that are never moved, so an
+// ArrayVariable* (in vm.globalArrayVars, on the stack, in a slice) stays good
+// until freeVM - an array bigger than ARRAY_LARGE_SIZE gets a block of its own
+#define ARRAY_BLOCK_SIZE  (64 * 1024)
+#define ARRAY_LARGE_SIZE  (ARRAY_BLOCK_SIZE / 4)
 
 // Array support
 
@@ -10,49 +15,132 @@ typedef struct {
     int uBound;
 } ArrayBound;
 
-typedef struct {
+// typedef is in value.h so a Value can hold an ArrayVariable*
+// the elements are stored row-major (the last subscript moves fastest), so
+// element (s0, s1, ...) is arrayValues[s0 * strides[0] + s1 * strides[1] + ... - offset]
+struct ArrayVariable {
     char* variableName;
     int dimensions;
     ArrayBound bounds[MAXARRAYDIMENSIONS];
+    int strides[MAXARRAYDIMENSIONS];
+    int offset;     // the lower bounds times the strides
+    int count;      // elements in all
     Value* arrayValues;
-} ArrayVariable;
+    int local;            // which of the local arrays (LocalArrays) - a view has its array's
+    unsigned int serial;  // 0 for a global array
+    unsigned int boundsVersion;  // times a global array was declared again with other bounds
+};
+
+typedef struct ArrayBlock {
+    struct ArrayBlock* next;
+    size_t used;
+    size_t size;
+    char memory[];
+} ArrayBlock;
 
 typedef struct {
-    ArrayVariable* arrayVars[MAXARRAYVARIABLES];
+    ArrayBlock* blocks;     // the one arrays are being put in first
+    ArrayBlock* large;      // one per large array
     int arrayVarCount;
-    int bytesCurrAllocated;
-    char* memoryPool;  // contiguous using arena allocator pattern
+    int blockCount;
+    int largeCount;
+    size_t bytesAllocated;  // definitions and elements
+    size_t bytesReserved;   // all the blocks
 } ArrayVariables;
 
-typedef struct CallFrame CallFrame;  // forward ref
+void initArrayVariables(ArrayVariables* av);
+void freeArrayVariables(ArrayVariables* av);
 
+// room for the definition and varCount elements - exits if out of memory
+ArrayVariable* allocateNewArrayVar(ArrayVariables* av, int varCount);
 
+// arrays declared inside a function or block - a stack of them that goes
+// back down when the block ends (OP_RELEASE_ARRAYS) or the function returns
+// (to CallFrame arrayMark), so they cost no hashing and no arena space.
+// Both the definitions and the elements are in chunks that are never moved,
+// and more are added as the stack gets deeper - an array bigger than
+// LOCAL_ARRAY_VALUES gets an elements block of its own
+#define LOCAL_ARRAY_CHUNK   256
+#define LOCAL_ARRAY_VALUES  (64 * 1024)
 
-typedef struct {
-    CallFrame* frame;
-    int start;         // start index in bytecode to run for rhs
-    int end;           // end index in bytecode to create new rhs
-} ValueContext;
+typedef struct LocalValueBlock {
+    struct LocalValueBlock* below;  // the one before it on the stack
+    int size;
+    int used;
+    Value values[];
+} LocalValueBlock;
 
+typedef struct {
+    ArrayVariable** chunks;  // LOCAL_ARRAY_CHUNK definitions each
+    int chunkCount;
+    int count;
+    LocalValueBlock* values;  // the top block
+    LocalValueBlock* spare;   // a released one, kept for the next call that needs it
+    unsigned int serial;      // of the last one
+} LocalArrays;
+
+void initLocalArrays(LocalArrays* la);
+void freeLocalArrays(LocalArrays* la);
+
+// the next local array with varCount elements (all nil) - exits if out of memory
+ArrayVariable* allocateLocalArrayVar(LocalArrays* la, int varCount);
+
+// drop the local arrays from number mark on
+void releaseLocalArrays(LocalArrays* la, int mark);
+
+// a slice can outlive the local array it is a view of - true if it has
+bool arrayReleased(LocalArrays* la, ArrayVariable* varDefn);
+
+// for the garbage collector - the elements of all the arrays (a released
+// local array's are gone, the slices left pointing at them aren't used).
+// The arena can be big, so it is marked a few elements at a time: the cursor
+// says how far it has got (an array defined after it has passed starts all nil)
+typedef struct {
+    ArrayBlock* block;  // NULL when it has been through both lists
+    bool large;         // in av->large
+    size_t at;          // the ArrayVariable in the block
+    int element;        // its next element
+} ArrayCursor;
 
-ArrayVariable* allocateNewArrayVar(ArrayVariables* av, int numBounds, int varCount);
+void startArrayCursor(ArrayVariables* av, ArrayCursor* cursor);
+// marks up to budget elements, returns how many
+int markArraysStep(ArrayVariables* av, ArrayCursor* cursor, int budget);
+void markLocalArrays(LocalArrays* la);
 
 int calculateVarCount(int lbound, int ubound);
 
 int calculateArraySize(int dimensions, int lBounds[MAXARRAYDIMENSIONS], int uBounds[MAXARRAYDIMENSIONS]);
 
+// strides, offset and count from the bounds - once the bounds are set
+void setArrayLayout(ArrayVariable* varDefn);
+
 // get a value out of the array using the dimensions
 // bounds check the request and generate runtime error if invalid
 Value* getArrayValue(ArrayVariable* varDefn, Value subscripts[], char* errbuf, size_t errbuf_size);
 
-// callback for setArrayValue
-typedef Value* (*ValueProvider)(ValueContext* ctx);
+// set a single value - bounds checked like getArrayValue
+// TODO handle subscript range e.g. foo[7:10] = 0;
+bool setArrayValue(ArrayVariable* varDefn, Value value, Value subscripts[], char* errbuf, size_t errbuf_size);
 
-// void get_new_rhs_for_set_array(ValueProvider provider, ValueContext* ctx);
+// Cross sections - a(*) = expr, run as a loop by OP_CROSS_SECTION / OP_SET_CROSS_SECTION
+// * can be any of the subscripts, e.g. m(5,*) is row 5 and m(*,5) column 5
+// so can a range lo:hi - a(3:1) is a(3), a(2), a(1)
+// the subscripts that aren't * must be in bounds, and so must both ends of a range
+bool checkCrossSection(ArrayVariable* varDefn, Value subscripts[], char* errbuf, size_t errbuf_size);
 
-// set a single value, or if one or more of the subscripts has the star operator set all values in that slice
-// TODO handle subscript range e.g. foo[7:10] = 0;
-// bool setArrayValue(ArrayVariable* varDefn, Value* newvalue, Value subscripts[], char* errbuf, size_t errbuf_size);
-bool setArrayValue(ArrayVariable* varDefn, ValueProvider provider, ValueContext* ctx, Value subscripts[], char* errbuf, size_t errbuf_size);
+// how many elements the cross section has
+int crossSectionCount(ArrayVariable* varDefn, Value subscripts[]);
+
+// element number cursor (0 to crossSectionCount - 1) of the cross section,
+// in row-major order like the array
+Value* crossSectionElement(ArrayVariable* varDefn, Value subscripts[], int cursor);
+
+// the elements of the cross section if they are one after the other in
+// arrayValues, NULL if not - for the bulk kernels (arraykernel.h)
+Value* crossSectionSpan(ArrayVariable* varDefn, Value subscripts[]);
+
+// the cross section as an array of its own (for an ObjSlice) that uses the
+// same arrayValues - nothing is copied
+void crossSectionView(ArrayVariable* varDefn, Value subscripts[], ArrayVariable* view);
 
 
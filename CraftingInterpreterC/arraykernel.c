@@ -0,0 +1,135 @@
+#include <string.h>
+
+#include "arraykernel.h"
+#include "memory.h"
+
+// SSE2 is always there on x86-64 - AVX2 is checked for at run time (GCC / Clang only)
+#if defined(NAN_BOXING) && (defined(__x86_64__) || defined(_M_X64))
+#define KERNEL_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define KERNEL_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+static bool allNumbers(KernelOperand operand, int count) {
+	if (operand.values == NULL) return IS_NUMBER(operand.constant);
+#ifdef NAN_BOXING
+	// no branch in the loop so the compiler can vectorize it
+	uint64_t notNumber = 0;
+	for (int i = 0; i < count; i++) notNumber |= (operand.values[i] & QNAN) == QNAN;
+	return notNumber == 0;
+#else
+	for (int i = 0; i < count; i++) {
+		if (!IS_NUMBER(operand.values[i])) return false;
+	}
+	return true;
+#endif
+}
+
+static inline double operandAt(KernelOperand operand, int i) {
+	return AS_NUMBER(operand.values != NULL ? operand.values[i] : operand.constant);
+}
+
+static inline double arithmetic(KernelOp op, double x, double y) {
+	switch (op) {
+		case KERNEL_ADD:      return x + y;
+		case KERNEL_SUBTRACT: return x - y;
+		case KERNEL_MULTIPLY: return x * y;
+		default:              return x / y;
+	}
+}
+
+#ifdef KERNEL_SSE2
+// one vector of WIDTH doubles at a time - a constant operand is the same in every lane
+// the number Values are the doubles, so the array storage is loaded as it is
+#define SIMD_LOOP(VEC, SET1, LOADU, STOREU, WIDTH, OPERATION) \
+	do { \
+		VEC bConstant = SET1(AS_NUMBER(b.constant)); \
+		VEC cConstant = SET1(AS_NUMBER(c.constant)); \
+		for (; i + WIDTH <= count; i += WIDTH) { \
+			VEC x = b.values != NULL ? LOADU((const double*)(b.values + i)) : bConstant; \
+			VEC y = c.values != NULL ? LOADU((const double*)(c.values + i)) : cConstant; \
+			STOREU((double*)(dest + i), OPERATION(x, y)); \
+		} \
+	} while (false)
+
+// returns how many elements it did - the rest are done one at a time
+static int kernelSse2(KernelOp op, Value* dest, int count, KernelOperand b, KernelOperand c) {
+	int i = 0;
+	switch (op) {
+		case KERNEL_ADD:      SIMD_LOOP(__m128d, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, 2, _mm_add_pd); break;
+		case KERNEL_SUBTRACT: SIMD_LOOP(__m128d, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, 2, _mm_sub_pd); break;
+		case KERNEL_MULTIPLY: SIMD_LOOP(__m128d, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, 2, _mm_mul_pd); break;
+		case KERNEL_DIVIDE:   SIMD_LOOP(__m128d, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, 2, _mm_div_pd); break;
+		default:              break;
+	}
+	return i;
+}
+#endif
+
+#ifdef KERNEL_AVX2
+__attribute__((target("avx2")))
+static int kernelAvx2(KernelOp op, Value* dest, int count, KernelOperand b, KernelOperand c) {
+	int i = 0;
+	switch (op) {
+		case KERNEL_ADD:      SIMD_LOOP(__m256d, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, 4, _mm256_add_pd); break;
+		case KERNEL_SUBTRACT: SIMD_LOOP(__m256d, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, 4, _mm256_sub_pd); break;
+		case KERNEL_MULTIPLY: SIMD_LOOP(__m256d, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, 4, _mm256_mul_pd); break;
+		case KERNEL_DIVIDE:   SIMD_LOOP(__m256d, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, 4, _mm256_div_pd); break;
+		default:              break;
+	}
+	return i;
+}
+
+static bool hasAvx2() {
+	static int avx2 = -1;
+	if (avx2 < 0) {
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2") != 0;
+	}
+	return avx2;
+}
+#endif
+
+// b or c starting part way into dest - the element loop would read what it
+// already wrote there, memmove and SIMD_LOOP wouldn't
+static bool partlyOverlaps(KernelOperand operand, Value* dest, int count) {
+	return operand.values != NULL && operand.values != dest &&
+		operand.values < dest + count && dest < operand.values + count;
+}
+
+// dest can be b or c (a(*) = a(*) * 2) - each element only reads its own position.
+// Any other overlap is refused, the caller's loop does those
+bool arrayKernel(KernelOp op, Value* dest, int count, KernelOperand b, KernelOperand c) {
+	if (partlyOverlaps(b, dest, count) || partlyOverlaps(c, dest, count)) return false;
+
+	switch (op) {
+		case KERNEL_FILL:	// a constant - never young
+			for (int i = 0; i < count; i++) dest[i] = b.constant;
+			return true;
+		case KERNEL_COPY:
+			memmove(dest, b.values, count * sizeof(Value));
+			for (int i = 0; i < count; i++) writeBarrier(&dest[i], dest[i]);
+			return true;
+		default:
+			break;
+	}
+
+	// checked before anything is written - the loop has to start from the values as they were
+	if (!allNumbers(b, count) || !allNumbers(c, count)) return false;
+
+	int i = 0;
+#ifdef KERNEL_AVX2
+	if (hasAvx2()) i = kernelAvx2(op, dest, count, b, c);
+	else
+#endif
+#ifdef KERNEL_SSE2
+	i = kernelSse2(op, dest, count, b, c);
+#endif
+	for (; i < count; i++) {
+		dest[i] = NUMBER_VAL(arithmetic(op, operandAt(b, i), operandAt(c, i)));
+	}
+	return true;
+}
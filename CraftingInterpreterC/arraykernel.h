@@ -0,0 +1,56 @@
+#pragma once
+#ifndef clox_arraykernel_h
+#define clox_arraykernel_h
+
+#include "common.h"
+#include "value.h"
+
+// Bulk kernels for the whole array forms of a(*) = expr
+//
+// The compiler spots a right hand side that is one of
+//
+//   a(*) = 0                  fill with a constant
+//   a(*) = b(*)               copy
+//   a(*) = b(*) + c(*)        + - * / of two cross sections
+//   a(*) = a(*) * 2           or of a cross section and a number constant
+//   a(*) = 2 - b(*)
+//
+// and puts OP_ARRAY_KERNEL in front of the usual loop (see
+// crossSectionAssignment() in compiler.c).  If every operand is a contiguous
+// run of the same length and the arithmetic ones are all numbers, the kernel
+// does the whole cross section and jumps over the loop; otherwise nothing has
+// been written and the loop runs, which gives the string + and the error
+// messages vm.c gives.
+//
+// With NAN_BOXING a number Value is the double itself, so on x86-64 the
+// arithmetic runs straight over the array storage with SSE2 (AVX2 if the
+// CPU has it).
+
+typedef enum {
+	KERNEL_FILL,		// b is a constant
+	KERNEL_COPY,		// b is an array
+	KERNEL_ADD,
+	KERNEL_SUBTRACT,
+	KERNEL_MULTIPLY,
+	KERNEL_DIVIDE
+} KernelOp;
+
+// the kernel byte of OP_ARRAY_KERNEL is the KernelOp and how many * subscripts
+// each operand has - 0 is a constant index, otherwise the name index of an array
+#define KERNEL_BYTE(op, bStars, cStars) ((op) | (bStars) << 3 | (cStars) << 5)
+#define KERNEL_OP(kernel)       ((KernelOp)((kernel) & 0x07))
+#define KERNEL_B_STARS(kernel)  (((kernel) >> 3) & 0x03)
+#define KERNEL_C_STARS(kernel)  (((kernel) >> 5) & 0x03)
+
+// an array operand is values[0..count-1], a constant one has values NULL
+typedef struct {
+	Value* values;
+	Value constant;
+} KernelOperand;
+
+// dest[i] = b[i] op c[i] for count elements - false (and dest untouched)
+// if an arithmetic operand isn't all numbers, or b or c overlaps dest
+// without being dest
+bool arrayKernel(KernelOp op, Value* dest, int count, KernelOperand b, KernelOperand c);
+
+#endif
@@ -5,7 +5,7 @@
 #include "memory.h"
 
 //> Garbage Collection chunk-include-vm
-//  #include "vm.h"
+#include "vm.h"
 //< Garbage Collection chunk-include-vm
 
 void initChunk(Chunk* chunk) {
@@ -14,11 +14,19 @@ void initChunk(Chunk* chunk) {
 	chunk->code = NULL;
 	chunk->lines = NULL;
 	initValueArray(&chunk->constants);
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
+	chunk->caches = NULL;
+	chunk->longJumpCount = 0;
+	chunk->longJumpCapacity = 0;
+	chunk->longJumps = NULL;
 }
 
 void freeChunk(Chunk* chunk) {
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	FREE_ARRAY(GlobalCache, chunk->caches, chunk->cacheCapacity);
+	FREE_ARRAY(int, chunk->longJumps, chunk->longJumpCapacity);
 	initChunk(chunk);
 }
 
@@ -39,8 +47,36 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 }
 
 int addConstant(Chunk* chunk, Value value) {
+	push(value);  // growing the constants can collect - the value isn't in them yet
 	writeValueArray(&chunk->constants, value);
+	pop();
+	markingBarrier(value);  // the function may be black already
 	return chunk->constants.count - 1;
 }
 
+// a fresh (empty) inline cache, returns its index for the instruction operand
+int addGlobalCache(Chunk* chunk) {
+	if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+		int oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->caches = GROW_ARRAY(GlobalCache, chunk->caches,
+			oldCapacity, chunk->cacheCapacity);
+	}
+	chunk->caches[chunk->cacheCount].entry = NULL;
+	chunk->caches[chunk->cacheCount].version = 0;
+	return chunk->cacheCount++;
+}
+
+// a jump too far for 16 bits - returns the index for the *_LONG instruction operand
+int addLongJump(Chunk* chunk, int distance) {
+	if (chunk->longJumpCapacity < chunk->longJumpCount + 1) {
+		int oldCapacity = chunk->longJumpCapacity;
+		chunk->longJumpCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->longJumps = GROW_ARRAY(int, chunk->longJumps,
+			oldCapacity, chunk->longJumpCapacity);
+	}
+	chunk->longJumps[chunk->longJumpCount] = distance;
+	return chunk->longJumpCount++;
+}
+
 // https://github.com/munificent/craftinginterpreters/blob/master/c/chunk.c
@@ -4,6 +4,7 @@
 
 #include "common.h"
 #include "value.h"
+#include "hashtable.h"
 
 typedef enum {
 	OP_INVALID,  // this is zero and could show up if we run off the end of the VM bytecode by accident!
@@ -18,12 +19,12 @@ typedef enum {
 	
 	OP_GET_LOCAL,
 	OP_SET_LOCAL,
-	OP_GET_GLOBAL,
-	OP_DEFINE_GLOBAL,
-	OP_SET_GLOBAL,
-	OP_GET_GLOBAL_ARRAY,
-	OP_SET_GLOBAL_ARRAY,
-	OP_DEFINE_GLOBAL_ARRAY,
+	OP_GET_GLOBAL,		// name16, cache16 - see GlobalCache
+	OP_DEFINE_GLOBAL,	// name16
+	OP_SET_GLOBAL,		// name16, cache16
+	OP_GET_GLOBAL_ARRAY,	// array16, subscript count, cache16 (array16 - see ARRAY_LOCAL)
+	OP_SET_GLOBAL_ARRAY,	// array16, subscript count, cache16
+	OP_DEFINE_GLOBAL_ARRAY,	// name16, subscript count, var count32, bounds 2 x 32 each
 	OP_GET_UPVALUE,
 	OP_SET_UPVALUE,
 	
@@ -57,16 +58,92 @@ typedef enum {
 	OP_CLASS,
 	OP_INHERIT,
 	OP_METHOD,
-	OP_RANDOM
+	OP_RANDOM,
+
+	// quickened forms - never emitted by the compiler, the VM rewrites
+	// the generic opcode in place once it has seen the operand types
+	OP_ADD_NUM,
+	OP_ADD_STR,
+	OP_SUBTRACT_NUM,
+	OP_GREATER_NUM,
+	OP_LESS_NUM,
+	OP_ADD_MIXED,				// an OP_ADD that has seen numbers and strings - stays generic
+
+	// superinstructions - the compiler fuses these common sequences
+	// (picked from the PROFILE_OPCODES pair counts)
+	OP_GET_LOCAL2,				// OP_GET_LOCAL a, OP_GET_LOCAL b
+	OP_ADD_CONST,				// OP_CONSTANT k, OP_ADD
+	OP_NOT_EQUAL,				// OP_EQUAL, OP_NOT
+	OP_POP_JUMP_IF_FALSE,		// OP_JUMP_IF_FALSE, then OP_POP on both paths
+	OP_LESS_JUMP_IF_FALSE,		// OP_LESS, OP_POP_JUMP_IF_FALSE
+	OP_GREATER_JUMP_IF_FALSE,	// OP_GREATER, OP_POP_JUMP_IF_FALSE
+
+	// globals resolved to a slot in vm.globalValues by the compiler - 2 byte operand
+	OP_GET_GLOBAL_SLOT,
+	OP_SET_GLOBAL_SLOT,
+	OP_DEFINE_GLOBAL_SLOT,
+
+	// only made by the peephole pass (peephole.c)
+	OP_SET_LOCAL_POP,		// OP_SET_LOCAL a, OP_POP - an assignment statement
+	OP_NOT_LESS,			// OP_LESS, OP_NOT - a >= b (true for a NaN, like the pair)
+	OP_NOT_GREATER,			// OP_GREATER, OP_NOT - a <= b
+
+	// wide forms - the compiler only picks these when the operand doesn't fit
+	OP_CONSTANT_LONG,				// constant index in 3 bytes
+	OP_JUMP_LONG,					// the 2 byte operand is an index into chunk->longJumps,
+	OP_JUMP_IF_FALSE_LONG,			// so they are the same length as the short ones and
+	OP_POP_JUMP_IF_FALSE_LONG,		// patchJump can swap the opcode in place
+	OP_LESS_JUMP_IF_FALSE_LONG,
+	OP_GREATER_JUMP_IF_FALSE_LONG,
+	OP_LOOP_LONG,
+
+	// a(*) = expr - see crossSectionAssignment() in compiler.c
+	OP_CROSS_SECTION,			// array16, subscript count
+	OP_SET_CROSS_SECTION,		// jump16 back to the right hand side, subscript count
+	OP_GET_CROSS_SECTION,		// array16, subscript count - b(*) in the right hand side
+	OP_ARRAY_KERNEL,			// jump16 over the loop, kernel, b16, c16 - see arraykernel.h
+
+	// slices - A(lo:hi) anywhere else is a view of A (ObjSlice)
+	OP_RANGE,					// lo, hi -> lo:hi as a subscript
+	OP_SLICE,					// array16, subscript count
+
+	// arrays declared in a function or block - see LocalArrays in array.h
+	OP_DEFINE_LOCAL_ARRAY,		// like OP_DEFINE_GLOBAL_ARRAY - the array goes in the local's slot
+	OP_RELEASE_ARRAYS,			// how many of the function's local arrays to keep
+
+	// a(i) where the compiler proved i is in bounds (a counted for loop) - no
+	// bounds check; back to the checked op if a global array is declared again
+	OP_GET_ARRAY_UNCHECKED,		// like OP_GET_GLOBAL_ARRAY
+	OP_SET_ARRAY_UNCHECKED		// like OP_SET_GLOBAL_ARRAY
 	
 } OpCode;
 
+// the array operand of the array instructions is the name of a global - an
+// array, or a variable holding a slice - or with this bit set the slot of a
+// local - a local array, or a slice (a function parameter)
+#define ARRAY_LOCAL 0x8000
+
+// inline cache for OP_GET_GLOBAL / OP_SET_GLOBAL - the vm.globals entry the
+// name was found in last time, good while the table version is unchanged.
+// The array element ops keep the vm.globalArrayVars entry of a global array
+// the same way
+typedef struct {
+	Entry* entry;
+	uint32_t version;
+} GlobalCache;
+
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t* code;
 	int* lines;
 	ValueArray constants;
+	int cacheCount;
+	int cacheCapacity;
+	GlobalCache* caches;
+	int longJumpCount;
+	int longJumpCapacity;
+	int* longJumps;			// distances for the *_LONG jumps
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -76,4 +153,6 @@ void freeChunk(Chunk* chunk);
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int addGlobalCache(Chunk* chunk);
+int addLongJump(Chunk* chunk, int distance);
 #endif
\ No newline at end of file
@@ -9,6 +9,13 @@
 
 #define NAN_BOXING
 
+// the compiler resolves each global to a slot in vm.globalValues
+// turn off to look globals up by name through a per instruction inline cache -
+// or build with NO_GLOBAL_SLOTS defined, see tests/testGlobalCache.lox
+#ifndef NO_GLOBAL_SLOTS
+#define GLOBAL_SLOTS
+#endif
+
 #define DEBUG_PRINT_CODE
 
 // to get stack trace at each step in VM
@@ -20,6 +27,27 @@
 // this is the limit for Local variables - 1 byte worth Pg 401
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// threaded dispatch in the VM using labels-as-values (GCC / Clang only)
+// MSVC does not have the extension, so it uses the switch statement
+// the stack trace needs the top of the loop on every instruction so it also uses the switch
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(DEBUG_TRACE_EXECUTION)
+#define COMPUTED_GOTO
+#endif
+
+// count opcodes plus opcode pairs and triples as they are dispatched
+// the report is printed by freeVM - see profile.c
+// it counts at the top of the loop too, so it goes back to the switch
+// #define PROFILE_OPCODES
+#ifdef PROFILE_OPCODES
+#undef COMPUTED_GOTO
+#endif
+
+// template JIT for hot functions (jit.c) - turned on at run time with  clox --jit
+// it emits x86-64 for the System V ABI and relies on the 8 byte NAN_BOXING Value
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING)
+#define JIT_X64
+#endif
+
 #endif
 // In the book, we show them defined, but for working on them locally,
 // we don't want them to be.
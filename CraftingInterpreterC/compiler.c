@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,6 +8,9 @@
 #include "scanner.h"
 #include "parseRules.h"
 #include "local.h"
+#include "regvm.h"
+#include "peephole.h"
+#include "arraykernel.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -27,6 +31,18 @@ typedef struct ClassCompiler {
 static ObjFunction globalFunctions[MAX_GLOBAL_FUNCTIONS];  // todo is the ObjString pointer valid at time of use?
 int globalFunctionCount;
 
+// the global arrays declared so far and their bounds - for bounds-check elimination
+#define MAX_KNOWN_ARRAYS 64
+
+typedef struct {
+    ObjString* name;
+    int dimensions;     // 0 once it is declared again with other bounds
+    ArrayBound bounds[MAXARRAYDIMENSIONS];
+} KnownArray;
+
+static KnownArray knownArrays[MAX_KNOWN_ARRAYS];
+static int knownArrayCount;
+
 Parser parser;
 Compiler* current = NULL;
 
@@ -35,9 +51,12 @@ static void declaration();
 static void statement();
 static void parsePrecedence(Precedence precedence);
 static void consume(TokenType type, const char* message);
-static uint8_t identifierConstant(Token* name);
+static int identifierConstant(Token* name);
+static void emitByte(uint8_t byte);
+static void emitShort(uint16_t val);
 static void emitBytes(OpCode byte1, uint8_t byte2);
-static uint8_t makeConstant(Value value);
+static Chunk* currentChunk();
+static int makeConstant(Value value);
 static bool check(TokenType type);
 static bool match(TokenType type);
 static bool parseIntSlice(const char* ptr, int len, int* outValue);
@@ -45,12 +64,35 @@ static bool parseIntSlice(const char* ptr, int len, int* outValue);
 // ch 21.2 pg 389
 // take token and and lexeme to chunk constant table as string
 // return index of the constant - to lookup the variable in future usages
+// the name operands are 2 bytes, and a name used again gets the same index
+
+static int identifierConstant(Token* name) {
+    ObjString* string = copyString(name->start, name->length);
+    Value index;
+    if (tableGet(&current->names, string, &index)) return (int)AS_NUMBER(index);
+
+    int constant = addConstant(currentChunk(), OBJ_VAL(string));
+    if (constant > UINT16_MAX) {
+        error("Too many global names in one chunk.");
+        return 0;
+    }
+    tableSet(&current->names, string, NUMBER_VAL(constant));
+    return constant;
+}
 
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+// slot in vm.globalValues for a global - the VM indexes it instead of hashing the name
+#ifdef GLOBAL_SLOTS
+static int resolveGlobal(ObjString* name) {
+    int slot = globalSlot(name);
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
 }
+#endif
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     // If we have a global, there is no need to add variable name to the locals lookup table
@@ -70,14 +112,23 @@ static void markInitialized() {
 
 // Emit the VM opcode to define global variable now that it becomes available for use
 // for local just mark it as initialized
-static void defineVariable(OpCode opcode, uint8_t globalVarSlot) {
+static void defineVariable(OpCode opcode, int globalVarSlot) {
 
     // if in local scope, the local var is already on top of stack - see pg 404
     if (current->scopeDepth > 0) {
         markInitialized(); // pg 411
         return;
     } 
-    emitBytes(opcode, globalVarSlot); // ch 21.2 pg 389
+#ifdef GLOBAL_SLOTS
+    if (opcode == OP_DEFINE_GLOBAL) {
+        // resolved to its slot - the name constant is only needed to find it
+        emitByte(OP_DEFINE_GLOBAL_SLOT);
+        emitShort(resolveGlobal(AS_STRING(currentChunk()->constants.values[globalVarSlot])));
+        return;
+    }
+#endif
+    emitByte(opcode); // ch 21.2 pg 389
+    emitShort(globalVarSlot);
 }
 
 // Ch 24 pg 450
@@ -196,7 +247,7 @@ static void emitByte(uint8_t byte) {
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
-static void emitShort(short val) {
+static void emitShort(uint16_t val) {
     emitByte((val >> 8) & 0xff);
     emitByte(val & 0xff);
 }
@@ -206,6 +257,35 @@ static void emitBytes(OpCode byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+static void emitInt(int val) {
+    emitShort((val >> 16) & 0xffff);
+    emitShort(val & 0xffff);
+}
+
+// Superinstructions
+// remember the last instruction emitted that can be the first half of a fused pair
+static void noteInstruction(OpCode op) {
+    current->lastOp = op;
+    current->lastOpOffset = currentChunk()->count;
+}
+
+// true if the last thing emitted was op (length bytes) and no jump lands
+// right after it, so the next instruction can be folded into it
+static bool canFuse(OpCode op, int length) {
+    int count = currentChunk()->count;
+    return current->lastOp == op &&
+        current->lastOpOffset == count - length &&
+        current->lastJumpTarget != count;
+}
+
+// the next instruction is the target of a jump (or a loop)
+static int markJumpTarget() {
+    current->lastJumpTarget = currentChunk()->count;
+    current->constantCount = 0;  // what comes before the label isn't a constant any more
+    current->numericEnd = -1;
+    return current->lastJumpTarget;
+}
+
 static int emitJump(OpCode instruction) {
     emitByte(instruction);
     emitByte(0xff);
@@ -214,11 +294,17 @@ static int emitJump(OpCode instruction) {
 }
 
 // conditionally jump backwards - used for while Ch 23.3 pg 423
+// a body over 64K goes back through OP_LOOP_LONG and chunk->longJumps
 static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
-
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset > UINT16_MAX) {
+        emitByte(OP_LOOP_LONG);
+        offset = addLongJump(currentChunk(), offset);
+        if (offset > UINT16_MAX) error("Loop body too large.");
+    }
+    else {
+        emitByte(OP_LOOP);
+    }
 
     emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
@@ -238,19 +324,202 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+// if / while / for condition - pops the condition on both paths
+// a comparison right before it is fused into the jump
+static int emitConditionJump() {
+    OpCode fused = OP_INVALID;
+    if (canFuse(OP_LESS, 1)) fused = OP_LESS_JUMP_IF_FALSE;
+    else if (canFuse(OP_GREATER, 1)) fused = OP_GREATER_JUMP_IF_FALSE;
+
+    current->lastOp = OP_INVALID;
+    if (fused == OP_INVALID) return emitJump(OP_POP_JUMP_IF_FALSE);
+
+    currentChunk()->count--;  // drop the comparison, the fused opcode does it
+    return emitJump(fused);
+}
+
+static void emitGetLocal(uint8_t slot) {
+    if (canFuse(OP_GET_LOCAL, 2)) {
+        currentChunk()->code[current->lastOpOffset] = OP_GET_LOCAL2;
+        emitByte(slot);
+        current->lastOp = OP_INVALID;  // a third one starts over
+        return;
+    }
+    noteInstruction(OP_GET_LOCAL);
+    emitBytes(OP_GET_LOCAL, slot);
+}
+
+// the first 256 load with OP_CONSTANT, the rest with OP_CONSTANT_LONG (3 byte index)
+static int makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > 0xffffff) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
+}
+
+static void emitConstantIndex(int constant) {
+    if (constant <= UINT8_MAX) {
+        emitBytes(OP_CONSTANT, (uint8_t)constant);
+    }
+    else {
+        emitByte(OP_CONSTANT_LONG);
+        emitByte((constant >> 16) & 0xff);
+        emitShort(constant & 0xffff);
+    }
+}
+
+static int constantLoadLength(uint8_t op) {
+    return op == OP_CONSTANT ? 2 : op == OP_CONSTANT_LONG ? 4 : 1;
+}
+
+// pool index of the OP_CONSTANT / OP_CONSTANT_LONG at offset
+static int constantIndex(Chunk* chunk, int offset) {
+    if (chunk->code[offset] == OP_CONSTANT) return chunk->code[offset + 1];
+    return (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+}
+
+
+// Constant folding
+// a constant load is about to be emitted - remember where, if it follows the
+// one before it (so 1 + 2 has two in a row when binary() gets to the +)
+static void noteConstant() {
+    Chunk* chunk = currentChunk();
+    if (current->constantCount > 0) {
+        int last = current->constantOffsets[current->constantCount - 1];
+        if (last + constantLoadLength(chunk->code[last]) != chunk->count) current->constantCount = 0;
+    }
+    if (current->constantCount == FOLD_DEPTH) {
+        memmove(current->constantOffsets, current->constantOffsets + 1, (FOLD_DEPTH - 1) * sizeof(int));
+        current->constantCount--;
+    }
+    current->constantOffsets[current->constantCount++] = chunk->count;
+}
+
+// the value of the constant n loads back from the end of the code (0 is the
+// last one) - false if the code doesn't end with that many in a row
+static bool constantOperand(int n, Value* value) {
+    Chunk* chunk = currentChunk();
+    if (current->constantCount <= n) return false;
+    int last = current->constantOffsets[current->constantCount - 1];
+    if (last + constantLoadLength(chunk->code[last]) != chunk->count) return false;
+
+    int offset = current->constantOffsets[current->constantCount - 1 - n];
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: *value = chunk->constants.values[constantIndex(chunk, offset)]; break;
+        case OP_NIL:      *value = NIL_VAL; break;
+        case OP_TRUE:     *value = BOOL_VAL(true); break;
+        case OP_FALSE:    *value = BOOL_VAL(false); break;
+        default:          return false;
+    }
+    // a(*) puts ARRAY_STAR on the stack - that one is for the VM
+    return IS_NUMBER(*value) || IS_STRING(*value) || IS_BOOL(*value) || IS_NIL(*value);
+}
+
+// take the last n constant loads back out of the chunk, and their constants
+// out of the pool if nothing was added after them
+static void dropConstants(int n) {
+    Chunk* chunk = currentChunk();
+    for (int i = 0; i < n; i++) {
+        int offset = current->constantOffsets[--current->constantCount];
+        if (constantLoadLength(chunk->code[offset]) > 1 && constantIndex(chunk, offset) == chunk->constants.count - 1) {
+            chunk->constants.count--;
+        }
+        chunk->count = offset;
+    }
+    current->lastOp = OP_INVALID;
+}
+
+static void emitConstant(Value value);
+
+static void emitFolded(Value value) {
+    if (IS_NIL(value) || IS_BOOL(value)) {
+        noteConstant();
+        emitByte(IS_NIL(value) ? OP_NIL : AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else {
+        emitConstant(value);
+    }
 }
 
+// both operands of a binary operator are constants - work it out now
+// anything that would be a runtime error (1 < "a") is left for the VM
+static bool foldBinary(TokenType operatorType) {
+    Value a, b;
+    if (!constantOperand(1, &a) || !constantOperand(0, &b)) return false;
+
+    Value result;
+    if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+        result = BOOL_VAL(valuesEqual(a, b) == (operatorType == TOKEN_EQUAL_EQUAL));
+    }
+    else if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        result = OBJ_VAL(concatenateStrings(AS_STRING(a), AS_STRING(b), false));
+    }
+    else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (operatorType) {
+            case TOKEN_PLUS:          result = NUMBER_VAL(x + y); break;
+            case TOKEN_MINUS:         result = NUMBER_VAL(x - y); break;
+            case TOKEN_STAR:          result = NUMBER_VAL(x * y); break;
+            case TOKEN_SLASH:         result = NUMBER_VAL(x / y); break;
+            case TOKEN_GREATER:       result = BOOL_VAL(x > y); break;
+            case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;  // what OP_LESS, OP_NOT gives for a NaN
+            case TOKEN_LESS:          result = BOOL_VAL(x < y); break;
+            case TOKEN_LESS_EQUAL:    result = BOOL_VAL(!(x > y)); break;
+            default:                  return false;  // ? is random
+        }
+    }
+    else {
+        return false;
+    }
+
+    dropConstants(2);
+    emitFolded(result);
+    return true;
+}
+
+// x * 1, x / 1 and x - 0 when x is known to be a number - just x
+// (not x + 0: -0 + 0 is 0, and x could be a string)
+static bool simplifyBinary(TokenType operatorType) {
+    Value b;
+    if (!constantOperand(0, &b) || !IS_NUMBER(b)) return false;
+    if (current->numericEnd != current->constantOffsets[current->constantCount - 1]) return false;
+
+    double y = AS_NUMBER(b);
+    bool identity = ((operatorType == TOKEN_STAR || operatorType == TOKEN_SLASH) && y == 1) ||
+        (operatorType == TOKEN_MINUS && y == 0 && !signbit(y));
+    if (!identity) return false;
+
+    dropConstants(1);
+    current->numericEnd = currentChunk()->count;
+    return true;
+}
+
+// the result of an arithmetic instruction is a number (or a runtime error)
+static void noteNumeric() {
+    current->numericEnd = currentChunk()->count;
+}
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    noteConstant();
+    int constant = makeConstant(value);
+    if (constant <= UINT8_MAX) noteInstruction(OP_CONSTANT);  // OP_ADD_CONST only has a byte
+    emitConstantIndex(constant);
+}
+
+static OpCode longJump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:                   return OP_JUMP_LONG;
+        case OP_JUMP_IF_FALSE:          return OP_JUMP_IF_FALSE_LONG;
+        case OP_POP_JUMP_IF_FALSE:      return OP_POP_JUMP_IF_FALSE_LONG;
+        case OP_LESS_JUMP_IF_FALSE:     return OP_LESS_JUMP_IF_FALSE_LONG;
+        case OP_GREATER_JUMP_IF_FALSE:  return OP_GREATER_JUMP_IF_FALSE_LONG;
+        default:                        return OP_INVALID;
+    }
 }
 
 static void patchJump(int offset) {
@@ -258,11 +527,15 @@ static void patchJump(int offset) {
     int jump = currentChunk()->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        // same length - swap in the long opcode, the operand becomes an index into chunk->longJumps
+        currentChunk()->code[offset - 1] = longJump(currentChunk()->code[offset - 1]);
+        jump = addLongJump(currentChunk(), jump);
+        if (jump > UINT16_MAX) error("Too much code to jump over.");
     }
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    markJumpTarget();
 }
 
 // FunctionType added in Ch 24.2 pg 436
@@ -273,11 +546,21 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->scopeDepth = 0;
     compiler->function = newFunction();  // pg 437
     compiler->type = type;
+    compiler->lastOp = OP_INVALID;
+    compiler->lastOpOffset = -1;
+    compiler->lastJumpTarget = -1;
+    compiler->constantCount = 0;
+    compiler->numericEnd = -1;
+    initTable(&compiler->names);
+    compiler->crossSectionDepth = 0;
+    compiler->loopCount = 0;
+    compiler->uncheckedCount = 0;
     
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start,
             parser.previous.length);
+        markingBarrier(OBJ_VAL(current->function->name));
     }
 
     // Reserve stack slot zero for VM internal use ch 24.2.1 pg 438
@@ -285,6 +568,7 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     local->depth = 0;
     local->name.start = "";  //  name is empty so user can't refer to it
     local->name.length = 0;
+    local->isArray = false;
 
     /*if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start,
@@ -314,12 +598,32 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    freeTable(&current->names);
+
+    int removedInstructions = vm.peepholeInstructions;
+    int removedBytes = vm.peepholeBytes;
+    if (vm.peephole && !parser.hadError) {
+        peepholeChunk(currentChunk());
+    }
+
+    // second backend - three address code built from the finished stack code
+    if (vm.registerBackend && !parser.hadError) {
+        compileRegisterCode(function);
+    }
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         printf("clean compile! here is the bytecode\n");
+        if (vm.peephole) {
+            printf("peephole removed %d instructions (%d bytes)\n",
+                vm.peepholeInstructions - removedInstructions, vm.peepholeBytes - removedBytes);
+        }
         disassembleChunk(currentChunk(), function->name != NULL
             ? function->name->chars : "<script>");
+        if (function->registerChunk.count > 0) {
+            disassembleRegisterChunk(&function->registerChunk, &currentChunk()->constants,
+                function->name != NULL ? function->name->chars : "<script>");
+        }
     }
 #endif
     
@@ -335,12 +639,14 @@ static void beginScope() {
 // Ch 22.2 pg 403 and 407
 static void endScope() {
     current->scopeDepth--;
+    int arrays = 0;
    
     // Ch 22.3 Locals pg 407
     while (current->localCount > 0 &&
         current->locals[current->localCount - 1].depth >
         current->scopeDepth) {
         // TODO possible optimization POPN see page 407
+        if (current->locals[current->localCount - 1].isArray) arrays++;
         emitByte(OP_POP);
         //// Closures end-scope
         //if (current->locals[current->localCount - 1].isCaptured) {
@@ -352,7 +658,15 @@ static void endScope() {
         ////< Closures end-scope
         current->localCount--;
     }
- 
+
+    // the block's arrays go too - the function's arrays in the blocks around it stay
+    if (arrays > 0) {
+        int keep = 0;
+        for (int i = 0; i < current->localCount; i++) {
+            if (current->locals[i].isArray) keep++;
+        }
+        emitBytes(OP_RELEASE_ARRAYS, (uint8_t)keep);
+    }
 }
 
 static void expression() {
@@ -381,6 +695,42 @@ static void consumeInteger(char* message, int* outValue) {
 
 #define MAXVARSINDECLARE 20
 
+static void setBounds(int* dimensions, ArrayBound bounds[], int count, int lBounds[], int uBounds[]) {
+    *dimensions = count;
+    for (int i = 0; i < count; i++) {
+        bounds[i].lBound = lBounds[i];
+        bounds[i].uBound = uBounds[i];
+    }
+}
+
+static KnownArray* findKnownArray(ObjString* name) {
+    for (int i = 0; i < knownArrayCount; i++) {
+        if (knownArrays[i].name == name) return &knownArrays[i];
+    }
+    return NULL;
+}
+
+// declared again with other bounds, code compiled before that (a function
+// called afterwards) would be wrong - the VM notices (ArrayVariable boundsVersion).
+// After that the name has no known bounds, so the checks are only ever left out
+// for the bounds of the first declaration
+static void declareKnownArray(ObjString* name, int dimensions, int lBounds[], int uBounds[]) {
+    KnownArray* known = findKnownArray(name);
+    if (known == NULL) {
+        if (knownArrayCount == MAX_KNOWN_ARRAYS) return;
+        known = &knownArrays[knownArrayCount++];
+        known->name = name;
+        setBounds(&known->dimensions, known->bounds, dimensions, lBounds, uBounds);
+        return;
+    }
+
+    bool same = known->dimensions == dimensions;
+    for (int i = 0; same && i < dimensions; i++) {
+        same = known->bounds[i].lBound == lBounds[i] && known->bounds[i].uBound == uBounds[i];
+    }
+    if (!same) known->dimensions = 0;
+}
+
 
 // 11/17/25 add support for multiple
 // var x=66, a=33; print a;  print x;
@@ -394,7 +744,7 @@ static void varDeclaration() {
     // this will consume(TOKEN_IDENTIFIER, errorMessage);
     // and we need it to set up a array version if this is an array!
     OpCode vmDefineOpcode = OP_DEFINE_GLOBAL;
-    uint8_t varNameSlot = parseVariable("Expect variable name."); // gets us a slot for the constant name for this var
+    int varNameSlot = parseVariable("Expect variable name."); // gets us a slot for the constant name for this var
     int dimensions = 0;
     int lBounds[MAXARRAYDIMENSIONS], uBounds[MAXARRAYDIMENSIONS];
 
@@ -465,12 +815,25 @@ static void varDeclaration() {
     if (vmDefineOpcode == OP_DEFINE_GLOBAL_ARRAY) {
         int varCount = calculateArraySize(dimensions, lBounds, uBounds);
 
+        // in a function or block the array is local - the slot the nil went in gets
+        // it, and the array goes when the block ends or the function returns
+        if (current->scopeDepth > 0) {
+            Local* local = &current->locals[current->localCount - 1];
+            local->isArray = true;
+            setBounds(&local->arrayDimensions, local->arrayBounds, dimensions, lBounds, uBounds);
+            emitByte(OP_DEFINE_LOCAL_ARRAY);
+            emitShort(varNameSlot);
+        }
+        else {
+            declareKnownArray(AS_STRING(currentChunk()->constants.values[varNameSlot]), dimensions, lBounds, uBounds);
+        }
+
         emitByte(dimensions); // provide the runtime with the # subscripts
-        emitShort(varCount);  // provide the runtime with count of Values needed 
+        emitInt(varCount);  // provide the runtime with count of Values needed 
         
         for (int i = 0; i < dimensions; i++) {
-            emitShort(lBounds[i]);
-            emitShort(uBounds[i]);
+            emitInt(lBounds[i]);
+            emitInt(uBounds[i]);
         }
 
         // TODO 11/21/25 - the bytecode should be self-sufficient
@@ -479,8 +842,9 @@ static void varDeclaration() {
         // bytecode
         //  OP_DEFINE_GLOBAL_ARRAY
         //  # subscripts
-        //  2 byte short lowbound 1
-        //  2 byte short upbound 1
+        //  4 byte var count
+        //  4 byte int lowbound 1
+        //  4 byte int upbound 1
         // repeat for additional subscripts
         //  then next opCode
     }
@@ -537,12 +901,10 @@ static void ifStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); // [paren]
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int thenJump = emitConditionJump();  // pops the condition either way
     statement();  // THEN branch
     int elseJump = emitJump(OP_JUMP);
     patchJump(thenJump);
-    emitByte(OP_POP);
 
     if (match(TOKEN_ELSE)) statement(); // ELSE branch
     patchJump(elseJump);
@@ -566,18 +928,200 @@ static void ifStatement() {
 
 // added ch 23 pg 422
 static void whileStatement() {
-    int loopStart = currentChunk()->count;  // The bytecode location of the while condition
+    int loopStart = markJumpTarget();  // The bytecode location of the while condition
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int exitJump = emitConditionJump();
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    emitByte(OP_POP);
+}
+
+// Bounds-check elimination
+// for (var i = 1; i <= 10; i = i + 1) a(i) = ... with a declared a(10) - the
+// compiler knows every i the body sees, so a(i), a(i + 1), a(i - 1) and a(3)
+// whose values all fall in the bounds get OP_GET/SET_ARRAY_UNCHECKED.
+// Only for loops like that are counted: a var initialized with an integer, a
+// compare against a constant and i = i + step (or - step) with an integer step
+// going the way the compare lets it.  If the body assigns i after all, the
+// unchecked ops that relied on it are turned back into checked ones.
+
+// a subscript - the loop variable in slot plus constant, or (slot -1) just the constant
+typedef struct {
+    int slot;
+    double constant;
+} SubscriptForm;
+
+static bool integerConstant(Chunk* chunk, int offset, double* value) {
+    if (chunk->code[offset] != OP_CONSTANT && chunk->code[offset] != OP_CONSTANT_LONG) return false;
+    Value v = chunk->constants.values[constantIndex(chunk, offset)];
+    if (!IS_NUMBER(v) || AS_NUMBER(v) != floor(AS_NUMBER(v))) return false;
+    *value = AS_NUMBER(v);
+    return true;
+}
+
+// the subscript compiled from start - fused when its OP_GET_LOCAL was made into
+// the OP_GET_LOCAL2 of the variable before it, so only the slot byte is at start
+static bool subscriptForm(int start, bool fused, SubscriptForm* form) {
+    Chunk* chunk = currentChunk();
+    int at = start;
+    int end = chunk->count;
+    form->slot = -1;
+    form->constant = 0;
+
+    if (fused) {
+        form->slot = chunk->code[at++];
+    }
+    else if (at + 2 <= end && chunk->code[at] == OP_GET_LOCAL) {
+        form->slot = chunk->code[at + 1];
+        at += 2;
+    }
+    if (at == end) return form->slot != -1;
+
+    if (form->slot != -1 && chunk->code[at] == OP_ADD_CONST) {
+        Value v = chunk->constants.values[chunk->code[at + 1]];
+        form->constant = IS_NUMBER(v) ? AS_NUMBER(v) : 0.5;
+        return at + 2 == end && form->constant == floor(form->constant);
+    }
+    if (!integerConstant(chunk, at, &form->constant)) return false;
+    at += constantLoadLength(chunk->code[at]);
+    if (form->slot == -1) return at == end;
+
+    // i + k with a constant too big for OP_ADD_CONST, or i - k
+    if (at + 1 != end) return false;
+    if (chunk->code[at] == OP_SUBTRACT) form->constant = -form->constant;
+    else if (chunk->code[at] != OP_ADD) return false;
+    return true;
+}
+
+// the condition compiled from start is i against a constant - the last value
+// (or first, going down) i can have in the body.  <= is OP_GREATER, OP_NOT
+static bool loopLimit(int start, int slot, bool* upward, double* limit) {
+    Chunk* chunk = currentChunk();
+    uint8_t* code = chunk->code;
+    int end = chunk->count;
+    if (start + 2 > end || code[start] != OP_GET_LOCAL || code[start + 1] != slot) return false;
+
+    int at = start + 2;
+    if (at == end || (code[at] != OP_CONSTANT && code[at] != OP_CONSTANT_LONG)) return false;
+    Value v = chunk->constants.values[constantIndex(chunk, at)];
+    if (!IS_NUMBER(v)) return false;
+    double b = AS_NUMBER(v);
+    at += constantLoadLength(code[at]);
+
+    bool negated = at + 2 == end && code[at + 1] == OP_NOT;
+    if (at + 1 != end && !negated) return false;
+    switch (code[at]) {
+        case OP_LESS:    *upward = !negated; *limit = negated ? ceil(b) : ceil(b) - 1; break;    // i < b, i >= b
+        case OP_GREATER: *upward = negated;  *limit = negated ? floor(b) : floor(b) + 1; break;  // i <= b, i > b
+        default:         return false;
+    }
+    return true;
+}
+
+// the increment compiled from start is i = i + step or i = i - step
+static bool loopStep(int start, int slot, double* step) {
+    Chunk* chunk = currentChunk();
+    uint8_t* code = chunk->code;
+    int end = chunk->count;
+    if (end < start + 6 || code[start] != OP_GET_LOCAL || code[start + 1] != slot) return false;
+    if (code[end - 2] != OP_SET_LOCAL || code[end - 1] != slot) return false;
+
+    int at = start + 2;
+    if (code[at] == OP_ADD_CONST) {
+        Value v = chunk->constants.values[code[at + 1]];
+        if (!IS_NUMBER(v) || AS_NUMBER(v) != floor(AS_NUMBER(v))) return false;
+        *step = AS_NUMBER(v);
+        return at + 2 == end - 2;
+    }
+    if (!integerConstant(chunk, at, step)) return false;
+    at += constantLoadLength(code[at]);
+    if (at + 1 != end - 2) return false;
+    if (code[at] == OP_SUBTRACT) *step = -*step;
+    else if (code[at] != OP_ADD) return false;
+    return true;
+}
+
+// the body of a counted loop is being compiled
+static void beginCountedLoop(int slot, double min, double max) {
+    CountedLoop* loop = &current->loops[current->loopCount++];
+    loop->slot = slot;
+    loop->min = min;
+    loop->max = max;
+}
+
+// the unchecked ops that only relied on the loop ending here are for good
+static void endCountedLoop() {
+    int bit = 1 << --current->loopCount;
+    int kept = 0;
+    for (int i = 0; i < current->uncheckedCount; i++) {
+        int loops = current->uncheckedLoops[i] & ~bit;
+        if (loops == 0) continue;
+        current->uncheckedOffsets[kept] = current->uncheckedOffsets[i];
+        current->uncheckedLoops[kept++] = loops;
+    }
+    current->uncheckedCount = kept;
+}
+
+// an OP_SET_LOCAL to slot - if it is the variable of a loop the code is in,
+// what that loop's body was going to count on is gone
+static void loopVariableAssigned(int slot) {
+    for (int k = 0; k < current->loopCount; k++) {
+        if (current->loops[k].slot != slot) continue;
+        current->loops[k].slot = -1;
+        for (int i = 0; i < current->uncheckedCount; i++) {
+            if (!(current->uncheckedLoops[i] & (1 << k))) continue;
+            uint8_t* op = &currentChunk()->code[current->uncheckedOffsets[i]];
+            *op = *op == OP_GET_ARRAY_UNCHECKED ? OP_GET_GLOBAL_ARRAY : OP_SET_GLOBAL_ARRAY;
+        }
+    }
+}
+
+// the array arg (see ARRAY_LOCAL) with the subscripts in forms - true if they
+// are in its bounds for all the values the loops give them, and which loops
+// that depends on
+static bool subscriptsInBounds(Token* name, int arg, int numArraySubscripts, SubscriptForm forms[], int* loops) {
+    int dimensions;
+    ArrayBound* bounds;
+    if (arg & ARRAY_LOCAL) {
+        Local* local = &current->locals[arg & ~ARRAY_LOCAL];
+        if (!local->isArray) return false;  // a slice passed in
+        dimensions = local->arrayDimensions;
+        bounds = local->arrayBounds;
+    }
+    else {
+        KnownArray* known = findKnownArray(copyString(name->start, name->length));
+        if (known == NULL) return false;
+        dimensions = known->dimensions;
+        bounds = known->bounds;
+    }
+    if (dimensions != numArraySubscripts) return false;
+
+    *loops = 0;
+    for (int i = 0; i < numArraySubscripts; i++) {
+        double lo = forms[i].constant;
+        double hi = forms[i].constant;
+        if (forms[i].slot != -1) {
+            int k = current->loopCount - 1;
+            while (k >= 0 && current->loops[k].slot != forms[i].slot) k--;
+            if (k < 0) return false;
+            lo += current->loops[k].min;
+            hi += current->loops[k].max;
+            *loops |= 1 << k;
+        }
+        if (!(lo >= bounds[i].lBound && hi <= bounds[i].uBound)) return false;
+    }
+    return *loops == 0 || current->uncheckedCount < MAX_UNCHECKED_SITES;
+}
+
+// the unchecked op just emitted at offset
+static void noteUnchecked(int offset, int loops) {
+    if (loops == 0) return;  // all constant subscripts - nothing can change that
+    current->uncheckedOffsets[current->uncheckedCount] = offset;
+    current->uncheckedLoops[current->uncheckedCount++] = loops;
 }
 
 // added ch 23.4 pg 425
@@ -597,17 +1141,26 @@ static void forStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
     // Handle initializer
+    // var i = integer - could be a counted loop (see Bounds-check elimination)
+    int loopSlot = -1;
+    double first = 0, limit = 0, step = 0;
+    bool upward = false;
     if (match(TOKEN_SEMICOLON)) {
         // No initializer.
     }
     else if (match(TOKEN_VAR)) {
         varDeclaration();
+        Value value;
+        if (constantOperand(0, &value) && IS_NUMBER(value) && AS_NUMBER(value) == floor(AS_NUMBER(value))) {
+            loopSlot = current->localCount - 1;
+            first = AS_NUMBER(value);
+        }
     }
     else {
         expressionStatement();  // will consume the semicolon after initializer
     }
  
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
 
     // Next is the condition
     int exitJump = -1;
@@ -615,10 +1168,10 @@ static void forStatement() {
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        if (loopSlot != -1 && !loopLimit(loopStart, loopSlot, &upward, &limit)) loopSlot = -1;
 
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP); // Condition.
+        exitJump = emitConditionJump(); // pops the condition
     }
 
     // increment clause
@@ -626,8 +1179,9 @@ static void forStatement() {
     // it runs after the loop, but is injected above the body
     if (!match(TOKEN_RIGHT_PAREN)) {
         int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
+        int incrementStart = markJumpTarget();
         expression();
+        if (exitJump == -1 || !loopStep(incrementStart, loopSlot, &step)) loopSlot = -1;
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
@@ -637,14 +1191,18 @@ static void forStatement() {
     }
     //< for-increment
 
+    // going up to the limit or down to it - anything else isn't counted
+    bool counted = loopSlot != -1 && current->loopCount < MAX_COUNTED_LOOPS &&
+        ((upward && step > 0) || (!upward && step < 0));
+    if (counted) beginCountedLoop(loopSlot, upward ? first : limit, upward ? limit : first);
     statement();
+    if (counted) endCountedLoop();
     emitLoop(loopStart);
 
     // if there is a condition clause, patch - pg 436
     // if not, there is no jump to patch and no condition to pop
     if (exitJump != -1) {
         patchJump(exitJump);
-        emitByte(OP_POP); // Condition.
     }
 
     endScope();
@@ -676,7 +1234,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constantSlotForVarName = parseVariable("Expect parameter name.");
+            int constantSlotForVarName = parseVariable("Expect parameter name.");
             defineVariable(OP_DEFINE_GLOBAL, constantSlotForVarName);
         } while (match(TOKEN_COMMA));
     }
@@ -686,7 +1244,7 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
+    emitConstantIndex(makeConstant(OBJ_VAL(function)));
     //if (globalFunctionCount < MAX_GLOBAL_FUNCTIONS) {
     //    globalFunctions[globalFunctionCount++].name = function->name;
     //}
@@ -699,7 +1257,7 @@ static void function(FunctionType type) {
 
 // added in 24.4 pg 446
 static void funDeclaration() {
-    uint8_t constantsSlotForFunName = parseVariable("Expect function name.");
+    int constantsSlotForFunName = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(OP_DEFINE_GLOBAL, constantsSlotForFunName);
@@ -814,20 +1372,31 @@ static void binary(bool canAssign) {
     printf("in binary. Operator type=%d \n", operatorType);
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
+    if (foldBinary(operatorType) || simplifyBinary(operatorType)) return;
     switch (operatorType) {
         /* new in 18.4.2 page 338*/
-        case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
+        case TOKEN_BANG_EQUAL:    emitByte(OP_NOT_EQUAL); break;  // superinstruction for OP_EQUAL, OP_NOT
         case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
+        case TOKEN_GREATER:       noteInstruction(OP_GREATER); emitByte(OP_GREATER); break;
         case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
+        case TOKEN_LESS:          noteInstruction(OP_LESS); emitByte(OP_LESS); break;
         case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
 
-        case TOKEN_PLUS:          emitByte(OP_ADD);  printf("in binary: emitted ADD opcode\n"); break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
-        case TOKEN_RANDOM:        emitByte(OP_RANDOM); break;
+        case TOKEN_PLUS:
+            if (canFuse(OP_CONSTANT, 2)) {
+                // x + constant - turn the OP_CONSTANT into OP_ADD_CONST
+                currentChunk()->code[current->lastOpOffset] = OP_ADD_CONST;
+                current->lastOp = OP_INVALID;
+            }
+            else {
+                emitByte(OP_ADD);
+            }
+            printf("in binary: emitted ADD opcode\n");
+            break;
+        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); noteNumeric(); break;
+        case TOKEN_STAR:          emitByte(OP_MULTIPLY); noteNumeric(); break;
+        case TOKEN_SLASH:         emitByte(OP_DIVIDE); noteNumeric(); break;
+        case TOKEN_RANDOM:        emitByte(OP_RANDOM); noteNumeric(); break;
         default: return; // Unreachable.
     }
 }
@@ -840,6 +1409,7 @@ static void call(bool canAssign) {
 
 // new for ch18 - to handle false, true, nil tokens
 static void literal(bool canAssign) {
+    noteConstant();
     switch (parser.previous.type) {
         case TOKEN_FALSE: emitByte(OP_FALSE); break;
         case TOKEN_NIL: emitByte(OP_NIL); break;
@@ -940,47 +1510,241 @@ static void string(bool canAssign) {
 //    }
 //}
 
+// locals are 1 byte, global slots and names 2
+// the name based global ops are followed by the index of their inline cache
+static void emitVariableOp(OpCode op, int arg) {
+    if (op == OP_GET_LOCAL || op == OP_SET_LOCAL) {
+        emitBytes(op, (uint8_t)arg);
+    }
+    else if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+        int cache = addGlobalCache(currentChunk());
+        if (cache > UINT16_MAX) {
+            error("Too many global variable references in one function.");
+        }
+        emitByte(op);
+        emitShort(arg);
+        emitShort(cache);
+    }
+    else {
+        emitByte(op);
+        emitShort(arg);
+    }
+}
+
+// one operand of a bulk kernel at *offset - b(*) (all the subscripts *)
+// or a constant load.  The longest is a * per subscript and OP_GET_CROSS_SECTION,
+// and the longest right hand side two of them and the operator
+#define KERNEL_OPERAND_MAX  (2 * MAXARRAYDIMENSIONS + 4)
+#define KERNEL_RHS_MAX      (2 * KERNEL_OPERAND_MAX + 1)
+
+static bool kernelOperand(int* offset, uint16_t* index, int* stars) {
+    Chunk* chunk = currentChunk();
+    int at = *offset;
+    *stars = 0;
+    while (at + 2 <= chunk->count && chunk->code[at] == OP_CONSTANT &&
+        IS_ARRAY_STAR(chunk->constants.values[chunk->code[at + 1]])) {
+        (*stars)++;
+        at += 2;
+    }
+    if (*stars > 0) {
+        if (at + 4 > chunk->count || chunk->code[at] != OP_GET_CROSS_SECTION || chunk->code[at + 3] != *stars) return false;
+        *index = (uint16_t)((chunk->code[at + 1] << 8) | chunk->code[at + 2]);
+        *offset = at + 4;
+        return true;
+    }
+    if (at + 2 > chunk->count || chunk->code[at] != OP_CONSTANT) return false;
+    *index = chunk->code[at + 1];
+    *offset = at + 2;
+    return true;
+}
+
+// the kernel byte of OP_ARRAY_KERNEL if the right hand side from loopStart
+// is one of the forms in arraykernel.h, -1 if it isn't
+static int arrayKernelFor(int loopStart, uint16_t* b, uint16_t* c) {
+    Chunk* chunk = currentChunk();
+    int offset = loopStart;
+    int bStars, cStars = 0;
+    // crossSectionAssignment() moves it through a KERNEL_RHS_MAX buffer - and
+    // anything longer is not one of the forms anyway (too many subscripts)
+    if (chunk->count - loopStart > KERNEL_RHS_MAX) return -1;
+    if (!kernelOperand(&offset, b, &bStars)) return -1;
+    *c = 0;
+    if (offset == chunk->count) return KERNEL_BYTE(bStars > 0 ? KERNEL_COPY : KERNEL_FILL, bStars, 0);
+
+    KernelOp op;
+    if (chunk->code[offset] == OP_ADD_CONST && offset + 2 == chunk->count) {
+        // b(*) + constant - binary() fused the constant into the add
+        *c = chunk->code[offset + 1];
+        op = KERNEL_ADD;
+    }
+    else {
+        if (!kernelOperand(&offset, c, &cStars) || offset + 1 != chunk->count) return -1;
+        switch (chunk->code[offset]) {
+            case OP_ADD:      op = KERNEL_ADD; break;
+            case OP_SUBTRACT: op = KERNEL_SUBTRACT; break;
+            case OP_MULTIPLY: op = KERNEL_MULTIPLY; break;
+            case OP_DIVIDE:   op = KERNEL_DIVIDE; break;
+            default:          return -1;
+        }
+    }
+    // the arithmetic is only for numbers - "ab" + b(*) is left to the loop
+    if (bStars == 0 && !IS_NUMBER(chunk->constants.values[*b])) return -1;
+    if (cStars == 0 && !IS_NUMBER(chunk->constants.values[*c])) return -1;
+    return KERNEL_BYTE(op, bStars, cStars);
+}
+
+// a(*) = expr - every element gets its own value of the right hand side
+// (a(*) = 1?100 is a different random number in each one), so it is
+// compiled as a loop around the right hand side:
+//
+//    subscripts                 * is ARRAY_STAR
+//    OP_CROSS_SECTION name      checks them, pushes the array and a cursor
+//    [OP_ARRAY_KERNEL]          for the forms in arraykernel.h - does all of
+//                               it in one go and jumps over the loop if it can
+//  loop:
+//    right hand side            b(*) is OP_GET_CROSS_SECTION, the element of b
+//                               the cursor is on
+//    OP_SET_CROSS_SECTION       stores it in the element the cursor is on,
+//                               moves the cursor and goes back to loop until
+//                               all are done, then leaves the last value
+static void crossSectionAssignment(int name, int numArraySubscripts) {
+    emitByte(OP_CROSS_SECTION);
+    emitShort(name);
+    emitByte((uint8_t)numArraySubscripts);
+
+    int loopStart = markJumpTarget();
+    current->crossSectionDepth++;
+    expression();
+    current->crossSectionDepth--;
+
+    uint16_t b, c;
+    int kernel = arrayKernelFor(loopStart, &b, &c);
+    if (kernel != -1) {
+        // the kernel goes in front of the loop - take the right hand side out and put it back after
+        Chunk* chunk = currentChunk();
+        uint8_t rhs[KERNEL_RHS_MAX];
+        int length = chunk->count - loopStart;
+        memcpy(rhs, chunk->code + loopStart, length);
+        chunk->count = loopStart;
+
+        emitByte(OP_ARRAY_KERNEL);
+        emitShort(length + 4);  // over the loop
+        emitByte((uint8_t)kernel);
+        emitShort(b);
+        emitShort(c);
+
+        loopStart = markJumpTarget();
+        for (int i = 0; i < length; i++) emitByte(rhs[i]);
+        current->lastOp = OP_INVALID;
+    }
+
+    int offset = currentChunk()->count - loopStart + 4;
+    if (offset > UINT16_MAX) error("Cross section right hand side too large.");
+    emitByte(OP_SET_CROSS_SECTION);
+    emitShort(offset);
+    emitByte((uint8_t)numArraySubscripts);
+}
+
 // for assignment logic - ch 22.4 pg 407 local vars
-static void namedVariable(Token name, bool canAssign, int numArraySubscripts) {
+// crossSection - one of the array subscripts is * or a range
+// forms - what the subscripts are, if they could be bounds checked here (NULL if not)
+static void namedVariable(Token name, bool canAssign, int numArraySubscripts, bool crossSection, SubscriptForm forms[]) {
     OpCode getOp, setOp;
     int arg = -1;
     if (numArraySubscripts != 0) {
-        // TODO lookup the array definition to set arg
-        arg = identifierConstant(&name);
+        // a global is an array or a variable holding a slice, a local is an array or a slice
+        arg = resolveLocal(current, &name);
+        if (arg != -1) {
+            arg |= ARRAY_LOCAL;
+        }
+        else {
+            arg = identifierConstant(&name);
+            if (arg >= ARRAY_LOCAL) error("Too many global names in one chunk.");
+        }
         getOp = OP_GET_GLOBAL_ARRAY;
         setOp = OP_SET_GLOBAL_ARRAY;
 
     }
     else {
         arg = resolveLocal(current, &name);
+        if (arg != -1 && current->locals[arg].isArray) {
+            error("An array needs subscripts - a(*) is all of it.");
+        }
         if (arg != -1) {
             getOp = OP_GET_LOCAL;
             setOp = OP_SET_LOCAL;
         }
         else {
+#ifdef GLOBAL_SLOTS
+            arg = resolveGlobal(copyString(name.start, name.length));
+            getOp = OP_GET_GLOBAL_SLOT;
+            setOp = OP_SET_GLOBAL_SLOT;
+#else
             arg = identifierConstant(&name);
             getOp = OP_GET_GLOBAL;
             setOp = OP_SET_GLOBAL;
+#endif
         }
     }
 
     if (canAssign && match(TOKEN_EQUAL)) { //pg 408
-        uint8_t bytecode_start_rhs_ip = current->function->chunk.count;  // save off the start of the assignment
-        printf("ip (bytecode offset) for start of the rhs is %d\n", current->function->chunk.count);
+        if (crossSection) {
+            crossSectionAssignment(arg, numArraySubscripts);
+            return;
+        }
         expression(); // This is the RH side of the assignment
-        emitBytes(setOp, (uint8_t)arg);
-        if (setOp == OP_SET_GLOBAL_ARRAY) {
-            // put the ip of the opcode that starts the RHS into the bytecode
-            emitByte((uint8_t)bytecode_start_rhs_ip);
+        int loops;
+        if (setOp == OP_SET_LOCAL) {
+            loopVariableAssigned(arg);
+        }
+        else if (forms != NULL && subscriptsInBounds(&name, arg, numArraySubscripts, forms, &loops)) {
+            setOp = OP_SET_ARRAY_UNCHECKED;
+            noteUnchecked(currentChunk()->count, loops);
         }
+        emitVariableOp(setOp, arg);
+    }
+    else if (crossSection) {
+        // b(*) in a(*) = ... is the element of b the loop is on,
+        // anywhere else b(*) or b(2:5) is a slice - a view of b
+        emitByte(current->crossSectionDepth > 0 ? OP_GET_CROSS_SECTION : OP_SLICE);
+        emitShort(arg);
+    }
+    else if (getOp == OP_GET_LOCAL) {
+        emitGetLocal((uint8_t)arg);
     }
     else {
-        emitBytes(getOp, (uint8_t)arg);
+        int loops;
+        if (forms != NULL && subscriptsInBounds(&name, arg, numArraySubscripts, forms, &loops)) {
+            getOp = OP_GET_ARRAY_UNCHECKED;
+            noteUnchecked(currentChunk()->count, loops);
+        }
+        emitVariableOp(getOp, arg);
     }
 
     if (numArraySubscripts != 0) { // TODO  must always have subscripts for OP_GET_GLOBAL_ARRAY! assert this!
         emitByte((uint8_t)numArraySubscripts);
     }
+    if (numArraySubscripts != 0 && !crossSection) {
+        // an element op - the cache finds a global array without a lookup (a local doesn't need one)
+        int cache = (arg & ARRAY_LOCAL) ? 0 : addGlobalCache(currentChunk());
+        if (cache > UINT16_MAX) {
+            error("Too many global variable references in one function.");
+        }
+        emitShort(cache);
+    }
+}
+
+// lo:hi - a constant when both ends are
+static void rangeSubscript() {
+    Value lo, hi;
+    if (constantOperand(1, &lo) && constantOperand(0, &hi) && IS_NUMBER(lo) && IS_NUMBER(hi) &&
+        AS_NUMBER(lo) >= RANGE_MIN && AS_NUMBER(lo) <= RANGE_MAX &&
+        AS_NUMBER(hi) >= RANGE_MIN && AS_NUMBER(hi) <= RANGE_MAX) {
+        dropConstants(2);
+        emitConstant(RANGE_VAL((int)AS_NUMBER(lo), (int)AS_NUMBER(hi)));
+        return;
+    }
+    emitByte(OP_RANGE);
 }
 
 // added in Ch 21.3 pg 391; canAssign added on pg 395
@@ -1003,6 +1767,9 @@ static void variable(bool canAssign) {
 
     
     bool varIsFunction = false;
+    bool crossSection = false;
+    SubscriptForm forms[MAXARRAYDIMENSIONS];
+    bool formsKnown = true;
 
     if (variableToken.length == 5 && memcmp("clock", variableToken.start, 5) == 0) {
         varIsFunction = true;
@@ -1030,24 +1797,32 @@ static void variable(bool canAssign) {
             // the subscript can be an integer (negative is allowed)
             // or any expression that yields an integer
             // 
-            // Cross sectioning - need to generalize this 
-            // Instead of the kludge workaround, emit a for loop for cross sectioning
-            // 
-            // 
+            // Cross sectioning - an assignment to a(*) is compiled as a loop,
+            // see crossSectionAssignment()
             // 
             // or the special case of a '*' which means all array elements
             //   .e.g. A(*) or B(*,*) or MATRIX(5,*) etc.
             ///  B(*) = .N will set the values to 1,2,3,4,5 in the array
+            //
+            // or a range - A(1:N), or A(3:1) for A(3) then A(2) then A(1)
             
             if (match(TOKEN_STAR)) {
                 emitConstant(ARRAY_STAR_VAL);  
-            }
-            else if (match(TOKEN_COLON)) {
-                // e.g. A(1:N)
-                error("Not implemented yet - support for A(1:3) or even A(3:1) for A(3) then A(2) then A(1). Sorry.");
+                crossSection = true;
             }
             else {
+                int start = currentChunk()->count;
+                bool fusable = canFuse(OP_GET_LOCAL, 2);
                 expression();
+                if (match(TOKEN_COLON)) {
+                    expression();
+                    rangeSubscript();
+                    crossSection = true;
+                }
+                else if (formsKnown && numArraySubscripts <= MAXARRAYDIMENSIONS) {
+                    bool fused = fusable && currentChunk()->code[start - 2] == OP_GET_LOCAL2;
+                    formsKnown = subscriptForm(start, fused, &forms[numArraySubscripts - 1]);
+                }
             }
             
 
@@ -1060,7 +1835,8 @@ static void variable(bool canAssign) {
     }
     
 
-    namedVariable(variableToken, canAssign, numArraySubscripts);
+    namedVariable(variableToken, canAssign, numArraySubscripts, crossSection,
+        numArraySubscripts > 0 && numArraySubscripts <= MAXARRAYDIMENSIONS && formsKnown && !crossSection ? forms : NULL);
    
 }
 
@@ -1070,10 +1846,23 @@ static void unary(bool canAssign) {
     printf("in unary. Operator type=%d \n", operatorType);
     
     parsePrecedence(PREC_UNARY); 
+
+    // -3 and !true are constants too
+    Value operand;
+    if (constantOperand(0, &operand) && (operatorType == TOKEN_BANG || IS_NUMBER(operand))) {
+        dropConstants(1);
+        if (operatorType == TOKEN_BANG) {
+            emitFolded(BOOL_VAL(IS_NIL(operand) || (IS_BOOL(operand) && !AS_BOOL(operand))));
+        }
+        else {
+            emitFolded(NUMBER_VAL(-AS_NUMBER(operand)));
+        }
+        return;
+    }
     
     switch (operatorType) {
         case TOKEN_BANG: emitByte(OP_NOT); break;  // ch 18.4.1 pg 336
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_MINUS: emitByte(OP_NEGATE); noteNumeric(); break;
         default: return; // Unreachable.
     }
 }
@@ -1109,12 +1898,28 @@ static void parsePrecedence(Precedence precedence) {
 }
 
 
+// Garbage Collection Ch 26.2.2 - the functions being compiled (and so their
+// constants) and the names the compiler keeps to the side
+void markCompilerRoots() {
+    for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+        markObject((Obj*)compiler->function);
+        markTable(&compiler->names);
+    }
+    for (int i = 0; i < MAX_GLOBAL_FUNCTIONS; i++) {
+        markObject((Obj*)globalFunctions[i].name);
+    }
+    for (int i = 0; i < knownArrayCount; i++) {
+        markObject((Obj*)knownArrays[i].name);
+    }
+}
+
 //void compile(const char* source) {
 // bool compile(const char* source, Chunk * chunk) { prior to ch 24
 ObjFunction* compile(const char* source) {
 	initScanner(source);
 
     globalFunctionCount = 0;
+    knownArrayCount = 0;
     for (int i = 0; i < MAX_GLOBAL_FUNCTIONS; i++) {
         globalFunctions[i].name = NULL;
     }
@@ -20,6 +20,20 @@ typedef enum {
     TYPE_SCRIPT  // a dummy function used for the main program logic
 } FunctionType;
 
+// constants in a row the folder keeps track of - 1 + 2 * (3 - 4) needs 4
+#define FOLD_DEPTH 16
+
+// for (var i = first; i < limit; i = i + step) with constants - the values
+// i takes in the body, so a(i), a(i + 1) ... can skip the bounds check
+typedef struct {
+    int slot;       // the loop variable, -1 once the body assigns it
+    double min;
+    double max;
+} CountedLoop;
+
+#define MAX_COUNTED_LOOPS   8
+#define MAX_UNCHECKED_SITES 256
+
 typedef struct Compiler {
     struct Compiler* enclosing;  // linked list added Ch 24.4.1 pg 448
     ObjFunction* function;
@@ -28,6 +42,29 @@ typedef struct Compiler {
     Local locals[UINT8_COUNT];
     int localCount;  // count of locals in scope
     int scopeDepth;
+
+    // for fusing superinstructions - last fusable instruction emitted and where
+    OpCode lastOp;
+    int lastOpOffset;
+    int lastJumpTarget;  // bytecode offset that some jump lands on - never fuse across it
+
+    // for constant folding - where the constant loads (OP_CONSTANT, OP_NIL,
+    // OP_TRUE, OP_FALSE) at the end of the code start, one right after the other
+    int constantOffsets[FOLD_DEPTH];
+    int constantCount;
+    int numericEnd;      // the code up to here leaves a number on the stack (arithmetic result), -1 if not known
+
+    Table names;         // name constants already in the pool -> their index, so each name is added once
+    int crossSectionDepth;  // > 0 in the right hand side of a(*) = ..., where b(*) can be read
+
+    // bounds-check elimination - the counted loops the code is in, and the
+    // unchecked array accesses that rely on them (set back to checked ones
+    // if the body turns out to assign the loop variable)
+    CountedLoop loops[MAX_COUNTED_LOOPS];
+    int loopCount;
+    int uncheckedOffsets[MAX_UNCHECKED_SITES];
+    int uncheckedLoops[MAX_UNCHECKED_SITES];  // bit per loops[] entry
+    int uncheckedCount;
     // LLM Upvalue upvalues[UINT8_COUNT]; // Closures upvalues-array
 } Compiler;
 
@@ -39,5 +76,5 @@ typedef struct {
 } Parser;
 
 //> Garbage Collection mark-compiler-roots-h
-//void markCompilerRoots();
+void markCompilerRoots();
 #endif
\ No newline at end of file
@@ -3,6 +3,9 @@
 
 #include "debug.h"
 #include "value.h"
+#include "regvm.h"
+#include "vm.h"
+#include "arraykernel.h"
 
 #define READ_SHORT() \
     (frame->ip += 2, \
@@ -12,6 +15,101 @@
     (offset += 2, \
     (uint16_t)((chunk->code[offset-2] << 8) | chunk->code[offset-1]))
 
+#define DEBUG_READ_INT() \
+    (offset += 4, \
+    (int)(((uint32_t)chunk->code[offset-4] << 24) | (chunk->code[offset-3] << 16) | \
+    (chunk->code[offset-2] << 8) | chunk->code[offset-1]))
+
+// opcode names indexed by OpCode - for the opcode profiler
+// the disassembler below keeps its own names since it also decodes operands
+static const char* opcodeNames[] = {
+    [OP_INVALID] = "OP_INVALID",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_GLOBAL_ARRAY] = "OP_GET_GLOBAL_ARRAY",
+    [OP_SET_GLOBAL_ARRAY] = "OP_SET_GLOBAL_ARRAY",
+    [OP_DEFINE_GLOBAL_ARRAY] = "OP_DEFINE_GLOBAL_ARRAY",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_RANDOM] = "OP_RANDOM",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_ADD_MIXED] = "OP_ADD_MIXED",
+    [OP_GET_LOCAL2] = "OP_GET_LOCAL2",
+    [OP_ADD_CONST] = "OP_ADD_CONST",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_LESS_JUMP_IF_FALSE] = "OP_LESS_JUMP_IF_FALSE",
+    [OP_GREATER_JUMP_IF_FALSE] = "OP_GREATER_JUMP_IF_FALSE",
+    [OP_GET_GLOBAL_SLOT] = "OP_GET_GLOBAL_SLOT",
+    [OP_SET_GLOBAL_SLOT] = "OP_SET_GLOBAL_SLOT",
+    [OP_DEFINE_GLOBAL_SLOT] = "OP_DEFINE_GLOBAL_SLOT",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_NOT_LESS] = "OP_NOT_LESS",
+    [OP_NOT_GREATER] = "OP_NOT_GREATER",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_JUMP_LONG] = "OP_JUMP_LONG",
+    [OP_JUMP_IF_FALSE_LONG] = "OP_JUMP_IF_FALSE_LONG",
+    [OP_POP_JUMP_IF_FALSE_LONG] = "OP_POP_JUMP_IF_FALSE_LONG",
+    [OP_LESS_JUMP_IF_FALSE_LONG] = "OP_LESS_JUMP_IF_FALSE_LONG",
+    [OP_GREATER_JUMP_IF_FALSE_LONG] = "OP_GREATER_JUMP_IF_FALSE_LONG",
+    [OP_LOOP_LONG] = "OP_LOOP_LONG",
+    [OP_CROSS_SECTION] = "OP_CROSS_SECTION",
+    [OP_SET_CROSS_SECTION] = "OP_SET_CROSS_SECTION",
+    [OP_GET_CROSS_SECTION] = "OP_GET_CROSS_SECTION",
+    [OP_ARRAY_KERNEL] = "OP_ARRAY_KERNEL",
+    [OP_RANGE] = "OP_RANGE",
+    [OP_SLICE] = "OP_SLICE",
+    [OP_DEFINE_LOCAL_ARRAY] = "OP_DEFINE_LOCAL_ARRAY",
+    [OP_RELEASE_ARRAYS] = "OP_RELEASE_ARRAYS",
+    [OP_GET_ARRAY_UNCHECKED] = "OP_GET_ARRAY_UNCHECKED",
+    [OP_SET_ARRAY_UNCHECKED] = "OP_SET_ARRAY_UNCHECKED",
+};
+
+const char* opcodeName(uint8_t instruction) {
+    if (instruction >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) ||
+        opcodeNames[instruction] == NULL) {
+        return "OP_UNKNOWN";
+    }
+    return opcodeNames[instruction];
+}
+
 // Ch 14.5.3
 // The constant index is in the next byte of bytecode
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
@@ -22,6 +120,24 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2; // next instruction is 2 bytecodes later
 }
 
+// 3 byte constant index
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
+// 2 byte name constant - OP_DEFINE_GLOBAL
+static int nameInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t constant = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk,
     int offset) {
     uint8_t constant = chunk->code[offset + 1];
@@ -46,38 +162,50 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
-static int arrayRefInstruction(const char* name, Chunk* chunk, int offset, bool isSetOperation) {
-    uint8_t constantNameIdx = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constantNameIdx);
-    printValue(chunk->constants.values[constantNameIdx]);
+// the array operand - a global name, or a local slot with ARRAY_LOCAL set
+static void arrayOperand(Chunk* chunk, uint16_t operand) {
+    if (operand & ARRAY_LOCAL) printf("local %d", operand & ~ARRAY_LOCAL);
+    else printValue(chunk->constants.values[operand]);
+}
 
-    if (isSetOperation){
-        uint8_t start_rhs_ip = chunk->code[offset + 2];
-        printf("'  start of RHS ip counter  = % d\n", start_rhs_ip);
-        offset++;
-    }
+// OP_CROSS_SECTION, OP_GET_CROSS_SECTION, OP_SLICE
+static int arrayRefInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t constantNameIdx = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, constantNameIdx & ~ARRAY_LOCAL);
+    arrayOperand(chunk, constantNameIdx);
 
     // uint8_t slot = chunk->code[offset + 1];
-    uint8_t numSubscripts = chunk->code[offset + 2];
+    uint8_t numSubscripts = chunk->code[offset + 3];
     printf("' #subscripts = % d\n", numSubscripts);
-    return offset + 3;
+    return offset + 4;
+}
+
+// OP_GET_GLOBAL_ARRAY, OP_SET_GLOBAL_ARRAY and unchecked - with the inline cache
+static int arrayElementInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t constantNameIdx = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, constantNameIdx & ~ARRAY_LOCAL);
+    arrayOperand(chunk, constantNameIdx);
+    uint8_t numSubscripts = chunk->code[offset + 3];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 4] << 8) | chunk->code[offset + 5]);
+    printf("' #subscripts = % d cache %d\n", numSubscripts, cache);
+    return offset + 6;
 }
 
 static int arrayDefInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constantNameIdx = chunk->code[offset + 1];
+    uint16_t constantNameIdx = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
     printf("%-16s %4d '", name, constantNameIdx);
     printValue(chunk->constants.values[constantNameIdx]);
 
     // uint8_t slot = chunk->code[offset + 1];
-    uint8_t numSubscripts = chunk->code[offset + 2];
-    offset = offset + 3;
-    short numVars = DEBUG_READ_SHORT();
+    uint8_t numSubscripts = chunk->code[offset + 3];
+    offset = offset + 4;
+    int numVars = DEBUG_READ_INT();
     printf("' #subscripts = %d varCount = %d   indices ", numSubscripts, numVars);
     // offset = offset + 3;
     for (int i = 0; i < numSubscripts; i++) {
         printf(" (");
-        short lBound = DEBUG_READ_SHORT();
-        short uBound = DEBUG_READ_SHORT();
+        int lBound = DEBUG_READ_INT();
+        int uBound = DEBUG_READ_INT();
         //uint8_t lBound = chunk->code[offset + 4 + i *4];
         //uint8_t uBound = chunk->code[offset + 6 + i * 4];
         printf("%d:%d)  ", lBound, uBound);
@@ -90,6 +218,33 @@ static int arrayDefInstruction(const char* name, Chunk* chunk, int offset) {
 
 
 
+// superinstruction with two local slots
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slotA = chunk->code[offset + 1];
+    uint8_t slotB = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, slotA, slotB);
+    return offset + 3;
+}
+
+// global resolved to a slot - 2 byte operand, the name comes from the VM
+static int globalSlotInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, slot);
+    if (slot < vm.globalNames.count) printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
+// 2 byte name constant then the 2 byte inline cache index
+static int cachedGlobalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t constant = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 5;
+}
+
 // Added in Ch 23.2 pg 420
 static int jumpInstruction(const char* name, int sign,
     Chunk* chunk, int offset) {
@@ -100,6 +255,46 @@ static int jumpInstruction(const char* name, int sign,
     return offset + 3;
 }
 
+// back to the start of the right hand side, then the subscript count
+static int setCrossSectionInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d -> %d #subscripts = %d\n", name, offset,
+        offset + 4 - jump, chunk->code[offset + 3]);
+    return offset + 4;
+}
+
+// kernel operands with no * are constants, the others array names
+static void kernelOperand(Chunk* chunk, int stars, int index) {
+    if (stars == 0) printValue(chunk->constants.values[index]);
+    else arrayOperand(chunk, index);
+    for (int i = 0; i < stars; i++) printf(i == 0 ? "(*" : ",*");
+    if (stars > 0) printf(")");
+}
+
+static int arrayKernelInstruction(const char* name, Chunk* chunk, int offset) {
+    static const char* ops[] = { "fill", "copy", "+", "-", "*", "/" };
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    uint8_t kernel = chunk->code[offset + 3];
+    printf("%-16s %4d -> %d %s ", name, offset, offset + 8 + jump, ops[KERNEL_OP(kernel)]);
+    kernelOperand(chunk, KERNEL_B_STARS(kernel), (chunk->code[offset + 4] << 8) | chunk->code[offset + 5]);
+    if (KERNEL_OP(kernel) > KERNEL_COPY) {
+        printf(" ");
+        kernelOperand(chunk, KERNEL_C_STARS(kernel), (chunk->code[offset + 6] << 8) | chunk->code[offset + 7]);
+    }
+    printf("\n");
+    return offset + 8;
+}
+
+// the operand is the index of the distance in chunk->longJumps
+static int longJumpInstruction(const char* name, int sign,
+    Chunk* chunk, int offset) {
+    uint16_t index = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    int jump = chunk->longJumps[index];
+    printf("%-16s %4d -> %d (long %d)\n", name, offset,
+        offset + 3 + sign * jump, index);
+    return offset + 3;
+}
+
 
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
@@ -130,18 +325,45 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_LOCAL:
         return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return cachedGlobalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return nameInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return cachedGlobalInstruction("OP_SET_GLOBAL", chunk, offset);
+    
+    case OP_GET_GLOBAL_SLOT:
+        return globalSlotInstruction("OP_GET_GLOBAL_SLOT", chunk, offset);
+    case OP_SET_GLOBAL_SLOT:
+        return globalSlotInstruction("OP_SET_GLOBAL_SLOT", chunk, offset);
+    case OP_DEFINE_GLOBAL_SLOT:
+        return globalSlotInstruction("OP_DEFINE_GLOBAL_SLOT", chunk, offset);
     
     case OP_GET_GLOBAL_ARRAY:
-        return arrayRefInstruction("OP_GET_GLOBAL_ARRAY", chunk, offset, false);
+        return arrayElementInstruction("OP_GET_GLOBAL_ARRAY", chunk, offset);
     case OP_SET_GLOBAL_ARRAY:
-        return arrayRefInstruction("OP_SET_GLOBAL_ARRAY", chunk, offset, true);
+        return arrayElementInstruction("OP_SET_GLOBAL_ARRAY", chunk, offset);
+    case OP_CROSS_SECTION:
+        return arrayRefInstruction("OP_CROSS_SECTION", chunk, offset);
+    case OP_SET_CROSS_SECTION:
+        return setCrossSectionInstruction("OP_SET_CROSS_SECTION", chunk, offset);
+    case OP_GET_CROSS_SECTION:
+        return arrayRefInstruction("OP_GET_CROSS_SECTION", chunk, offset);
+    case OP_ARRAY_KERNEL:
+        return arrayKernelInstruction("OP_ARRAY_KERNEL", chunk, offset);
+    case OP_RANGE:
+        return simpleInstruction("OP_RANGE", offset);
+    case OP_SLICE:
+        return arrayRefInstruction("OP_SLICE", chunk, offset);
     case OP_DEFINE_GLOBAL_ARRAY:
         return arrayDefInstruction("OP_DEFINE_GLOBAL_ARRAY", chunk, offset);
+    case OP_DEFINE_LOCAL_ARRAY:
+        return arrayDefInstruction("OP_DEFINE_LOCAL_ARRAY", chunk, offset);
+    case OP_RELEASE_ARRAYS:
+        return byteInstruction("OP_RELEASE_ARRAYS", chunk, offset);
+    case OP_GET_ARRAY_UNCHECKED:
+        return arrayElementInstruction("OP_GET_ARRAY_UNCHECKED", chunk, offset);
+    case OP_SET_ARRAY_UNCHECKED:
+        return arrayElementInstruction("OP_SET_ARRAY_UNCHECKED", chunk, offset);
     
     case OP_GET_UPVALUE:
         return byteInstruction("OP_GET_UPVALUE", chunk, offset);
@@ -173,6 +395,36 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         return simpleInstruction("OP_DIVIDE", offset);
     case OP_RANDOM:
         return simpleInstruction("OP_RANDOM", offset);
+    case OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simpleInstruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+        return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_GREATER_NUM:
+        return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+        return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_ADD_MIXED:
+        return simpleInstruction("OP_ADD_MIXED", offset);
+    case OP_GET_LOCAL2:
+        return twoByteInstruction("OP_GET_LOCAL2", chunk, offset);
+    case OP_ADD_CONST:
+        return constantInstruction("OP_ADD_CONST", chunk, offset);
+    case OP_NOT_EQUAL:
+        return simpleInstruction("OP_NOT_EQUAL", offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_LESS_JUMP_IF_FALSE:
+        return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_GREATER_JUMP_IF_FALSE:
+        return jumpInstruction("OP_GREATER_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_NOT_LESS:
+        return simpleInstruction("OP_NOT_LESS", offset);
+    case OP_NOT_GREATER:
+        return simpleInstruction("OP_NOT_GREATER", offset);
         
     case OP_NOT:
         return simpleInstruction("OP_NOT", offset);
@@ -193,6 +445,20 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OP_LOOP:
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_CONSTANT_LONG:
+        return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_JUMP_LONG:
+        return longJumpInstruction("OP_JUMP_LONG", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+        return longJumpInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+    case OP_POP_JUMP_IF_FALSE_LONG:
+        return longJumpInstruction("OP_POP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+    case OP_LESS_JUMP_IF_FALSE_LONG:
+        return longJumpInstruction("OP_LESS_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+    case OP_GREATER_JUMP_IF_FALSE_LONG:
+        return longJumpInstruction("OP_GREATER_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+    case OP_LOOP_LONG:
+        return longJumpInstruction("OP_LOOP_LONG", -1, chunk, offset);
     case OP_CALL:
         return byteInstruction("OP_CALL", chunk, offset);
         //> Methods and Initializers disassemble-invoke
@@ -246,4 +512,106 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     }
 }
 
-#undef DEBUG_READ_SHORT
\ No newline at end of file
+#undef DEBUG_READ_SHORT
+
+// Register code (regvm.h) - constants live in the stack code's chunk
+static int registerInstruction(const char* name, const char* operands, Chunk* chunk,
+    ValueArray* constants, int offset) {
+    printf("%-24s", name);
+    offset++;
+    for (const char* op = operands; *op != '\0'; op++) {
+        switch (*op) {
+        case 'R':
+            printf(" r%d", chunk->code[offset++]);
+            break;
+        case 'K':
+            printf(" '");
+            printValue(constants->values[chunk->code[offset++]]);
+            printf("'");
+            break;
+        case 'G': {
+            uint16_t slot = (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+            offset += 2;
+            printf(" g%d", slot);
+            break;
+        }
+        case 'C': {
+            uint16_t cache = (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+            offset += 2;
+            printf(" cache %d", cache);
+            break;
+        }
+        case 'N':
+            printf(" %d", chunk->code[offset++]);
+            break;
+        case 'J':
+        case 'L': {
+            uint16_t jump = (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+            offset += 2;
+            printf(" -> %d", *op == 'J' ? offset + jump : offset - jump);
+            break;
+        }
+        }
+    }
+    printf("\n");
+    return offset;
+}
+
+static int disassembleRegisterInstruction(Chunk* chunk, ValueArray* constants, int offset) {
+    printf("%04d ", offset);
+    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+        printf("   | ");
+    }
+    else {
+        printf("%4d ", chunk->lines[offset]);
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction) {
+    case R_MOVE:            return registerInstruction("R_MOVE", "RR", chunk, constants, offset);
+    case R_LOADK:           return registerInstruction("R_LOADK", "RK", chunk, constants, offset);
+    case R_LOADNIL:         return registerInstruction("R_LOADNIL", "R", chunk, constants, offset);
+    case R_LOADTRUE:        return registerInstruction("R_LOADTRUE", "R", chunk, constants, offset);
+    case R_LOADFALSE:       return registerInstruction("R_LOADFALSE", "R", chunk, constants, offset);
+    case R_GET_GLOBAL:      return registerInstruction("R_GET_GLOBAL", "RKC", chunk, constants, offset);
+    case R_SET_GLOBAL:      return registerInstruction("R_SET_GLOBAL", "KCR", chunk, constants, offset);
+    case R_DEFINE_GLOBAL:   return registerInstruction("R_DEFINE_GLOBAL", "KR", chunk, constants, offset);
+    case R_GET_GLOBAL_SLOT:     return registerInstruction("R_GET_GLOBAL_SLOT", "RG", chunk, constants, offset);
+    case R_SET_GLOBAL_SLOT:     return registerInstruction("R_SET_GLOBAL_SLOT", "GR", chunk, constants, offset);
+    case R_DEFINE_GLOBAL_SLOT:  return registerInstruction("R_DEFINE_GLOBAL_SLOT", "GR", chunk, constants, offset);
+    case R_ADD:             return registerInstruction("R_ADD", "RRR", chunk, constants, offset);
+    case R_ADDK:            return registerInstruction("R_ADDK", "RRK", chunk, constants, offset);
+    case R_SUBTRACT:        return registerInstruction("R_SUBTRACT", "RRR", chunk, constants, offset);
+    case R_SUBK:            return registerInstruction("R_SUBK", "RRK", chunk, constants, offset);
+    case R_MULTIPLY:        return registerInstruction("R_MULTIPLY", "RRR", chunk, constants, offset);
+    case R_DIVIDE:          return registerInstruction("R_DIVIDE", "RRR", chunk, constants, offset);
+    case R_RANDOM:          return registerInstruction("R_RANDOM", "RRR", chunk, constants, offset);
+    case R_EQUAL:           return registerInstruction("R_EQUAL", "RRR", chunk, constants, offset);
+    case R_NOT_EQUAL:       return registerInstruction("R_NOT_EQUAL", "RRR", chunk, constants, offset);
+    case R_GREATER:         return registerInstruction("R_GREATER", "RRR", chunk, constants, offset);
+    case R_LESS:            return registerInstruction("R_LESS", "RRR", chunk, constants, offset);
+    case R_NOT:             return registerInstruction("R_NOT", "RR", chunk, constants, offset);
+    case R_NEGATE:          return registerInstruction("R_NEGATE", "RR", chunk, constants, offset);
+    case R_PRINT:           return registerInstruction("R_PRINT", "R", chunk, constants, offset);
+    case R_JUMP:            return registerInstruction("R_JUMP", "J", chunk, constants, offset);
+    case R_LOOP:            return registerInstruction("R_LOOP", "L", chunk, constants, offset);
+    case R_JUMP_IF_FALSE:   return registerInstruction("R_JUMP_IF_FALSE", "RJ", chunk, constants, offset);
+    case R_LESS_JUMP_IF_FALSE:      return registerInstruction("R_LESS_JUMP_IF_FALSE", "RRJ", chunk, constants, offset);
+    case R_LESSK_JUMP_IF_FALSE:     return registerInstruction("R_LESSK_JUMP_IF_FALSE", "RKJ", chunk, constants, offset);
+    case R_GREATER_JUMP_IF_FALSE:   return registerInstruction("R_GREATER_JUMP_IF_FALSE", "RRJ", chunk, constants, offset);
+    case R_GREATERK_JUMP_IF_FALSE:  return registerInstruction("R_GREATERK_JUMP_IF_FALSE", "RKJ", chunk, constants, offset);
+    case R_CALL:            return registerInstruction("R_CALL", "RN", chunk, constants, offset);
+    case R_RETURN:          return registerInstruction("R_RETURN", "R", chunk, constants, offset);
+    default:
+        printf("Unknown register opcode %d\n", instruction);
+        return offset + 1;
+    }
+}
+
+void disassembleRegisterChunk(Chunk* chunk, ValueArray* constants, const char* name) {
+    printf("== %s (registers) ==\n", name);
+
+    for (int offset = 0; offset < chunk->count;) {
+        offset = disassembleRegisterInstruction(chunk, constants, offset);
+    }
+}
@@ -6,6 +6,8 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char* opcodeName(uint8_t instruction);
+void disassembleRegisterChunk(Chunk* chunk, ValueArray* constants, const char* name);
 
 #endif
 
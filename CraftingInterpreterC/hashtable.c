@@ -15,6 +15,7 @@ void initTable(Table* table) {
     table->count = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->version = 0;
 }
 
 // string intern 
@@ -41,8 +42,10 @@ void debugPrintTable(Table* table, char* description, bool isStringIntern) {
 }
 
 void freeTable(Table* table) {
+    uint32_t version = table->version;
     FREE_ARRAY(Entry, table->entries, table->capacity);
     initTable(table);
+    table->version = version + 1;  // the entries are gone
 }
 // NOTE: The "Optimization" chapter has a manual copy of this function.
 // If you change it here, make sure to update that copy.
@@ -98,6 +101,14 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
+// for inline caches - the Entry* stays good until table->version changes
+Entry* tableGetEntry(Table* table, ObjString* key) {
+    if (table->count == 0) return NULL;
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    return entry->key == NULL ? NULL : entry;
+}
+
 static void adjustCapacity(Table* table, int capacity) {
     Entry* entries = ALLOCATE(Entry, capacity);
     for (int i = 0; i < capacity; i++) {
@@ -120,6 +131,7 @@ static void adjustCapacity(Table* table, int capacity) {
     FREE_ARRAY(Entry, table->entries, table->capacity);
     table->entries = entries;
     table->capacity = capacity;
+    table->version++;  // every Entry* moved
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
@@ -149,6 +161,18 @@ bool tableDelete(Table* table, ObjString* key) {
 
     entry->key = NULL;
     entry->value = BOOL_VAL(true);
+    table->version++;
+    return true;
+}
+
+// the collector moved key to newKey - same hash, so the same entry
+bool tableReplaceKey(Table* table, ObjString* key, ObjString* newKey) {
+    if (table->count == 0) return false;
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return false;
+
+    entry->key = newKey;  // an Entry* handed out is still good
     return true;
 }
 
@@ -198,12 +222,10 @@ void tableRemoveWhite(Table* table) {
         }
     }
 }
-/* LLM later for GC
 void markTable(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
         markObject((Obj*)entry->key);
         markValue(entry->value);
     }
-}
-*/
\ No newline at end of file
+}
\ No newline at end of file
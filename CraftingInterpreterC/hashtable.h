@@ -6,8 +6,9 @@
 #include "common.h"
 #include "value.h"
 
-// empty slot is key = NULL and value = Value NIL_VAL (ValueType of VAL_NIL)
-// Tombstone is key = NULL and value = Value BOOL_VAL
+// empty slot is key = NULL and value = Value NIL_VAL
+// Tombstone is key = NULL and value = Value BOOL_VAL(true)
+// only tested through IS_NIL / BOOL_VAL so it works with or without NAN_BOXING
 // See Ch 20.4.5 page 374 for Tombstone
 
 typedef struct {
@@ -15,10 +16,13 @@ typedef struct {
     Value value;
 } Entry;
 
+// version changes whenever an Entry* handed out by tableGetEntry may no longer
+// point at its key - a rehash in adjustCapacity or a tombstone from tableDelete
 typedef struct {
     int count;
     int capacity;
     Entry* entries;
+    uint32_t version;
 } Table;
 
 
@@ -27,14 +31,16 @@ void initTable(Table* table);
 void freeTable(Table* table);
 
 bool tableGet(Table* table, ObjString* key, Value* value);
+Entry* tableGetEntry(Table* table, ObjString* key);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
+bool tableReplaceKey(Table* table, ObjString* key, ObjString* newKey);
 void tableAddAll(Table* from, Table* to);
 
 ObjString* tableFindString(Table* table, const char* chars,
     int length, uint32_t hash);
 
 void tableRemoveWhite(Table* table);
-// void markTable(Table* table);
+void markTable(Table* table);
 void debugPrintTable(Table* table, char* description, bool isStringIntern);
 #endif
\ No newline at end of file
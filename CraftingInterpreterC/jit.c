@@ -0,0 +1,859 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "jit.h"
+#include "vm.h"
+
+#ifdef JIT_X64
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+// Bytecode -> x86-64 templates (see jit.h)
+//
+// One pass over the bytecode emits the template for each instruction and
+// records the native offset of every bytecode offset, so the jumps can be
+// patched at the end.  A guard that fails jumps to a stub after the main
+// code that runs the instruction in the interpreter and comes back at the
+// next instruction.
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// condition codes - jcc is 0F 80+cc, setcc is 0F 90+cc
+enum { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_NP = 0xB };
+
+#define JMP -1		// cc for an unconditional jump
+
+#define STACK_TOP	RBX
+#define SLOTS		R12
+#define FRAME		R13
+#define VM_PTR		R15
+
+#define VM_OFFSET(field)	((int32_t)offsetof(VM, field))
+
+// x86-64 SSE2 scalar double opcodes (F2 0F xx)
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5C
+#define SSE_DIV 0x5E
+
+typedef enum {
+	TO_BYTECODE,	// the code for a bytecode offset
+	TO_SLOW_PATH,	// an interpreter stub
+	TO_ERROR		// the runtime error exit
+} PatchKind;
+
+typedef struct {
+	int codeOffset;		// where the rel32 goes
+	PatchKind kind;
+	int target;			// bytecode offset or slow path index
+} JitPatch;
+
+typedef struct {
+	int start;			// the instruction the interpreter runs instead
+	int end;
+} SlowPath;
+
+typedef struct {
+	Chunk* chunk;
+	uint8_t* code;
+	int count;
+	int capacity;
+	int* labels;		// bytecode offset -> native offset, -1 inside an instruction
+	JitPatch* patches;
+	int patchCount;
+	int patchCapacity;
+	SlowPath* slowPaths;
+	int slowPathCount;
+	int slowPathCapacity;
+	bool localArrays;	// the function declares arrays - OP_RETURN releases them
+	bool failed;
+} JitCompiler;
+
+static void emit(JitCompiler* jc, uint8_t byte) {
+	if (jc->capacity < jc->count + 1) {
+		int oldCapacity = jc->capacity;
+		jc->capacity = GROW_CAPACITY(oldCapacity);
+		jc->code = GROW_ARRAY(uint8_t, jc->code, oldCapacity, jc->capacity);
+	}
+	jc->code[jc->count++] = byte;
+}
+
+static void emit32(JitCompiler* jc, uint32_t value) {
+	for (int i = 0; i < 4; i++) emit(jc, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(JitCompiler* jc, uint64_t value) {
+	for (int i = 0; i < 8; i++) emit(jc, (uint8_t)(value >> (8 * i)));
+}
+
+// REX prefix - W for a 64 bit operand, R and B extend the reg and rm fields to r8-r15
+static void emitRex(JitCompiler* jc, bool wide, int reg, int rm) {
+	uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+	if (rex != 0x40) emit(jc, rex);
+}
+
+static void emitRegReg(JitCompiler* jc, int reg, int rm) {
+	emit(jc, (uint8_t)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// [base + disp32] - rsp and r12 as the base need a SIB byte
+static void emitMem(JitCompiler* jc, int reg, int base, int32_t disp) {
+	emit(jc, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+	if ((base & 7) == RSP) emit(jc, 0x24);
+	emit32(jc, (uint32_t)disp);
+}
+
+// mov dst, [base + disp]
+static void movLoad(JitCompiler* jc, int dst, int base, int32_t disp) {
+	emitRex(jc, true, dst, base);
+	emit(jc, 0x8B);
+	emitMem(jc, dst, base, disp);
+}
+
+// mov dst32, [base + disp] - zero extended
+static void movLoad32(JitCompiler* jc, int dst, int base, int32_t disp) {
+	emitRex(jc, false, dst, base);
+	emit(jc, 0x8B);
+	emitMem(jc, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void movStore(JitCompiler* jc, int base, int32_t disp, int src) {
+	emitRex(jc, true, src, base);
+	emit(jc, 0x89);
+	emitMem(jc, src, base, disp);
+}
+
+// mov dst, imm64
+static void movImm(JitCompiler* jc, int dst, uint64_t value) {
+	emitRex(jc, true, 0, dst);
+	emit(jc, (uint8_t)(0xB8 + (dst & 7)));
+	emit64(jc, value);
+}
+
+// mov dst32, imm32 - for int arguments
+static void movImm32(JitCompiler* jc, int dst, uint32_t value) {
+	emitRex(jc, false, 0, dst);
+	emit(jc, (uint8_t)(0xB8 + (dst & 7)));
+	emit32(jc, value);
+}
+
+// 64 bit  op dst, src  - 0x01 add, 0x21 and, 0x29 sub, 0x39 cmp, 0x89 mov
+#define ALU_ADD 0x01
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+
+static void alu(JitCompiler* jc, uint8_t op, int dst, int src) {
+	emitRex(jc, true, src, dst);
+	emit(jc, op);
+	emitRegReg(jc, src, dst);
+}
+
+// add reg, imm32 (81 /0) or sub reg, imm32 (81 /5) for a negative value
+static void addImm(JitCompiler* jc, int reg, int32_t value) {
+	emitRex(jc, true, 0, reg);
+	emit(jc, 0x81);
+	emitRegReg(jc, value < 0 ? 5 : 0, reg);
+	emit32(jc, (uint32_t)(value < 0 ? -value : value));
+}
+
+static void pushReg(JitCompiler* jc, int reg) {
+	emitRex(jc, false, 0, reg);
+	emit(jc, (uint8_t)(0x50 + (reg & 7)));
+}
+
+static void popReg(JitCompiler* jc, int reg) {
+	emitRex(jc, false, 0, reg);
+	emit(jc, (uint8_t)(0x58 + (reg & 7)));
+}
+
+// movq xmm, r64
+static void movqToXmm(JitCompiler* jc, int xmm, int reg) {
+	emit(jc, 0x66);
+	emitRex(jc, true, xmm, reg);
+	emit(jc, 0x0F);
+	emit(jc, 0x6E);
+	emitRegReg(jc, xmm, reg);
+}
+
+// movq r64, xmm
+static void movqFromXmm(JitCompiler* jc, int reg, int xmm) {
+	emit(jc, 0x66);
+	emitRex(jc, true, xmm, reg);
+	emit(jc, 0x0F);
+	emit(jc, 0x7E);
+	emitRegReg(jc, xmm, reg);
+}
+
+// addsd/subsd/mulsd/divsd xmm, xmm
+static void sseOp(JitCompiler* jc, uint8_t op, int dst, int src) {
+	emit(jc, 0xF2);
+	emit(jc, 0x0F);
+	emit(jc, op);
+	emitRegReg(jc, dst, src);
+}
+
+// ucomisd a, b - the flags read like unsigned a ? b, unordered sets ZF PF and CF
+static void ucomisd(JitCompiler* jc, int a, int b) {
+	emit(jc, 0x66);
+	emit(jc, 0x0F);
+	emit(jc, 0x2E);
+	emitRegReg(jc, a, b);
+}
+
+// setcc on al/cl/dl/bl
+static void setcc(JitCompiler* jc, int cc, int reg) {
+	emit(jc, 0x0F);
+	emit(jc, (uint8_t)(0x90 + cc));
+	emitRegReg(jc, 0, reg);
+}
+
+static void callC(JitCompiler* jc, void* function) {
+	movImm(jc, RAX, (uint64_t)(uintptr_t)function);
+	emit(jc, 0xFF);		// call rax
+	emit(jc, 0xD0);
+}
+
+static void addPatch(JitCompiler* jc, PatchKind kind, int target) {
+	if (jc->patchCapacity < jc->patchCount + 1) {
+		int oldCapacity = jc->patchCapacity;
+		jc->patchCapacity = GROW_CAPACITY(oldCapacity);
+		jc->patches = GROW_ARRAY(JitPatch, jc->patches, oldCapacity, jc->patchCapacity);
+	}
+	JitPatch* patch = &jc->patches[jc->patchCount++];
+	patch->codeOffset = jc->count;
+	patch->kind = kind;
+	patch->target = target;
+}
+
+// jmp / jcc rel32 to a target that is patched in at the end
+static void jumpTo(JitCompiler* jc, int cc, PatchKind kind, int target) {
+	if (cc == JMP) {
+		emit(jc, 0xE9);
+	}
+	else {
+		emit(jc, 0x0F);
+		emit(jc, (uint8_t)(0x80 + cc));
+	}
+	addPatch(jc, kind, target);
+	emit32(jc, 0);
+}
+
+// short forward jump inside one template - patchHere() when the target is reached
+static int jumpForward(JitCompiler* jc, int cc) {
+	emit(jc, cc == JMP ? 0xEB : (uint8_t)(0x70 + cc));
+	emit(jc, 0);
+	return jc->count - 1;
+}
+
+static void patchHere(JitCompiler* jc, int at) {
+	jc->code[at] = (uint8_t)(jc->count - (at + 1));
+}
+
+static void patch32(JitCompiler* jc, int at, int target) {
+	uint32_t rel = (uint32_t)(target - (at + 4));
+	for (int i = 0; i < 4; i++) jc->code[at + i] = (uint8_t)(rel >> (8 * i));
+}
+
+static int addSlowPath(JitCompiler* jc, int start, int end) {
+	if (jc->slowPathCapacity < jc->slowPathCount + 1) {
+		int oldCapacity = jc->slowPathCapacity;
+		jc->slowPathCapacity = GROW_CAPACITY(oldCapacity);
+		jc->slowPaths = GROW_ARRAY(SlowPath, jc->slowPaths, oldCapacity, jc->slowPathCapacity);
+	}
+	jc->slowPaths[jc->slowPathCount].start = start;
+	jc->slowPaths[jc->slowPathCount].end = end;
+	return jc->slowPathCount++;
+}
+
+// ---- templates
+
+static void syncStackTop(JitCompiler* jc) {
+	movStore(jc, VM_PTR, VM_OFFSET(stackTop), STACK_TOP);
+}
+
+static void reloadStackTop(JitCompiler* jc) {
+	movLoad(jc, STACK_TOP, VM_PTR, VM_OFFSET(stackTop));
+}
+
+static void pushRax(JitCompiler* jc) {
+	movStore(jc, STACK_TOP, 0, RAX);
+	addImm(jc, STACK_TOP, 8);
+}
+
+// a helper returned its InterpretResult in eax
+static void checkResult(JitCompiler* jc) {
+	emit(jc, 0x85);		// test eax, eax
+	emit(jc, 0xC0);
+	jumpTo(jc, CC_NE, TO_ERROR, 0);
+}
+
+// run bytecode [start, end) in the interpreter - the fallback for everything
+// without a template, and the slow path behind every guard
+static void interpretInstruction(JitCompiler* jc, int start, int end) {
+	syncStackTop(jc);
+	alu(jc, ALU_MOV, RDI, FRAME);
+	movImm32(jc, RSI, (uint32_t)start);
+	movImm32(jc, RDX, (uint32_t)end);
+	callC(jc, (void*)jitInterpret);
+	checkResult(jc);
+	reloadStackTop(jc);
+}
+
+// to the slow path if storing reg needs the write barrier (memory.h) - while
+// the collector is marking, or if it could be a young string.  Only the
+// payload is compared with the nursery, so now and then a number goes the
+// slow way too - that does no harm
+static void guardBarrier(JitCompiler* jc, int reg, int slowPath) {
+	movLoad32(jc, RCX, VM_PTR, VM_OFFSET(gcPhase));
+	alu(jc, ALU_AND, RCX, RCX);
+	jumpTo(jc, CC_NE, TO_SLOW_PATH, slowPath);
+	alu(jc, ALU_MOV, RSI, reg);
+	movImm(jc, RCX, ~(SIGN_BIT | QNAN));
+	alu(jc, ALU_AND, RSI, RCX);
+	movLoad(jc, RCX, VM_PTR, VM_OFFSET(nursery));
+	alu(jc, ALU_SUB, RSI, RCX);
+	movImm(jc, RCX, NURSERY_SIZE);
+	alu(jc, ALU_CMP, RSI, RCX);
+	jumpTo(jc, CC_B, TO_SLOW_PATH, slowPath);
+}
+
+// to the slow path unless reg holds a number - rcx must hold QNAN
+static void guardNumber(JitCompiler* jc, int reg, int slowPath) {
+	alu(jc, ALU_MOV, RSI, reg);
+	alu(jc, ALU_AND, RSI, RCX);
+	alu(jc, ALU_CMP, RSI, RCX);
+	jumpTo(jc, CC_E, TO_SLOW_PATH, slowPath);
+}
+
+// a in rax and xmm0, b in rdx and xmm1 - both numbers or off to the slow path
+static void loadNumbers(JitCompiler* jc, int slowPath) {
+	movLoad(jc, RAX, STACK_TOP, -16);
+	movLoad(jc, RDX, STACK_TOP, -8);
+	movImm(jc, RCX, QNAN);
+	guardNumber(jc, RAX, slowPath);
+	guardNumber(jc, RDX, slowPath);
+	movqToXmm(jc, 0, RAX);
+	movqToXmm(jc, 1, RDX);
+}
+
+// al (0 or 1) -> BOOL_VAL in rax, TRUE_VAL is FALSE_VAL + 1
+static void boolFromAl(JitCompiler* jc) {
+	emit(jc, 0x0F);		// movzx eax, al
+	emit(jc, 0xB6);
+	emit(jc, 0xC0);
+	movImm(jc, RCX, FALSE_VAL);
+	alu(jc, ALU_ADD, RAX, RCX);
+}
+
+// a b -> a op b
+static void binaryNumber(JitCompiler* jc, uint8_t op, int slowPath) {
+	loadNumbers(jc, slowPath);
+	sseOp(jc, op, 0, 1);
+	movqFromXmm(jc, RAX, 0);
+	movStore(jc, STACK_TOP, -16, RAX);
+	addImm(jc, STACK_TOP, -8);
+}
+
+// a b -> a < b  or  a > b   (a < b is b > a, so both are seta)
+// negate for OP_NOT_LESS / OP_NOT_GREATER - setbe is also true for a NaN
+static void compareNumber(JitCompiler* jc, bool less, bool negate, int slowPath) {
+	loadNumbers(jc, slowPath);
+	if (less) ucomisd(jc, 1, 0);
+	else ucomisd(jc, 0, 1);
+	setcc(jc, negate ? CC_BE : CC_A, RAX);
+	boolFromAl(jc);
+	movStore(jc, STACK_TOP, -16, RAX);
+	addImm(jc, STACK_TOP, -8);
+}
+
+// OP_LESS_JUMP_IF_FALSE / OP_GREATER_JUMP_IF_FALSE - jbe is also taken for a NaN
+static void compareJump(JitCompiler* jc, bool less, int target, int slowPath) {
+	loadNumbers(jc, slowPath);
+	addImm(jc, STACK_TOP, -16);
+	if (less) ucomisd(jc, 1, 0);
+	else ucomisd(jc, 0, 1);
+	jumpTo(jc, CC_BE, TO_BYTECODE, target);
+}
+
+// isFalsey(rax) - nil or false
+static void jumpIfFalsey(JitCompiler* jc, int target) {
+	movImm(jc, RCX, NIL_VAL);
+	alu(jc, ALU_CMP, RAX, RCX);
+	jumpTo(jc, CC_E, TO_BYTECODE, target);
+	movImm(jc, RCX, FALSE_VAL);
+	alu(jc, ALU_CMP, RAX, RCX);
+	jumpTo(jc, CC_E, TO_BYTECODE, target);
+}
+
+// to the slow path if reg holds a string builder - == compares its chars
+static void guardNotBuilder(JitCompiler* jc, int reg, int slowPath) {
+	movImm(jc, RCX, SIGN_BIT | QNAN);
+	alu(jc, ALU_MOV, RSI, reg);
+	alu(jc, ALU_AND, RSI, RCX);
+	alu(jc, ALU_CMP, RSI, RCX);
+	int notObject = jumpForward(jc, CC_NE);
+	alu(jc, ALU_MOV, RSI, reg);
+	movImm(jc, RCX, ~(SIGN_BIT | QNAN));
+	alu(jc, ALU_AND, RSI, RCX);
+	movLoad32(jc, RCX, RSI, (int32_t)offsetof(Obj, type));
+	movImm32(jc, RSI, OBJ_BUILDER);
+	alu(jc, ALU_CMP, RCX, RSI);
+	jumpTo(jc, CC_E, TO_SLOW_PATH, slowPath);
+	patchHere(jc, notObject);
+}
+
+// valuesEqual - two numbers compare as doubles (NaN != NaN), anything else by
+// its bits, unless one of two different values is a builder
+static void equal(JitCompiler* jc, bool negate, int slowPath) {
+	movLoad(jc, RAX, STACK_TOP, -16);
+	movLoad(jc, RDX, STACK_TOP, -8);
+	movImm(jc, RCX, QNAN);
+	alu(jc, ALU_MOV, RSI, RAX);
+	alu(jc, ALU_AND, RSI, RCX);
+	alu(jc, ALU_CMP, RSI, RCX);
+	int aNotNumber = jumpForward(jc, CC_E);
+	alu(jc, ALU_MOV, RSI, RDX);
+	alu(jc, ALU_AND, RSI, RCX);
+	alu(jc, ALU_CMP, RSI, RCX);
+	int bNotNumber = jumpForward(jc, CC_E);
+	movqToXmm(jc, 0, RAX);
+	movqToXmm(jc, 1, RDX);
+	ucomisd(jc, 0, 1);
+	setcc(jc, CC_E, RAX);
+	setcc(jc, CC_NP, RDX);
+	emit(jc, 0x20);		// and al, dl
+	emit(jc, 0xD0);
+	int done = jumpForward(jc, JMP);
+	patchHere(jc, aNotNumber);
+	patchHere(jc, bNotNumber);
+	alu(jc, ALU_CMP, RAX, RDX);
+	int same = jumpForward(jc, CC_E);
+	guardNotBuilder(jc, RAX, slowPath);
+	guardNotBuilder(jc, RDX, slowPath);
+	alu(jc, ALU_CMP, RAX, RDX);
+	patchHere(jc, same);
+	setcc(jc, CC_E, RAX);
+	patchHere(jc, done);
+	if (negate) {
+		emit(jc, 0x34);	// xor al, 1
+		emit(jc, 0x01);
+	}
+	boolFromAl(jc);
+	movStore(jc, STACK_TOP, -16, RAX);
+	addImm(jc, STACK_TOP, -8);
+}
+
+static void emitPrologue(JitCompiler* jc) {
+	pushReg(jc, RBX);
+	pushReg(jc, R12);
+	pushReg(jc, R13);
+	pushReg(jc, R14);	// not used - keeps the C stack 16 byte aligned for the calls
+	pushReg(jc, R15);
+	alu(jc, ALU_MOV, FRAME, RDI);
+	movLoad(jc, SLOTS, FRAME, (int32_t)offsetof(CallFrame, slots));
+	movImm(jc, VM_PTR, (uint64_t)(uintptr_t)&vm);
+	reloadStackTop(jc);
+	emit(jc, 0xFF);		// jmp rsi - the entry point
+	emit(jc, 0xE6);
+}
+
+static void emitEpilogue(JitCompiler* jc) {
+	popReg(jc, R15);
+	popReg(jc, R14);
+	popReg(jc, R13);
+	popReg(jc, R12);
+	popReg(jc, RBX);
+	emit(jc, 0xC3);		// ret
+}
+
+// OP_RETURN - the result goes where the callee was, the frame is dropped
+static void emitReturn(JitCompiler* jc) {
+	if (jc->localArrays) {
+		alu(jc, ALU_MOV, RDI, FRAME);
+		callC(jc, (void*)jitReleaseArrays);
+	}
+	movLoad(jc, RAX, STACK_TOP, -8);
+	movStore(jc, SLOTS, 0, RAX);
+	alu(jc, ALU_MOV, STACK_TOP, SLOTS);
+	addImm(jc, STACK_TOP, 8);
+	syncStackTop(jc);
+	emitRex(jc, false, 0, VM_PTR);	// dec dword [vm.frameCount]
+	emit(jc, 0xFF);
+	emitMem(jc, 1, VM_PTR, VM_OFFSET(frameCount));
+	movImm32(jc, RAX, INTERPRET_OK);
+	emitEpilogue(jc);
+}
+
+static uint16_t readShort(Chunk* chunk, int offset) {
+	return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// how far the jump at offset goes - the *_LONG ones keep it in chunk->longJumps
+static int jumpDistance(Chunk* chunk, int offset) {
+	switch (chunk->code[offset]) {
+	case OP_JUMP_LONG: case OP_JUMP_IF_FALSE_LONG: case OP_POP_JUMP_IF_FALSE_LONG:
+	case OP_LESS_JUMP_IF_FALSE_LONG: case OP_GREATER_JUMP_IF_FALSE_LONG: case OP_LOOP_LONG:
+		return chunk->longJumps[readShort(chunk, offset + 1)];
+	default:
+		return readShort(chunk, offset + 1);
+	}
+}
+
+// length of every instruction the compiler emits, 0 for anything else
+static int instructionLength(Chunk* chunk, int offset) {
+	switch (chunk->code[offset]) {
+	case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_POP:
+	case OP_EQUAL: case OP_NOT_EQUAL: case OP_GREATER: case OP_LESS:
+	case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE: case OP_RANDOM:
+	case OP_NOT: case OP_NEGATE: case OP_PRINT: case OP_RETURN:
+	case OP_RANGE:
+	case OP_ADD_NUM: case OP_ADD_STR: case OP_SUBTRACT_NUM:
+	case OP_GREATER_NUM: case OP_LESS_NUM: case OP_ADD_MIXED:
+	case OP_NOT_LESS: case OP_NOT_GREATER:
+		return 1;
+	case OP_CONSTANT: case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_SET_LOCAL_POP:
+	case OP_ADD_CONST: case OP_CALL:
+	case OP_RELEASE_ARRAYS:
+		return 2;
+	case OP_GET_LOCAL2:
+	case OP_GET_GLOBAL_SLOT: case OP_SET_GLOBAL_SLOT: case OP_DEFINE_GLOBAL_SLOT:
+	case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE: case OP_LOOP:
+	case OP_LESS_JUMP_IF_FALSE: case OP_GREATER_JUMP_IF_FALSE:
+	case OP_JUMP_LONG: case OP_JUMP_IF_FALSE_LONG: case OP_POP_JUMP_IF_FALSE_LONG: case OP_LOOP_LONG:
+	case OP_LESS_JUMP_IF_FALSE_LONG: case OP_GREATER_JUMP_IF_FALSE_LONG:
+	case OP_DEFINE_GLOBAL:			// name16
+		return 3;
+	case OP_CONSTANT_LONG:
+	case OP_CROSS_SECTION:			// name16, subscript count
+	case OP_SET_CROSS_SECTION:		// jump16, subscript count
+	case OP_GET_CROSS_SECTION:		// name16, subscript count
+	case OP_SLICE:					// name16, subscript count
+		return 4;
+	case OP_GET_GLOBAL_ARRAY: case OP_SET_GLOBAL_ARRAY:
+	case OP_GET_ARRAY_UNCHECKED: case OP_SET_ARRAY_UNCHECKED:	// name16, subscript count, cache16
+		return 6;
+	case OP_ARRAY_KERNEL:			// jump16, kernel, b16, c16
+		return 8;
+	case OP_GET_GLOBAL: case OP_SET_GLOBAL:	// name16, cache16
+		return 5;
+	case OP_DEFINE_GLOBAL_ARRAY:	// name16, subscript count, var count32, bounds 2 x 32 each
+	case OP_DEFINE_LOCAL_ARRAY:
+		return 8 + 8 * chunk->code[offset + 3];
+	default:
+		return 0;
+	}
+}
+
+static void compileInstruction(JitCompiler* jc, int offset, int length) {
+	Chunk* chunk = jc->chunk;
+	uint8_t instruction = chunk->code[offset];
+	uint8_t arg = length > 1 ? chunk->code[offset + 1] : 0;
+	int next = offset + length;
+
+	switch (instruction) {
+	case OP_CONSTANT:
+		movImm(jc, RAX, chunk->constants.values[arg]);
+		pushRax(jc);
+		break;
+	case OP_CONSTANT_LONG:
+		movImm(jc, RAX, chunk->constants.values[(arg << 16) | readShort(chunk, offset + 2)]);
+		pushRax(jc);
+		break;
+	case OP_NIL:	movImm(jc, RAX, NIL_VAL); pushRax(jc); break;
+	case OP_TRUE:	movImm(jc, RAX, TRUE_VAL); pushRax(jc); break;
+	case OP_FALSE:	movImm(jc, RAX, FALSE_VAL); pushRax(jc); break;
+	case OP_POP:	addImm(jc, STACK_TOP, -8); break;
+
+	case OP_GET_LOCAL:
+		movLoad(jc, RAX, SLOTS, arg * 8);
+		pushRax(jc);
+		break;
+	case OP_GET_LOCAL2:
+		movLoad(jc, RAX, SLOTS, arg * 8);
+		pushRax(jc);
+		movLoad(jc, RAX, SLOTS, chunk->code[offset + 2] * 8);
+		pushRax(jc);
+		break;
+	case OP_SET_LOCAL:
+		movLoad(jc, RAX, STACK_TOP, -8);
+		movStore(jc, SLOTS, arg * 8, RAX);
+		break;
+	case OP_SET_LOCAL_POP:
+		movLoad(jc, RAX, STACK_TOP, -8);
+		movStore(jc, SLOTS, arg * 8, RAX);
+		addImm(jc, STACK_TOP, -8);
+		break;
+
+	// vm.globalValues.values can move when a global is added, so it is loaded each time
+	case OP_GET_GLOBAL_SLOT: {
+		int slowPath = addSlowPath(jc, offset, next);
+		movLoad(jc, RAX, VM_PTR, VM_OFFSET(globalValues.values));
+		movLoad(jc, RAX, RAX, readShort(chunk, offset + 1) * 8);
+		movImm(jc, RCX, UNDEFINED_VAL);
+		alu(jc, ALU_CMP, RAX, RCX);
+		jumpTo(jc, CC_E, TO_SLOW_PATH, slowPath);
+		pushRax(jc);
+		break;
+	}
+	case OP_SET_GLOBAL_SLOT: {
+		int slowPath = addSlowPath(jc, offset, next);
+		int32_t disp = readShort(chunk, offset + 1) * 8;
+		movLoad(jc, RDX, VM_PTR, VM_OFFSET(globalValues.values));
+		movLoad(jc, RAX, RDX, disp);
+		movImm(jc, RCX, UNDEFINED_VAL);
+		alu(jc, ALU_CMP, RAX, RCX);
+		jumpTo(jc, CC_E, TO_SLOW_PATH, slowPath);
+		movLoad(jc, RAX, STACK_TOP, -8);
+		guardBarrier(jc, RAX, slowPath);
+		movStore(jc, RDX, disp, RAX);
+		break;
+	}
+	case OP_DEFINE_GLOBAL_SLOT: {
+		int slowPath = addSlowPath(jc, offset, next);
+		movLoad(jc, RAX, STACK_TOP, -8);
+		guardBarrier(jc, RAX, slowPath);
+		movLoad(jc, RDX, VM_PTR, VM_OFFSET(globalValues.values));
+		movStore(jc, RDX, readShort(chunk, offset + 1) * 8, RAX);
+		addImm(jc, STACK_TOP, -8);
+		break;
+	}
+
+	case OP_ADD: case OP_ADD_NUM: case OP_ADD_MIXED:
+		binaryNumber(jc, SSE_ADD, addSlowPath(jc, offset, next));
+		break;
+	case OP_SUBTRACT: case OP_SUBTRACT_NUM:
+		binaryNumber(jc, SSE_SUB, addSlowPath(jc, offset, next));
+		break;
+	case OP_MULTIPLY:
+		binaryNumber(jc, SSE_MUL, addSlowPath(jc, offset, next));
+		break;
+	case OP_DIVIDE:
+		binaryNumber(jc, SSE_DIV, addSlowPath(jc, offset, next));
+		break;
+
+	case OP_ADD_CONST: {
+		Value constant = chunk->constants.values[arg];
+		if (!IS_NUMBER(constant)) {
+			interpretInstruction(jc, offset, next);
+			break;
+		}
+		int slowPath = addSlowPath(jc, offset, next);
+		movLoad(jc, RAX, STACK_TOP, -8);
+		movImm(jc, RCX, QNAN);
+		guardNumber(jc, RAX, slowPath);
+		movqToXmm(jc, 0, RAX);
+		movImm(jc, RDX, constant);
+		movqToXmm(jc, 1, RDX);
+		sseOp(jc, SSE_ADD, 0, 1);
+		movqFromXmm(jc, RAX, 0);
+		movStore(jc, STACK_TOP, -8, RAX);
+		break;
+	}
+
+	case OP_GREATER: case OP_GREATER_NUM:
+		compareNumber(jc, false, false, addSlowPath(jc, offset, next));
+		break;
+	case OP_LESS: case OP_LESS_NUM:
+		compareNumber(jc, true, false, addSlowPath(jc, offset, next));
+		break;
+	case OP_NOT_GREATER:
+		compareNumber(jc, false, true, addSlowPath(jc, offset, next));
+		break;
+	case OP_NOT_LESS:
+		compareNumber(jc, true, true, addSlowPath(jc, offset, next));
+		break;
+	case OP_EQUAL:		equal(jc, false, addSlowPath(jc, offset, next)); break;
+	case OP_NOT_EQUAL:	equal(jc, true, addSlowPath(jc, offset, next)); break;
+
+	case OP_NOT:
+		movLoad(jc, RAX, STACK_TOP, -8);
+		movImm(jc, RCX, NIL_VAL);
+		alu(jc, ALU_CMP, RAX, RCX);
+		setcc(jc, CC_E, RDX);
+		movImm(jc, RCX, FALSE_VAL);
+		alu(jc, ALU_CMP, RAX, RCX);
+		setcc(jc, CC_E, RAX);
+		emit(jc, 0x08);		// or al, dl
+		emit(jc, 0xD0);
+		boolFromAl(jc);
+		movStore(jc, STACK_TOP, -8, RAX);
+		break;
+
+	case OP_NEGATE: {
+		int slowPath = addSlowPath(jc, offset, next);
+		movLoad(jc, RAX, STACK_TOP, -8);
+		movImm(jc, RCX, QNAN);
+		guardNumber(jc, RAX, slowPath);
+		emit(jc, 0x48);		// btc rax, 63 - flip the sign bit
+		emit(jc, 0x0F);
+		emit(jc, 0xBA);
+		emit(jc, 0xF8);
+		emit(jc, 63);
+		movStore(jc, STACK_TOP, -8, RAX);
+		break;
+	}
+
+	case OP_JUMP: case OP_JUMP_LONG:
+		jumpTo(jc, JMP, TO_BYTECODE, next + jumpDistance(chunk, offset));
+		break;
+	case OP_LOOP: case OP_LOOP_LONG:
+		jumpTo(jc, JMP, TO_BYTECODE, next - jumpDistance(chunk, offset));
+		break;
+	case OP_JUMP_IF_FALSE: case OP_JUMP_IF_FALSE_LONG:
+		movLoad(jc, RAX, STACK_TOP, -8);
+		jumpIfFalsey(jc, next + jumpDistance(chunk, offset));
+		break;
+	case OP_POP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE_LONG:
+		movLoad(jc, RAX, STACK_TOP, -8);
+		addImm(jc, STACK_TOP, -8);
+		jumpIfFalsey(jc, next + jumpDistance(chunk, offset));
+		break;
+	case OP_LESS_JUMP_IF_FALSE: case OP_LESS_JUMP_IF_FALSE_LONG:
+		compareJump(jc, true, next + jumpDistance(chunk, offset), addSlowPath(jc, offset, next));
+		break;
+	case OP_GREATER_JUMP_IF_FALSE: case OP_GREATER_JUMP_IF_FALSE_LONG:
+		compareJump(jc, false, next + jumpDistance(chunk, offset), addSlowPath(jc, offset, next));
+		break;
+
+	case OP_CALL:
+		// frame->ip is only looked at for the line numbers in a runtime error
+		syncStackTop(jc);
+		movImm(jc, RAX, (uint64_t)(uintptr_t)(chunk->code + next));
+		movStore(jc, FRAME, (int32_t)offsetof(CallFrame, ip), RAX);
+		movImm32(jc, RDI, arg);
+		callC(jc, (void*)jitCall);
+		checkResult(jc);
+		reloadStackTop(jc);
+		break;
+
+	case OP_RETURN:
+		emitReturn(jc);
+		break;
+
+	// the interpreter runs the kernel - if it did the cross section frame->ip is past the loop
+	case OP_ARRAY_KERNEL: {
+		int target = next + ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+		interpretInstruction(jc, offset, next);
+		movLoad(jc, RAX, FRAME, (int32_t)offsetof(CallFrame, ip));
+		movImm(jc, RCX, (uint64_t)(uintptr_t)(chunk->code + target));
+		alu(jc, ALU_CMP, RAX, RCX);
+		jumpTo(jc, CC_E, TO_BYTECODE, target);
+		break;
+	}
+
+	// no template - OP_PRINT, OP_RANDOM, the name based globals, arrays, strings
+	// (OP_SET_CROSS_SECTION jumps back inside jitInterpret, which then runs
+	// the rest of the a(*) = ... loop before coming back here)
+	default:
+		interpretInstruction(jc, offset, next);
+		break;
+	}
+}
+
+static void freeJitCompiler(JitCompiler* jc) {
+	FREE_ARRAY(uint8_t, jc->code, jc->capacity);
+	FREE_ARRAY(int, jc->labels, jc->chunk->count + 1);
+	FREE_ARRAY(JitPatch, jc->patches, jc->patchCapacity);
+	FREE_ARRAY(SlowPath, jc->slowPaths, jc->slowPathCapacity);
+}
+
+bool jitCompile(ObjFunction* function) {
+	JitCompiler jc;
+	memset(&jc, 0, sizeof(jc));
+	jc.chunk = &function->chunk;
+	jc.labels = ALLOCATE(int, jc.chunk->count + 1);
+	for (int i = 0; i <= jc.chunk->count; i++) jc.labels[i] = -1;
+
+	for (int offset = 0; offset < jc.chunk->count;) {
+		int length = instructionLength(jc.chunk, offset);
+		if (length == 0) break;
+		if (jc.chunk->code[offset] == OP_DEFINE_LOCAL_ARRAY) jc.localArrays = true;
+		offset += length;
+	}
+
+	emitPrologue(&jc);
+	for (int offset = 0; offset < jc.chunk->count;) {
+		int length = instructionLength(jc.chunk, offset);
+		if (length == 0) {
+			jc.failed = true;
+			break;
+		}
+		jc.labels[offset] = jc.count;
+		compileInstruction(&jc, offset, length);
+		offset += length;
+	}
+	jc.labels[jc.chunk->count] = jc.count;
+
+	// the stubs for the guards, then the error exit
+	int* slowPathCode = ALLOCATE(int, jc.slowPathCount + 1);
+	for (int i = 0; i < jc.slowPathCount; i++) {
+		slowPathCode[i] = jc.count;
+		interpretInstruction(&jc, jc.slowPaths[i].start, jc.slowPaths[i].end);
+		jumpTo(&jc, JMP, TO_BYTECODE, jc.slowPaths[i].end);
+	}
+	int errorExit = jc.count;
+	movImm32(&jc, RAX, INTERPRET_RUNTIME_ERROR);
+	emitEpilogue(&jc);
+
+	for (int i = 0; i < jc.patchCount && !jc.failed; i++) {
+		JitPatch* patch = &jc.patches[i];
+		int target = errorExit;
+		if (patch->kind == TO_BYTECODE) {
+			if (patch->target < 0 || patch->target > jc.chunk->count ||
+				jc.labels[patch->target] == -1) {
+				jc.failed = true;  // not the start of an instruction
+				break;
+			}
+			target = jc.labels[patch->target];
+		}
+		else if (patch->kind == TO_SLOW_PATH) {
+			target = slowPathCode[patch->target];
+		}
+		patch32(&jc, patch->codeOffset, target);
+	}
+	FREE_ARRAY(int, slowPathCode, jc.slowPathCount + 1);
+
+	// W^X - written while it is read/write, only then made executable
+	void* memory = MAP_FAILED;
+	if (!jc.failed) {
+		memory = mmap(NULL, (size_t)jc.count, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (memory != MAP_FAILED) {
+		memcpy(memory, jc.code, (size_t)jc.count);
+		if (mprotect(memory, (size_t)jc.count, PROT_READ | PROT_EXEC) != 0) {
+			munmap(memory, (size_t)jc.count);
+			memory = MAP_FAILED;
+		}
+	}
+	if (memory != MAP_FAILED) {
+		function->jitCode = memory;
+		function->jitSize = (size_t)jc.count;
+		function->jitOffsets = jc.labels;  // kept for the entry points
+		jc.labels = NULL;
+		vm.jitFunctionCount++;
+	}
+
+	freeJitCompiler(&jc);
+	return function->jitCode != NULL;
+}
+
+void jitFreeCode(ObjFunction* function) {
+	if (function->jitCode == NULL) return;
+	munmap(function->jitCode, function->jitSize);
+	FREE_ARRAY(int, function->jitOffsets, function->chunk.count + 1);
+	function->jitCode = NULL;
+	function->jitSize = 0;
+	function->jitOffsets = NULL;
+}
+
+#endif
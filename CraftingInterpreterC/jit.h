@@ -0,0 +1,65 @@
+#pragma once
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// Baseline template JIT for x86-64 Linux - run with  clox --jit file.lox
+//
+// call() in vm.c counts the calls of every function.  When a function gets
+// hot (vm.jitThreshold calls) its bytecode is turned into machine code one
+// instruction at a time: each opcode has a fixed template that does to the
+// value stack exactly what its case in vm.c does.  Constants, locals, global
+// slots, jumps, calls, returns and the number fast paths of the arithmetic and
+// comparison opcodes are native.  Everything else - and every fast path whose
+// type guard fails, e.g. OP_ADD on two strings - hands that one instruction
+// to the interpreter (jitInterpret), so results and error messages are the
+// ones vm.c gives.
+//
+// In the native code rbx is stackTop, r12 is frame->slots, r13 the CallFrame
+// and r15 &vm.  vm.stackTop is written back before anything calls out to C.
+// The code for a function runs the whole call, OP_RETURN included.
+//
+// On-stack replacement: a function that never gets called again - the top
+// level script with one big for loop - is compiled when OP_LOOP has taken
+// vm.jitLoopThreshold back edges, and the interpreter jumps into the native
+// code at the loop header the OP_LOOP was going back to.  Nothing needs
+// converting on the way in: the native code keeps the locals in the same
+// frame->slots and the temporaries on the same value stack, so the only
+// state to map across is frame->ip, through function->jitOffsets.
+
+#ifdef JIT_X64
+
+#define JIT_HOT_CALLS 100
+#define JIT_HOT_LOOPS 1000
+
+// entry is where to start - jitCode + jitOffsets[bytecode offset]
+typedef InterpretResult (*JitFn)(CallFrame* frame, void* entry);
+
+// returns false (and leaves function->jitCode NULL) if it can't
+bool jitCompile(ObjFunction* function);
+void jitFreeCode(ObjFunction* function);
+
+// run the call from the start
+static inline InterpretResult runJitCode(CallFrame* frame) {
+	ObjFunction* function = frame->function;
+	return ((JitFn)function->jitCode)(frame, (uint8_t*)function->jitCode + function->jitOffsets[0]);
+}
+
+// carry on in native code from frame->ip (a loop header)
+static inline InterpretResult runJitCodeAt(CallFrame* frame) {
+	ObjFunction* function = frame->function;
+	int offset = function->jitOffsets[frame->ip - function->chunk.code];
+	return ((JitFn)function->jitCode)(frame, (uint8_t*)function->jitCode + offset);
+}
+
+// in vm.c - what the native code calls back into
+InterpretResult jitCall(int argCount);
+InterpretResult jitInterpret(CallFrame* frame, int startIp, int endIp);
+void jitReleaseArrays(CallFrame* frame);
+
+#endif
+
+#endif
@@ -21,6 +21,7 @@ static void addLocal(Compiler* current, Token name) {
     Local* local = &current->locals[current->localCount++];
     local->name = name;
     local->depth = -1; // Ch 22.4.2 pg 411
+    local->isArray = false;
     // local->depth = current->scopeDepth;  // Ch 22.3 pg 405 
 
     //local->isCaptured = false; // for closures
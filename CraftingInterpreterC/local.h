@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include "scanner.h"
+#include "array.h"
 //#include "compiler.h"
 
 // forward declaration
@@ -15,6 +16,9 @@ typedef struct {
     Token name;
     int depth;  // 0 is a Global, 1 is the first local scope, 2 is the second nested local scope etc.
     bool isCaptured;   // for Closures (not implemented in this repo)
+    bool isArray;      // var t(10); in a function or block - the slot holds the array
+    int arrayDimensions;
+    ArrayBound arrayBounds[MAXARRAYDIMENSIONS];  // for bounds-check elimination
 } Local;
 
 void declareLocalVariable(Compiler* current, Token* localVarToken);
@@ -1,10 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "common.h"
 
 #include "vm.h"
+#include "jit.h"
 // #include <windows.h>
 
+#ifdef JIT_X64
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 
 
 // need setting /TC in VS project settings to compile as C
@@ -129,6 +136,99 @@ static void runFile(const char* path) {
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+#ifdef JIT_X64
+// clox --jit-diff file...  runs each script twice in a child process, on the
+// interpreter and with the JIT compiling every function on its first call
+// (and every loop on its first back edge), and checks that the programs
+// printed the same thing
+// e.g.  clox --jit-diff tests/*.lox
+
+// run the script with stdout and stderr going to the file - returns the exit code
+static int runCaptured(const char* path, bool jit, FILE* out) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fileno(out), STDOUT_FILENO);
+        dup2(fileno(out), STDERR_FILENO);
+        vm.jit = jit;
+        vm.jitThreshold = 1;
+        vm.jitLoopThreshold = 1;
+        runFile(path);
+        exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// what the program printed - between the trace header and the timing
+// (the timing and the instruction counts are expected to differ)
+static char* programOutput(FILE* out) {
+    long size = ftell(out);
+    char* text = malloc(size + 1);
+    rewind(out);
+    size_t length = fread(text, 1, size, out);
+    text[length] = '\0';
+
+    char* start = strstr(text, "Execution VM trace:");
+    if (start == NULL) return text;  // compile error - compare all of it
+    char* end = strstr(start, "\n EXECUTION TIME");
+    if (end != NULL) *end = '\0';
+    memmove(text, start, strlen(start) + 1);
+    return text;
+}
+
+static void printDifference(const char* expected, const char* actual) {
+    int line = 1;
+    while (*expected != '\0' && *expected == *actual) {
+        if (*expected == '\n') line++;
+        expected++;
+        actual++;
+    }
+    while (line > 1 && expected[-1] != '\n') {
+        expected--;
+        actual--;
+    }
+    printf("  line %d of the output\n", line);
+    printf("  interpreter: %.*s\n", (int)strcspn(expected, "\n"), expected);
+    printf("  jit:         %.*s\n", (int)strcspn(actual, "\n"), actual);
+}
+
+static int jitDiff(int count, const char* paths[]) {
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        FILE* interpreted = tmpfile();
+        FILE* compiled = tmpfile();
+        if (interpreted == NULL || compiled == NULL) {
+            fprintf(stderr, "Could not create a temporary file.\n");
+            exit(74);
+        }
+        int interpretedExit = runCaptured(paths[i], false, interpreted);
+        int compiledExit = runCaptured(paths[i], true, compiled);
+        char* expected = programOutput(interpreted);
+        char* actual = programOutput(compiled);
+
+        bool same = interpretedExit == compiledExit && strcmp(expected, actual) == 0;
+        printf("%s %s\n", same ? "same   " : "DIFFERS", paths[i]);
+        if (interpretedExit != compiledExit) {
+            printf("  exit code %d, with the jit %d\n", interpretedExit, compiledExit);
+        }
+        else if (!same) {
+            printDifference(expected, actual);
+        }
+        if (!same) failures++;
+
+        free(expected);
+        free(actual);
+        fclose(interpreted);
+        fclose(compiled);
+    }
+    printf("jit-diff: %d of %d scripts differ\n", failures, count);
+    return failures == 0 ? 0 : 1;
+}
+#endif
+
 #define MAX_TOTAL_LEN 4096   // Maximum total characters to store
 #define MAX_LINE_LEN  512    // Maximum characters per line
 char * getMultipleLines(void) {
@@ -197,6 +297,56 @@ int main(int argc, const char* argv[]) {
 
     initVM();
 
+    // clox --registers [path]  runs on the register backend (regvm.c)
+    // clox --no-peephole [path]  runs the chunks as the compiler emitted them
+    // clox --jit [path]        compiles hot functions to x86-64 (jit.c)
+    // clox --jit-diff path...  checks the JIT against the interpreter
+    // clox --gc-grow n [path]  lets the heap grow n times the live bytes between collections
+    // clox --gc-slice n [path] marks incrementally, n units of work at a time
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--registers") == 0) {
+            vm.registerBackend = true;
+        }
+        else if (strcmp(argv[1], "--no-peephole") == 0) {
+            vm.peephole = false;
+        }
+        else if (strcmp(argv[1], "--jit") == 0) {
+#ifdef JIT_X64
+            vm.jit = true;
+#else
+            fprintf(stderr, "No JIT in this build - using the interpreter.\n");
+#endif
+        }
+        else if (strcmp(argv[1], "--gc-grow") == 0 && argc > 2) {
+            vm.gcGrowFactor = atof(argv[2]);
+            if (vm.gcGrowFactor < 1) {
+                fprintf(stderr, "--gc-grow needs a factor of 1 or more.\n");
+                exit(64);
+            }
+            argc--;
+            argv++;
+        }
+        else if (strcmp(argv[1], "--gc-slice") == 0 && argc > 2) {
+            vm.gcSliceBudget = atoi(argv[2]);
+            if (vm.gcSliceBudget < 1) {
+                fprintf(stderr, "--gc-slice needs a budget of 1 or more.\n");
+                exit(64);
+            }
+            argc--;
+            argv++;
+        }
+#ifdef JIT_X64
+        else if (strcmp(argv[1], "--jit-diff") == 0 && argc > 2) {
+            exit(jitDiff(argc - 2, argv + 2));
+        }
+#endif
+        else {
+            break;
+        }
+        argc--;
+        argv++;
+    }
+
     if (argc == 1) {
         repl();
     }
@@ -204,7 +354,8 @@ int main(int argc, const char* argv[]) {
         runFile(argv[1]);
     }
     else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--registers] [--no-peephole] [--jit] [--gc-grow n] [--gc-slice n] [path]\n");
+        fprintf(stderr, "       clox --jit-diff path...\n");
         exit(64);
     }
     
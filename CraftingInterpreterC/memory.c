@@ -5,9 +5,13 @@
 //< Garbage Collection memory-include-compiler
 #include "memory.h"
 #include "vm.h"
+#include "jit.h"
+#include "compiler.h"
 
 // LLM for logging
+#include <limits.h>
 #include <stdio.h>
+#include <time.h>
 
 void* allocate(size_t size) {
     void* result = malloc(size);
@@ -15,7 +19,23 @@ void* allocate(size_t size) {
     return result;
 }
 
+// the running byte count - and a collection (or a slice of one) if it's time
+static void countBytes(size_t oldSize, size_t newSize) {
+    //> Garbage Collection updated-bytes-allocated
+    vm.bytesAllocated += newSize - oldSize;
+    //< Garbage Collection updated-bytes-allocated
+    if (newSize > oldSize && !vm.minorCollecting) {
+#ifdef DEBUG_STRESS_GC
+        collectGarbage();
+#else
+        if (vm.gcPhase == GC_MARKING || vm.bytesAllocated > vm.nextGC) collectGarbage();
+#endif
+    }
+}
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    countBytes(oldSize, newSize);
+
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -28,11 +48,151 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+//> Slab allocator
+// A slab is SLAB_SIZE aligned, so a cell finds its slab by masking the address.
+// New cells are bumped off the end, freed ones go on the slab's free list.
+// The slabs of a size class that have room are on its partial list - new
+// objects come from the first one, so they end up next to each other
+#define SLAB_STEP 8
+#define SLAB_CLASSES (SLAB_MAX_CELL / SLAB_STEP)
+#define SLAB_OF(cell) ((Slab*)((uintptr_t)(cell) & ~(uintptr_t)(SLAB_SIZE - 1)))
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#define alignedAlloc(size) _aligned_malloc(size, SLAB_SIZE)
+#define alignedFree(pointer) _aligned_free(pointer)
+#else
+#define alignedAlloc(size) aligned_alloc(SLAB_SIZE, size)
+#define alignedFree(pointer) free(pointer)
+#endif
+
+typedef struct Slab {
+    struct Slab* next;         // all the slabs of the size class
+    struct Slab* nextPartial;  // the ones with room
+    void* freeList;            // freed cells, each holds the next one
+    int cellSize;
+    int capacity;
+    int bumped;                // cells handed out from the end so far
+    int live;
+    bool partial;              // on the partial list
+} Slab;
+
+#define SLAB_HEADER ((sizeof(Slab) + 15) & ~(size_t)15)
+
+typedef struct {
+    Slab* slabs;
+    Slab* partial;
+} SlabClass;
+
+static SlabClass slabClasses[SLAB_CLASSES];
+
+static Slab* newSlab(SlabClass* slabClass, int cellSize) {
+    Slab* slab = (Slab*)alignedAlloc(SLAB_SIZE);
+    if (slab == NULL) exit(1);
+    slab->cellSize = cellSize;
+    slab->capacity = (int)((SLAB_SIZE - SLAB_HEADER) / cellSize);
+    slab->bumped = 0;
+    slab->live = 0;
+    slab->freeList = NULL;
+    slab->next = slabClass->slabs;
+    slabClass->slabs = slab;
+    slab->partial = true;
+    slab->nextPartial = slabClass->partial;
+    slabClass->partial = slab;
+    vm.slabCount++;
+    return slab;
+}
+
+void* allocateCell(size_t size) {
+    if (size > SLAB_MAX_CELL) return reallocate(NULL, 0, size);
+    countBytes(0, size);  // first - a sweep can give slabs back
+
+    int sizeClass = (int)((size - 1) / SLAB_STEP);
+    SlabClass* slabClass = &slabClasses[sizeClass];
+    Slab* slab = slabClass->partial;
+    if (slab == NULL) slab = newSlab(slabClass, (sizeClass + 1) * SLAB_STEP);
+
+    void* cell;
+    if (slab->freeList != NULL) {
+        cell = slab->freeList;
+        slab->freeList = *(void**)cell;
+    }
+    else {
+        cell = (uint8_t*)slab + SLAB_HEADER + (size_t)slab->bumped++ * slab->cellSize;
+    }
+    slab->live++;
+
+    if (slab->freeList == NULL && slab->bumped == slab->capacity) {
+        slabClass->partial = slab->nextPartial;  // full
+        slab->partial = false;
+    }
+    return cell;
+}
+
+void freeCell(void* cell, size_t size) {
+    if (size > SLAB_MAX_CELL) {
+        reallocate(cell, size, 0);
+        return;
+    }
+    countBytes(size, 0);
+
+    Slab* slab = SLAB_OF(cell);
+    *(void**)cell = slab->freeList;
+    slab->freeList = cell;
+    slab->live--;
+    if (!slab->partial) {
+        SlabClass* slabClass = &slabClasses[slab->cellSize / SLAB_STEP - 1];
+        slab->partial = true;
+        slab->nextPartial = slabClass->partial;
+        slabClass->partial = slab;
+    }
+}
+
+// after a sweep - the partial lists are made again without the empty slabs
+static void releaseEmptySlabs() {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        SlabClass* slabClass = &slabClasses[i];
+        slabClass->partial = NULL;
+        Slab** link = &slabClass->slabs;
+        while (*link != NULL) {
+            Slab* slab = *link;
+            if (slab->live == 0) {
+                *link = slab->next;
+                alignedFree(slab);
+                vm.slabCount--;
+                vm.slabsReleased++;
+                continue;
+            }
+            slab->partial = slab->freeList != NULL || slab->bumped < slab->capacity;
+            if (slab->partial) {
+                slab->nextPartial = slabClass->partial;
+                slabClass->partial = slab;
+            }
+            link = &slab->next;
+        }
+    }
+}
+
+static void freeSlabs() {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        Slab* slab = slabClasses[i].slabs;
+        while (slab != NULL) {
+            Slab* next = slab->next;
+            alignedFree(slab);
+            slab = next;
+        }
+        slabClasses[i].slabs = NULL;
+        slabClasses[i].partial = NULL;
+    }
+    vm.slabCount = 0;
+}
+//< Slab allocator
+
 // Added Ch 19.5
 static void freeObject(Obj* object) {
-    // #ifdef DEBUG_LOG_GC
+#ifdef DEBUG_LOG_GC
     printf("%p free type %d\n", (void*)object, object->type);
-    // #endif
+#endif
     switch (object->type) {
         /*
         case OBJ_BOUND_METHOD:
@@ -64,25 +224,329 @@ static void freeObject(Obj* object) {
         case OBJ_FUNCTION: {  // added Ch 24.1 pg 435
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            freeChunk(&function->registerChunk);
+#ifdef JIT_X64
+            jitFreeCode(function);
+#endif
+            FREE_OBJ(ObjFunction, object);
             break;
         }
 
        
         case OBJ_NATIVE:
-            FREE(ObjNative, object);
+            FREE_OBJ(ObjNative, object);
             break;
+        case OBJ_SLICE:
+            FREE_OBJ(ObjSlice, object);
+            break;
+        case OBJ_BUILDER: {
+            StringBuffer* buffer = ((ObjBuilder*)object)->buffer;
+            if (--buffer->builders == 0) {
+                FREE_ARRAY(char, buffer->chars, buffer->capacity);
+                FREE(StringBuffer, buffer);
+            }
+            FREE_OBJ(ObjBuilder, object);
+            break;
+        }
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
+#ifdef DEBUG_LOG_GC
             printf("  free string %s\n", string->chars);
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+#endif
+            freeCell(object, STRING_SIZE(string->length));
             break;
         }
         
     }
 }
 
+//> Garbage Collection Ch 26
+void markObject(Obj* object) {
+    if (object == NULL) return;
+    if (object->isMarked) return;
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    object->isMarked = true;
+
+    // nothing to trace in these - black straight away
+    if (object->type == OBJ_STRING || object->type == OBJ_NATIVE || object->type == OBJ_SLICE ||
+        object->type == OBJ_BUILDER) return;
+
+    // not through reallocate - that could start another collection
+    if (vm.grayCapacity < vm.grayCount + 1) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+        if (vm.grayStack == NULL) exit(1);
+    }
+    vm.grayStack[vm.grayCount++] = object;
+}
+
+void markValue(Value value) {
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        markValue(array->values[i]);
+    }
+}
+
+// the objects a marked object points to - returns the work it took
+static int blackenObject(Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            markObject((Obj*)function->name);
+            markArray(&function->chunk.constants);
+            markArray(&function->registerChunk.constants);  // the JIT and regvm use chunk's
+            return 1 + function->chunk.constants.count + function->registerChunk.constants.count;
+        }
+        default:    // strings, natives, slices and builders never get gray (markObject)
+            return 1;
+    }
+}
+
+// marked at the start of a collection and again at the end, since nothing
+// marks what goes into them meanwhile - small enough to do in one go
+static void markSmallRoots() {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        markValue(*slot);
+    }
+    for (int i = 0; i < vm.frameCount; i++) {
+        markObject((Obj*)vm.frames[i].function);
+    }
+
+    markTable(&vm.globals);
+    markArray(&vm.globalNames);
+    markTable(&vm.globalArrayVars);
+    markArray(&vm.crossSectionValues);
+    markLocalArrays(&vm.localArrays);
+    markCompilerRoots();
+}
+
+static bool bigRootsDone() {
+    return vm.gcGlobalCursor >= vm.globalValues.count &&
+        vm.gcArrayCursor.block == NULL && vm.gcArrayCursor.large;
+}
+
+// the gray objects, then the global values and the array elements - they are
+// written through a barrier (markingBarrier), so they are only looked at once.
+// false if the budget runs out first
+static bool markSlice(int budget) {
+    int work = 0;
+    while (work < budget) {
+        if (vm.grayCount > 0) {
+            work += blackenObject(vm.grayStack[--vm.grayCount]);
+        }
+        else if (vm.gcGlobalCursor < vm.globalValues.count) {
+            markValue(vm.globalValues.values[vm.gcGlobalCursor++]);
+            work++;
+        }
+        else if (!bigRootsDone()) {
+            work += markArraysStep(&vm.arrayVarList, &vm.gcArrayCursor, budget - work);
+        }
+        else {
+            return true;
+        }
+    }
+    return vm.grayCount == 0 && bigRootsDone();
+}
+
+static void beginMarking() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+    vm.gcPhase = GC_MARKING;
+    vm.gcGlobalCursor = 0;
+    startArrayCursor(&vm.arrayVarList, &vm.gcArrayCursor);
+    markSmallRoots();
+}
+
+static void sweep() {
+    Obj* previous = NULL;
+    Obj* object = vm.objects;
+    while (object != NULL) {
+        if (object->isMarked) {
+            object->isMarked = false;
+            previous = object;
+            object = object->next;
+        }
+        else {
+            Obj* unreached = object;
+            object = object->next;
+            if (previous != NULL) {
+                previous->next = object;
+            }
+            else {
+                vm.objects = object;
+            }
+
+            freeObject(unreached);
+        }
+    }
+}
+
+// young strings aren't on vm.objects - sweep() never sees them.  The dead
+// ones stay in the nursery until the next minor collection (tableRemoveWhite
+// has already dropped them from vm.strings), the live ones go back to white
+static void sweepNursery() {
+    for (uint8_t* at = vm.nursery; at < vm.nurseryTop; ) {
+        ObjString* young = (ObjString*)at;
+        young->obj.isMarked = false;
+        at += youngStringSize(young->length);
+    }
+}
+
+static void finishCollection() {
+    size_t before = vm.bytesAllocated;
+
+    markSmallRoots();
+    while (vm.grayCount > 0) blackenObject(vm.grayStack[--vm.grayCount]);
+    tableRemoveWhite(&vm.strings);  // interned strings nothing else points to
+    sweep();
+    sweepNursery();
+    releaseEmptySlabs();
+    vm.gcPhase = GC_IDLE;
+
+    vm.nextGC = (size_t)(vm.bytesAllocated * vm.gcGrowFactor);
+    if (vm.nextGC < GC_FIRST_COLLECTION) vm.nextGC = GC_FIRST_COLLECTION;
+    vm.gcCount++;
+    vm.gcFreed += before - vm.bytesAllocated;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+        before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+static void recordPause(clock_t ticks) {
+    double seconds = (double)ticks / CLOCKS_PER_SEC;
+    int bucket = 0;
+    for (double limit = 0.00001; bucket < GC_PAUSE_BUCKETS - 1 && seconds >= limit; limit *= 10) bucket++;
+    vm.gcPauses[bucket]++;
+    if (seconds > vm.gcLongestPause) vm.gcLongestPause = seconds;
+}
+
+void printGCPauses() {
+    static const char* buckets[GC_PAUSE_BUCKETS] = { "<10us", "<100us", "<1ms", "<10ms", "<100ms", "more" };
+    printf(" gc pauses:");
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        printf("%s %s %d", i == 0 ? "" : ",", buckets[i], vm.gcPauses[i]);
+    }
+    printf(" - longest %.3f ms\n", vm.gcLongestPause * 1000);
+}
+
+void collectGarbage() {
+    clock_t start = clock();
+    if (vm.gcPhase == GC_IDLE) beginMarking();
+
+    if (vm.gcSliceBudget == 0) {
+        markSlice(INT_MAX);
+        finishCollection();
+    }
+    else if (markSlice(vm.gcSliceBudget)) {
+        finishCollection();
+    }
+    vm.gcSlices += vm.gcSliceBudget > 0;
+    recordPause(clock() - start);
+}
+
+// the remembered sets grow with plain realloc, like the gray stack
+void rememberSlot(Value* slot) {
+    // a loop storing into the same element over and over only needs it once
+    if (vm.rememberedCount > 0 && vm.rememberedSlots[vm.rememberedCount - 1] == slot) return;
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.rememberedSlots = (Value**)realloc(vm.rememberedSlots, sizeof(Value*) * vm.rememberedCapacity);
+        if (vm.rememberedSlots == NULL) exit(1);
+    }
+    vm.rememberedSlots[vm.rememberedCount++] = slot;
+}
+
+void rememberGlobal(int slot) {
+    if (vm.rememberedGlobalCount > 0 && vm.rememberedGlobals[vm.rememberedGlobalCount - 1] == slot) return;
+    if (vm.rememberedGlobalCapacity < vm.rememberedGlobalCount + 1) {
+        vm.rememberedGlobalCapacity = GROW_CAPACITY(vm.rememberedGlobalCapacity);
+        vm.rememberedGlobals = (int*)realloc(vm.rememberedGlobals, sizeof(int) * vm.rememberedGlobalCapacity);
+        if (vm.rememberedGlobals == NULL) exit(1);
+    }
+    vm.rememberedGlobals[vm.rememberedGlobalCount++] = slot;
+}
+
+// a young string's obj.next is its old copy once it has one
+static void promote(Value* slot) {
+    if (!isYoung(*slot)) return;
+    ObjString* young = AS_STRING(*slot);
+    if (young->obj.next == NULL) {
+        ObjString* old = (ObjString*)allocateCell(STRING_SIZE(young->length));
+        memcpy(old, young, STRING_SIZE(young->length));  // the chars go with it
+        old->obj.isMarked = vm.gcPhase == GC_MARKING;
+        old->obj.next = vm.objects;
+        vm.objects = (Obj*)old;
+        young->obj.next = (Obj*)old;
+        vm.promotedCount++;
+    }
+    *slot = OBJ_VAL(young->obj.next);
+}
+
+// minor collection - the work is the stack, the remembered slots and one
+// pass over the nursery to let vm.strings know what moved or died
+void collectNursery() {
+    if (vm.nurseryTop == vm.nursery) return;
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc begin\n");
+#endif
+    clock_t start = clock();
+    vm.minorCollecting = true;
+
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        promote(slot);
+    }
+    for (int i = 0; i < vm.crossSectionValues.count; i++) {
+        promote(&vm.crossSectionValues.values[i]);
+    }
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        promote(vm.rememberedSlots[i]);
+    }
+    for (int i = 0; i < vm.rememberedGlobalCount; i++) {
+        promote(&vm.globalValues.values[vm.rememberedGlobals[i]]);
+    }
+
+    for (uint8_t* at = vm.nursery; at < vm.nurseryTop; ) {
+        ObjString* young = (ObjString*)at;
+        if (young->obj.next != NULL) {
+            tableReplaceKey(&vm.strings, young, (ObjString*)young->obj.next);
+        }
+        else {  // a major collection may have dropped it already
+#ifdef DEBUG_LOG_GC
+            printf("  free young string %s\n", young->chars);
+#endif
+            tableDelete(&vm.strings, young);
+        }
+        at += youngStringSize(young->length);
+    }
+
+    vm.nurseryTop = vm.nursery;
+    vm.rememberedCount = 0;
+    vm.rememberedGlobalCount = 0;
+    vm.minorCollecting = false;
+    vm.minorCount++;
+    recordPause(clock() - start);
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+#endif
+}
+//< Garbage Collection
+
 // Added Ch 19.5
 void freeObjects() {
     printf("free All Objects\n");
@@ -92,4 +556,6 @@ void freeObjects() {
         freeObject(object);
         object = next;
     }
+    vm.nurseryTop = vm.nursery;
+    freeSlabs();
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 // added CH 19.3 page 347
 #define ALLOCATE(type, count) \
@@ -22,16 +23,96 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// the heap can grow to this many times what was live after a collection
+// before the next one - clox --gc-grow n changes it (vm.gcGrowFactor)
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_FIRST_COLLECTION (1024 * 1024)
+
 void* allocate(size_t size);
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
-/*
+// objects up to SLAB_MAX_CELL bytes (ObjString, ObjNative, ObjFunction,
+// ObjSlice) come out of SLAB_SIZE slabs, one set per 8 byte size class - see
+// memory.c.  They are counted in vm.bytesAllocated like reallocate's
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MAX_CELL 256
+
+void* allocateCell(size_t size);
+void freeCell(void* cell, size_t size);
+#define FREE_OBJ(type, pointer) freeCell(pointer, sizeof(type))
 
-//> Garbage Collection 
+//> Garbage Collection - Ch 26
+// mark-sweep: reallocate() collects when vm.bytesAllocated passes vm.nextGC
+// (or on every allocation with DEBUG_STRESS_GC).  The roots are the stack,
+// the frames, the globals, the array elements and what the compiler is
+// working on - an object only a C local points to has to be pushed first
+//
+// With clox --gc-slice n the marking is incremental: collectGarbage() starts
+// it and then every allocation does another n units of work (an object traced
+// or a global or array element looked at) until the gray stack and the big
+// roots run out.  Then the stack, frames and other small roots are marked
+// again and the sweep is done in one go.  Objects made meanwhile are black.
 void markObject(Obj* object);
 void markValue(Value value);
 void collectGarbage();
-*/
+void printGCPauses();
+
+// a value stored where the marking may already have been can't stay white -
+// the stack is marked again at the end, so OP_SET_LOCAL doesn't need this
+static inline void markingBarrier(Value value) {
+    if (vm.gcPhase == GC_MARKING) markValue(value);
+}
+
+// Generational nursery - the strings a + b makes at run time are bump
+// allocated in vm.nursery (concatenateStrings), chars and all, 8 byte aligned;
+// everything else is old, and so is a result longer than NURSERY_MAX_STRING.
+// When the nursery is full the next concatenation first runs a minor
+// collection: the young strings the stack or a remembered slot points to are
+// copied into the old space and the slots updated, the rest are dropped.
+// Young strings move, so that only happens at nurserySafepoint() - no C local
+// may hold one there.  A major collection marks them but never moves them.
+// Storing a young string anywhere but the stack (a global, an array element)
+// has to go through a write barrier so the slot is remembered - the same
+// barrier does markingBarrier().
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MAX_STRING (NURSERY_SIZE / 16)
+
+static inline size_t youngStringSize(int length) {
+    return (STRING_SIZE(length) + 7) & ~(size_t)7;
+}
+
+static inline bool isYoung(Value value) {
+    return IS_OBJ(value) &&
+        (uintptr_t)AS_OBJ(value) - (uintptr_t)vm.nursery < NURSERY_SIZE;
+}
+
+void rememberSlot(Value* slot);
+void rememberGlobal(int slot);
+void collectNursery();
+
+// after storing value in an array element
+static inline void writeBarrier(Value* slot, Value value) {
+    if (isYoung(value)) rememberSlot(slot);
+    markingBarrier(value);
+}
+
+// after storing value in vm.globalValues - that can grow, so the slot number is kept
+static inline void globalWriteBarrier(int slot, Value value) {
+    if (isYoung(value)) rememberGlobal(slot);
+    markingBarrier(value);
+}
+
+// before concatenateStrings - room for a young string of length chars
+static inline void nurserySafepoint(int length) {
+#ifdef DEBUG_STRESS_GC
+    collectNursery();
+#else
+    size_t size = youngStringSize(length);
+    if (size <= NURSERY_MAX_STRING && vm.nurseryTop + size > vm.nursery + NURSERY_SIZE) {
+        collectNursery();
+    }
+#endif
+}
 
 void freeObjects(); // Ch 19.5
 
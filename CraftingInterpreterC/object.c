@@ -14,9 +14,9 @@
 
 // ch 19.4 page 348
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = (Obj*)allocateCell(size);
     object->type = type;
-    object->isMarked = false;
+    object->isMarked = vm.gcPhase == GC_MARKING;  // black while a collection is under way
 
     object->next = vm.objects; // Ch 19.5 - chain for eventual GC
     vm.objects = object;
@@ -36,6 +36,13 @@ ObjFunction* newFunction() {
     function->upvalueCount = 0;
     function->name = NULL;
     initChunk(&function->chunk);
+    initChunk(&function->registerChunk);
+    function->registerCount = 0;
+    function->callCount = 0;
+    function->loopCount = 0;
+    function->jitCode = NULL;
+    function->jitSize = 0;
+    function->jitOffsets = NULL;
     return function;
 }
 
@@ -52,6 +59,13 @@ ObjNative* newNative(NativeFn function) {
     return native;
 }
 
+// the subscripts have been checked (checkCrossSection)
+ObjSlice* newSlice(ArrayVariable* varDefn, Value subscripts[]) {
+    ObjSlice* slice = ALLOCATE_OBJ(ObjSlice, OBJ_SLICE);
+    crossSectionView(varDefn, subscripts, &slice->view);
+    return slice;
+}
+
 /*
 //> Methods and Initializers new-bound-method
 ObjBoundMethod* newBoundMethod(Value receiver,
@@ -103,21 +117,52 @@ ObjInstance* newInstance(ObjClass* klass) {
 }
 */
 
-// Ch 19.4 page 348
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// a string made at run time goes in the nursery (see memory.h) - off the
+// vm.objects list, obj.next is where it was promoted to
+static ObjString* allocateYoungString(int length) {
+    size_t size = youngStringSize(length);
+    if (size > NURSERY_MAX_STRING || vm.nurseryTop + size > vm.nursery + NURSERY_SIZE) {
+        // too long for the nursery, or no nurserySafepoint() before it
+        return (ObjString*)allocateObject(STRING_SIZE(length), OBJ_STRING);
+    }
+    ObjString* string = (ObjString*)vm.nurseryTop;
+    vm.nurseryTop += size;
+    string->obj.type = OBJ_STRING;
+    string->obj.isMarked = vm.gcPhase == GC_MARKING;
+    string->obj.next = NULL;
+    return string;
+}
+
+// Ch 19.4 page 348 - room for length chars, the caller writes them
+static ObjString* allocateString(int length, bool young) {
+    ObjString* string = young ? allocateYoungString(length)
+        : (ObjString*)allocateObject(STRING_SIZE(length), OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// the string just allocated was interned already - nothing was allocated
+// after it, so it's still the nursery top or the head of vm.objects
+static void discardString(ObjString* string) {
+    if (isYoung(OBJ_VAL(string))) {
+        vm.nurseryTop = (uint8_t*)string;
+        return;
+    }
+    vm.objects = string->obj.next;
+    freeCell(string, STRING_SIZE(string->length));
+}
+
+static ObjString* addString(ObjString* string, uint32_t hash) {
     string->hash = hash;
 
     // Garbage Collection push-string added in CH 26.6 
-    // push into vm stack temporarily before doing GC ...
-
-    // LLM GC push(OBJ_VAL(string));
+    // push into vm stack temporarily - growing vm.strings can collect
+    push(OBJ_VAL(string));
     
     tableSet(&vm.strings, string, NIL_VAL);
     
-    // LLM GC pop();
+    pop();
 
     //< Garbage Collection pop-string
     //< Hash Tables allocate-store-string
@@ -134,22 +179,33 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
+// ch 19.4.1 page 351 take ownership of string - the chars live in the
+// object now, so that's a copy and the caller's buffer goes
+ObjString* takeString(char* chars, int length) {
+    ObjString* string = copyString(chars, length);
+    FREE_ARRAY(char, chars, length + 1);
+    return string;
+}
 
-// ch 19.4.1 page 351 take ownership of string
+// a + b for strings, written straight into the new string.  The backends
+// make it young - nurserySafepoint() has to come first, while a and b are
+// still on the stack.  The compiler's constant folding makes it old.
+ObjString* concatenateStrings(ObjString* a, ObjString* b, bool young) {
+    int length = a->length + b->length;
+    ObjString* string = allocateString(length, young);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
 
-ObjString* takeString(char* chars, int length) {
-    
-    uint32_t hash = hashString(chars, length);  // added in Ch 20.4.1
-  
     /* Added in Ch 20.5 pg 378 */
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
+    uint32_t hash = hashString(string->chars, length);
+    ObjString* interned = tableFindString(&vm.strings, string->chars, length,
         hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        discardString(string);
+        markingBarrier(OBJ_VAL(interned));
         return interned;
     }
-
-    return allocateString(chars, length, hash);
+    return addString(string, hash);
 }
 
 // file and method created in Ch 19.3 page 347
@@ -159,12 +215,92 @@ ObjString* copyString(const char* chars, int length) {
     /* Added in Ch 20.5 pg 378 */
     ObjString* interned = tableFindString(&vm.strings, chars, length,
         hash);
-    if (interned != NULL) return interned;
+    if (interned != NULL) {
+        // it may be white and about to be stored somewhere already black
+        markingBarrier(OBJ_VAL(interned));
+        return interned;
+    }
         
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = allocateString(length, false);
+    memcpy(string->chars, chars, length);
+    return addString(string, hash);
+}
+
+// a string or a builder - a builder's chars go on past its length
+static const char* stringChars(Value value, int* length) {
+    if (IS_BUILDER(value)) {
+        *length = AS_BUILDER(value)->length;
+        return AS_BUILDER(value)->buffer->chars;
+    }
+    *length = AS_STRING(value)->length;
+    return AS_STRING(value)->chars;
+}
+
+// a + b when a is a builder or the result is long - amortized O(length of b)
+static ObjBuilder* appendString(Value a, Value b) {
+    int aLength, bLength;
+    stringChars(a, &aLength);
+    stringChars(b, &bLength);
+    int length = aLength + bLength;
+
+    StringBuffer* buffer;
+    bool fresh = !IS_BUILDER(a) || AS_BUILDER(a)->buffer->length != aLength;
+    if (fresh) {
+        buffer = ALLOCATE(StringBuffer, 1);
+        buffer->length = 0;
+        buffer->capacity = 0;
+        buffer->builders = 0;
+        buffer->chars = NULL;
+    }
+    else {
+        buffer = AS_BUILDER(a)->buffer;  // a is the longest one on it
+    }
+    if (buffer->capacity < length + 1) {
+        int oldCapacity = buffer->capacity;
+        buffer->capacity = length * 2;
+        buffer->chars = GROW_ARRAY(char, buffer->chars, oldCapacity, buffer->capacity);
+    }
+
+    // read again - b may be a builder on this buffer (s + s)
+    if (fresh) memcpy(buffer->chars, stringChars(a, &aLength), aLength);
+    memcpy(buffer->chars + aLength, stringChars(b, &bLength), bLength);
+    buffer->length = length;
+    buffer->chars[length] = '\0';
+
+    // can collect - a is on the stack and keeps a shared buffer alive
+    ObjBuilder* builder = ALLOCATE_OBJ(ObjBuilder, OBJ_BUILDER);
+    builder->length = length;
+    builder->buffer = buffer;
+    buffer->builders++;
+    return builder;
+}
+
+// a + b for any two strings - shared by both backends.  a and b point at stack
+// slots (or a constant), read again after nurserySafepoint() may move them
+Value addStrings(Value* a, Value* b) {
+    int aLength, bLength;
+    stringChars(*a, &aLength);
+    stringChars(*b, &bLength);
+    if (aLength + bLength >= BUILDER_MIN_LENGTH) {  // always so with a builder
+        return OBJ_VAL(appendString(*a, *b));
+    }
+    nurserySafepoint(aLength + bLength);
+    return OBJ_VAL(concatenateStrings(AS_STRING(*a), AS_STRING(*b), true));
+}
+
+// the interned string with a builder's chars
+ObjString* flattenString(ObjBuilder* builder) {
+    return copyString(builder->buffer->chars, builder->length);
+}
+
+// a == b when one of them is a builder - never the same object as an equal
+// string, so that's a compare of the chars
+bool builderEquals(Value a, Value b) {
+    if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b)) return false;
+    int aLength, bLength;
+    const char* aChars = stringChars(a, &aLength);
+    const char* bChars = stringChars(b, &bLength);
+    return aLength == bLength && memcmp(aChars, bChars, aLength) == 0;
 }
 
 /*
@@ -218,9 +354,28 @@ void printObject(Value value) {
     case OBJ_STRING:
         printf("%s", AS_CSTRING(value));
         break;
+    case OBJ_BUILDER:
+        printf("%.*s", AS_BUILDER(value)->length, AS_BUILDER(value)->buffer->chars);
+        break;
     case OBJ_FUNCTION:
         printFunction(AS_FUNCTION(value));  // added Ch 24.1
         break;
+    case OBJ_SLICE: {
+        // the elements, in row-major order
+        ArrayVariable* view = &AS_SLICE(value)->view;
+        Value all[MAXARRAYDIMENSIONS] = { ARRAY_STAR_VAL, ARRAY_STAR_VAL, ARRAY_STAR_VAL };
+        if (arrayReleased(&vm.localArrays, view)) {
+            printf("<slice of a released array>");
+            break;
+        }
+        printf("(");
+        for (int i = 0; i < view->count; i++) {
+            if (i > 0) printf(", ");
+            printValue(*crossSectionElement(view, all, i));
+        }
+        printf(")");
+        break;
+    }
     }
     
 }
@@ -5,6 +5,7 @@
 #include "common.h"
 #include "chunk.h"
 #include "value.h"
+#include "array.h"
 
 // AS_OBJ is defined in value.h, gets us the (value).as.obj
 
@@ -18,6 +19,9 @@
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_SLICE(value)        isObjType(value, OBJ_SLICE)
+#define IS_BUILDER(value)      isObjType(value, OBJ_BUILDER)
+#define IS_ANY_STRING(value)   (IS_STRING(value) || IS_BUILDER(value))
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
@@ -28,6 +32,8 @@
     (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_SLICE(value)        ((ObjSlice*)AS_OBJ(value))
+#define AS_BUILDER(value)      ((ObjBuilder*)AS_OBJ(value))
 
 typedef enum {
     OBJ_BOUND_METHOD,
@@ -37,7 +43,9 @@ typedef enum {
     OBJ_INSTANCE,
     OBJ_NATIVE,
     OBJ_STRING, // introduced Ch 19.2 page 344
-    OBJ_UPVALUE
+    OBJ_UPVALUE,
+    OBJ_SLICE,
+    OBJ_BUILDER
 } ObjType;
 
 // introduced Ch 19.2 page 344
@@ -58,6 +66,13 @@ typedef struct {
     int upvalueCount;
     Chunk chunk;
     ObjString* name;
+    Chunk registerChunk;  // same code for the register backend - empty if not translated (regvm.h)
+    int registerCount;    // registers (frame slots) the register code uses
+    int callCount;        // calls so far - the JIT compiles the function when it gets hot (jit.h)
+    int loopCount;        // OP_LOOP back edges taken - hot loops are compiled too (on-stack replacement)
+    void* jitCode;        // native code, NULL until compiled
+    size_t jitSize;
+    int* jitOffsets;      // bytecode offset -> offset in jitCode, -1 inside an instruction
 } ObjFunction;
 
 typedef Value(*NativeFn)(int argCount, Value* args);
@@ -70,13 +85,26 @@ typedef struct {
 // introduced Ch 19.2 page 344
 // we can cast this to Obj*, or downcast an Obj* to an ObjString*
 // in debugger use a watch (ObjString*) value.as.obj
+// the chars follow the header in the same allocation - one malloc (or slab
+// cell) per string, and the intern table's memcmp reads memory next to the
+// hash it just compared
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash; // aded in Ch 20.4.1 pg 367
+    char chars[];
 };
 
+// bytes for a string of length chars, the terminator included
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// A(lo:hi), A(*), m(5,*) ... anywhere but the right hand side of a(*) = ...
+// a view of the array - no elements of its own, see crossSectionView() in array.c
+typedef struct {
+    Obj obj;
+    ArrayVariable view;
+} ObjSlice;
+
 // Array dimension
 typedef struct ObjArrayDimension {
     short lBound;
@@ -93,6 +121,30 @@ struct ObjArray {
 };
 
 
+// the chars of a string being built by + - shared by every ObjBuilder that
+// is a prefix of them, freed with the last one
+typedef struct {
+    int length;     // chars written so far
+    int capacity;
+    int builders;   // ObjBuilders pointing here
+    char* chars;
+} StringBuffer;
+
+// s = s + piece once s is long - copying s every time makes a loop of those
+// quadratic, so instead the piece is appended to s's buffer in place (when
+// nothing was appended after s yet) and the result is a new header with the
+// longer length.  Nothing is hashed or interned: print and == read the buffer,
+// and it only becomes an ObjString when it has to (flattenString - the
+// arguments of a native).
+typedef struct {
+    Obj obj;
+    int length;
+    StringBuffer* buffer;
+} ObjBuilder;
+
+// a + b shorter than this stays an ObjString
+#define BUILDER_MIN_LENGTH 256
+
 /* not implemented in this repo
 typedef struct ObjUpvalue {
     Obj obj;
@@ -161,6 +213,11 @@ ObjFunction* newFunction(); // Ch 24.1 pg 434
 ObjNative* newNative(NativeFn function);  // Ch 24.7 pg 459
 ObjString* takeString(char* chars, int length); // ch 19.4.1 page 351 take ownership of string
 ObjString* copyString(const char* chars, int length);
+ObjString* concatenateStrings(ObjString* a, ObjString* b, bool young);
+Value addStrings(Value* a, Value* b);
+ObjString* flattenString(ObjBuilder* builder);
+bool builderEquals(Value a, Value b);
+ObjSlice* newSlice(ArrayVariable* varDefn, Value subscripts[]);
 void printObject(Value value);
 
 // introduced Ch 19.2 page 345
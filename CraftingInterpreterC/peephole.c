@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "memory.h"
+#include "peephole.h"
+#include "vm.h"
+
+// Peephole pass (see peephole.h)
+//
+// The chunk is decoded into a list of instructions first.  Jump targets are
+// kept as the old bytecode offset and removing an instruction just marks it
+// deleted, so a jump to it ends up at the next one still there.  The rules
+// run over the list until nothing changes, then the list is written back.
+
+typedef struct {
+	int offset;			// where it was in the chunk
+	int length;			// bytes now - a rewrite can change it
+	uint8_t op;
+	int operands;		// the operand bytes are copied from here (offset + 1 unless rewritten)
+	int target;			// old offset a jump goes to, -1 if not a jump
+	bool label;			// something jumps here
+	bool deleted;
+	int newOffset;
+} Instruction;
+
+typedef struct {
+	Chunk* chunk;
+	Instruction* code;
+	int count;
+	int* index;			// old offset -> instruction, -1 inside one; index[chunk->count] == count
+} Peephole;
+
+static uint16_t readShort(Chunk* chunk, int offset) {
+	return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// length of every instruction the compiler emits, 0 for anything else
+static int instructionLength(Chunk* chunk, int offset) {
+	switch (chunk->code[offset]) {
+	case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_POP:
+	case OP_EQUAL: case OP_NOT_EQUAL: case OP_GREATER: case OP_LESS:
+	case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE: case OP_RANDOM:
+	case OP_NOT: case OP_NEGATE: case OP_PRINT: case OP_RETURN:
+	case OP_RANGE:
+		return 1;
+	case OP_CONSTANT: case OP_GET_LOCAL: case OP_SET_LOCAL:
+	case OP_ADD_CONST: case OP_CALL:
+	case OP_RELEASE_ARRAYS:
+		return 2;
+	case OP_GET_LOCAL2:
+	case OP_GET_GLOBAL_SLOT: case OP_SET_GLOBAL_SLOT: case OP_DEFINE_GLOBAL_SLOT:
+	case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE: case OP_LOOP:
+	case OP_LESS_JUMP_IF_FALSE: case OP_GREATER_JUMP_IF_FALSE:
+	case OP_JUMP_LONG: case OP_JUMP_IF_FALSE_LONG: case OP_POP_JUMP_IF_FALSE_LONG: case OP_LOOP_LONG:
+	case OP_LESS_JUMP_IF_FALSE_LONG: case OP_GREATER_JUMP_IF_FALSE_LONG:
+	case OP_DEFINE_GLOBAL:			// name16
+		return 3;
+	case OP_CONSTANT_LONG:
+	case OP_CROSS_SECTION:			// name16, subscript count
+	case OP_SET_CROSS_SECTION:		// jump16, subscript count
+	case OP_GET_CROSS_SECTION:		// name16, subscript count
+	case OP_SLICE:					// name16, subscript count
+		return 4;
+	case OP_GET_GLOBAL_ARRAY: case OP_SET_GLOBAL_ARRAY:
+	case OP_GET_ARRAY_UNCHECKED: case OP_SET_ARRAY_UNCHECKED:	// name16, subscript count, cache16
+		return 6;
+	case OP_ARRAY_KERNEL:			// jump16, kernel, b16, c16
+		return 8;
+	case OP_GET_GLOBAL: case OP_SET_GLOBAL:	// name16, cache16
+		return 5;
+	case OP_DEFINE_GLOBAL_ARRAY:	// name16, subscript count, var count32, bounds 2 x 32 each
+	case OP_DEFINE_LOCAL_ARRAY:
+		return 8 + 8 * chunk->code[offset + 3];
+	default:
+		return 0;
+	}
+}
+
+static bool isJump(uint8_t op) {
+	return op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_FALSE ||
+		op == OP_LESS_JUMP_IF_FALSE || op == OP_GREATER_JUMP_IF_FALSE;
+}
+
+// the forward only ones
+static bool isConditionalJump(uint8_t op) {
+	return isJump(op) && op != OP_JUMP && op != OP_LOOP;
+}
+
+// the rules only see the short jumps - decode turns a *_LONG one into its
+// short opcode and encode picks the long one again if it still needs it
+static uint8_t shortJump(uint8_t op) {
+	switch (op) {
+	case OP_JUMP_LONG:						return OP_JUMP;
+	case OP_JUMP_IF_FALSE_LONG:				return OP_JUMP_IF_FALSE;
+	case OP_POP_JUMP_IF_FALSE_LONG:			return OP_POP_JUMP_IF_FALSE;
+	case OP_LESS_JUMP_IF_FALSE_LONG:		return OP_LESS_JUMP_IF_FALSE;
+	case OP_GREATER_JUMP_IF_FALSE_LONG:		return OP_GREATER_JUMP_IF_FALSE;
+	case OP_LOOP_LONG:						return OP_LOOP;
+	default:								return OP_INVALID;
+	}
+}
+
+static uint8_t longJump(uint8_t op) {
+	switch (op) {
+	case OP_JUMP:						return OP_JUMP_LONG;
+	case OP_JUMP_IF_FALSE:				return OP_JUMP_IF_FALSE_LONG;
+	case OP_POP_JUMP_IF_FALSE:			return OP_POP_JUMP_IF_FALSE_LONG;
+	case OP_LESS_JUMP_IF_FALSE:			return OP_LESS_JUMP_IF_FALSE_LONG;
+	case OP_GREATER_JUMP_IF_FALSE:		return OP_GREATER_JUMP_IF_FALSE_LONG;
+	case OP_LOOP:						return OP_LOOP_LONG;
+	default:							return OP_INVALID;
+	}
+}
+
+static bool decode(Peephole* p) {
+	Chunk* chunk = p->chunk;
+	p->code = ALLOCATE(Instruction, chunk->count);
+	p->index = ALLOCATE(int, chunk->count + 1);
+	p->count = 0;
+	for (int i = 0; i <= chunk->count; i++) p->index[i] = -1;
+
+	for (int offset = 0; offset < chunk->count;) {
+		int length = instructionLength(chunk, offset);
+		if (length == 0 || offset + length > chunk->count) return false;
+
+		Instruction* instruction = &p->code[p->count];
+		instruction->offset = offset;
+		instruction->length = length;
+		instruction->op = chunk->code[offset];
+		instruction->operands = offset + 1;
+		instruction->target = -1;
+		instruction->label = false;
+		instruction->deleted = false;
+		int distance = 0;
+		if (shortJump(instruction->op) != OP_INVALID) {
+			instruction->op = shortJump(instruction->op);
+			distance = chunk->longJumps[readShort(chunk, offset + 1)];
+		}
+		else if (isJump(instruction->op)) {
+			distance = readShort(chunk, offset + 1);
+		}
+		if (instruction->op == OP_LOOP) {
+			instruction->target = offset + 3 - distance;
+		}
+		else if (isJump(instruction->op)) {
+			instruction->target = offset + 3 + distance;
+		}
+		else if (instruction->op == OP_SET_CROSS_SECTION) {
+			instruction->target = offset + length - readShort(chunk, offset + 1);
+		}
+		else if (instruction->op == OP_ARRAY_KERNEL) {
+			instruction->target = offset + length + readShort(chunk, offset + 1);
+		}
+		if (instruction->target < -1 || instruction->target > chunk->count) return false;
+
+		p->index[offset] = p->count++;
+		offset += length;
+	}
+	p->index[chunk->count] = p->count;
+	return true;
+}
+
+// first instruction still there at or after i - count if none
+static int live(Peephole* p, int i) {
+	while (i < p->count && p->code[i].deleted) i++;
+	return i;
+}
+
+static int next(Peephole* p, int i) {
+	return live(p, i + 1);
+}
+
+// where a jump lands now
+static int targetOf(Peephole* p, Instruction* jump) {
+	return live(p, p->index[jump->target]);
+}
+
+static bool is(Peephole* p, int i, uint8_t op) {
+	return i < p->count && p->code[i].op == op;
+}
+
+// op at i, and nothing jumps to it - so it can be merged into the one before
+static bool isFree(Peephole* p, int i, uint8_t op) {
+	return is(p, i, op) && !p->code[i].label;
+}
+
+static uint8_t byteOperand(Peephole* p, int i) {
+	return p->chunk->code[p->code[i].operands];
+}
+
+static uint16_t shortOperand(Peephole* p, int i) {
+	return readShort(p->chunk, p->code[i].operands);
+}
+
+static void removeInstruction(Peephole* p, int i) {
+	p->code[i].deleted = true;
+}
+
+// redone every round - a jump that was threaded past an instruction
+// no longer makes it a label
+static void findLabels(Peephole* p) {
+	for (int i = 0; i < p->count; i++) p->code[i].label = false;
+	for (int i = 0; i < p->count; i++) {
+		Instruction* instruction = &p->code[i];
+		if (instruction->deleted) continue;
+		int target = -1;
+		if (instruction->target != -1) target = targetOf(p, instruction);
+		if (target != -1 && target < p->count) p->code[target].label = true;
+	}
+}
+
+static uint8_t negated(uint8_t op) {
+	switch (op) {
+	case OP_EQUAL:			return OP_NOT_EQUAL;
+	case OP_NOT_EQUAL:		return OP_EQUAL;
+	case OP_LESS:			return OP_NOT_LESS;
+	case OP_NOT_LESS:		return OP_LESS;
+	case OP_GREATER:		return OP_NOT_GREATER;
+	case OP_NOT_GREATER:	return OP_GREATER;
+	default:				return OP_INVALID;
+	}
+}
+
+// follow unconditional jumps from where this one lands
+static bool threadJump(Peephole* p, int i) {
+	Instruction* jump = &p->code[i];
+	bool changed = false;
+	for (int hops = 0; hops < 8; hops++) {
+		int t = targetOf(p, jump);
+		if (t >= p->count || t == i) break;
+		Instruction* to = &p->code[t];
+		bool unconditional = to->op == OP_JUMP || to->op == OP_LOOP;
+		if (!unconditional && !(jump->op == OP_JUMP_IF_FALSE && to->op == OP_JUMP_IF_FALSE)) break;
+		// the conditional jumps only go forward
+		if (isConditionalJump(jump->op) && to->target <= jump->offset) break;
+		if (to->target == jump->target) break;
+		jump->target = to->target;
+		changed = true;
+	}
+	return changed;
+}
+
+static bool rewrite(Peephole* p, int i) {
+	Instruction* instruction = &p->code[i];
+	int j = next(p, i);
+	int k = next(p, j);
+	uint8_t op = instruction->op;
+
+	// a comparison and OP_NOT - the opposite comparison
+	if (negated(op) != OP_INVALID && isFree(p, j, OP_NOT)) {
+		instruction->op = negated(op);
+		removeInstruction(p, j);
+		return true;
+	}
+
+	// !!x only matters for its truthiness when a jump tests it
+	if (op == OP_NOT && isFree(p, j, OP_NOT) && isFree(p, k, OP_POP_JUMP_IF_FALSE)) {
+		removeInstruction(p, i);
+		removeInstruction(p, j);
+		return true;
+	}
+
+	// the comparison the compiler could not fuse because of the jump in and / or
+	if ((op == OP_LESS || op == OP_GREATER) && isFree(p, j, OP_POP_JUMP_IF_FALSE)) {
+		instruction->op = op == OP_LESS ? OP_LESS_JUMP_IF_FALSE : OP_GREATER_JUMP_IF_FALSE;
+		instruction->length = 3;
+		instruction->target = p->code[j].target;
+		removeInstruction(p, j);
+		return true;
+	}
+
+	// a = a;
+	if (op == OP_GET_LOCAL && isFree(p, j, OP_SET_LOCAL) && isFree(p, k, OP_POP) &&
+		byteOperand(p, i) == byteOperand(p, j)) {
+		removeInstruction(p, i);
+		removeInstruction(p, j);
+		removeInstruction(p, k);
+		return true;
+	}
+	if (op == OP_GET_LOCAL && isFree(p, j, OP_SET_LOCAL_POP) && byteOperand(p, i) == byteOperand(p, j)) {
+		removeInstruction(p, i);
+		removeInstruction(p, j);
+		return true;
+	}
+
+	// store, pop and load the same variable - keep the value on the stack instead
+	if (op == OP_SET_LOCAL && isFree(p, j, OP_POP)) {
+		if (isFree(p, k, OP_GET_LOCAL) && byteOperand(p, k) == byteOperand(p, i)) {
+			removeInstruction(p, j);
+			removeInstruction(p, k);
+			return true;
+		}
+		if (isFree(p, k, OP_GET_LOCAL2) && byteOperand(p, k) == byteOperand(p, i)) {
+			removeInstruction(p, j);
+			p->code[k].op = OP_GET_LOCAL;  // just the second one
+			p->code[k].length = 2;
+			p->code[k].operands++;
+			return true;
+		}
+		instruction->op = OP_SET_LOCAL_POP;
+		removeInstruction(p, j);
+		return true;
+	}
+	if (op == OP_SET_GLOBAL_SLOT && isFree(p, j, OP_POP) && isFree(p, k, OP_GET_GLOBAL_SLOT) &&
+		shortOperand(p, k) == shortOperand(p, i)) {
+		removeInstruction(p, j);
+		removeInstruction(p, k);
+		return true;
+	}
+
+	if (isJump(op)) {
+		if (threadJump(p, i)) return true;
+
+		int t = targetOf(p, instruction);
+		// jump over nothing
+		if (t == j && (op == OP_JUMP || op == OP_JUMP_IF_FALSE)) {
+			removeInstruction(p, i);
+			return true;
+		}
+		if (t == j && op == OP_POP_JUMP_IF_FALSE) {
+			instruction->op = OP_POP;
+			instruction->length = 1;
+			instruction->target = -1;
+			return true;
+		}
+
+		// and: the left side was false, so the OP_POP_JUMP_IF_FALSE it lands on will jump too
+		if (op == OP_JUMP_IF_FALSE && isFree(p, j, OP_POP) && is(p, t, OP_POP_JUMP_IF_FALSE)) {
+			instruction->op = OP_POP_JUMP_IF_FALSE;
+			instruction->target = p->code[t].target;
+			removeInstruction(p, j);
+			return true;
+		}
+	}
+
+	// nothing can get to the code after a jump or return until the next label
+	if ((op == OP_JUMP || op == OP_LOOP || op == OP_RETURN) && j < p->count && !p->code[j].label) {
+		removeInstruction(p, j);
+		return true;
+	}
+
+	return false;
+}
+
+static int newOffsetOf(Peephole* p, int oldOffset, int newCount) {
+	int i = live(p, p->index[oldOffset]);
+	return i < p->count ? p->code[i].newOffset : newCount;
+}
+
+// write the instructions back - returns the new length, or -1 (and the chunk
+// untouched) if a jump can't be written.  A jump that needs more than 16 bits
+// goes out as its *_LONG form with a fresh chunk->longJumps entry
+static int encode(Peephole* p) {
+	Chunk* chunk = p->chunk;
+	int newCount = 0;
+	for (int i = 0; i < p->count; i++) {
+		if (p->code[i].deleted) continue;
+		p->code[i].newOffset = newCount;
+		newCount += p->code[i].length;
+	}
+
+	uint8_t* code = ALLOCATE(uint8_t, newCount);
+	int* lines = ALLOCATE(int, newCount);
+	int* longJumps = ALLOCATE(int, p->count);	// the new chunk->longJumps
+	int longJumpCount = 0;
+	bool ok = true;
+	for (int i = 0; i < p->count && ok; i++) {
+		Instruction* instruction = &p->code[i];
+		if (instruction->deleted) continue;
+		int at = instruction->newOffset;
+		uint8_t op = instruction->op;
+		if (instruction->length > 1) {
+			memcpy(code + at + 1, chunk->code + instruction->operands, instruction->length - 1);
+		}
+
+		if (op == OP_SET_CROSS_SECTION) {
+			int jump = at + 4 - newOffsetOf(p, instruction->target, newCount);
+			if (jump < 0 || jump > UINT16_MAX) ok = false;
+			code[at + 1] = (jump >> 8) & 0xff;
+			code[at + 2] = jump & 0xff;
+		}
+		else if (op == OP_ARRAY_KERNEL) {
+			int jump = newOffsetOf(p, instruction->target, newCount) - (at + 8);
+			if (jump < 0 || jump > UINT16_MAX) ok = false;
+			code[at + 1] = (jump >> 8) & 0xff;
+			code[at + 2] = jump & 0xff;
+		}
+		else if (instruction->target != -1) {
+			int target = newOffsetOf(p, instruction->target, newCount);
+			int after = at + 3;
+			int jump = target - after;
+			if (op == OP_JUMP || op == OP_LOOP) {
+				op = jump >= 0 ? OP_JUMP : OP_LOOP;  // threading can turn one into the other
+				if (jump < 0) jump = -jump;
+			}
+			if (jump < 0) ok = false;
+			if (jump > UINT16_MAX) {
+				op = longJump(op);
+				longJumps[longJumpCount] = jump;
+				jump = longJumpCount++;
+				if (jump > UINT16_MAX) ok = false;
+			}
+			code[at + 1] = (jump >> 8) & 0xff;
+			code[at + 2] = jump & 0xff;
+		}
+
+		code[at] = op;
+		for (int b = 0; b < instruction->length; b++) lines[at + b] = chunk->lines[instruction->offset];
+	}
+
+	if (ok) {
+		memcpy(chunk->code, code, newCount);
+		memcpy(chunk->lines, lines, newCount * sizeof(int));
+		chunk->count = newCount;
+		chunk->longJumpCount = 0;
+		for (int i = 0; i < longJumpCount; i++) addLongJump(chunk, longJumps[i]);
+	}
+	FREE_ARRAY(uint8_t, code, newCount);
+	FREE_ARRAY(int, lines, newCount);
+	FREE_ARRAY(int, longJumps, p->count);
+	return ok ? newCount : -1;
+}
+
+void peepholeChunk(Chunk* chunk) {
+	Peephole p;
+	p.chunk = chunk;
+	int oldCount = chunk->count;
+	bool ok = decode(&p);
+
+	bool changed = ok;
+	while (changed) {
+		changed = false;
+		findLabels(&p);
+		for (int i = live(&p, 0); i < p.count; i = next(&p, i)) {
+			if (rewrite(&p, i)) {
+				changed = true;
+				findLabels(&p);
+			}
+		}
+	}
+
+	if (ok && encode(&p) != -1) {
+		for (int i = 0; i < p.count; i++) {
+			if (p.code[i].deleted) vm.peepholeInstructions++;
+		}
+		vm.peepholeBytes += oldCount - chunk->count;
+	}
+
+	FREE_ARRAY(Instruction, p.code, oldCount);
+	FREE_ARRAY(int, p.index, oldCount + 1);
+}
@@ -0,0 +1,31 @@
+#pragma once
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "common.h"
+#include "chunk.h"
+
+// Peephole pass over a finished chunk - run by endCompiler()
+//
+// The single pass compiler only sees one instruction behind it (canFuse),
+// so it leaves sequences like these in the chunk:
+//
+//   OP_LESS, OP_NOT                    (a >= b)      ->  OP_NOT_LESS
+//   OP_GREATER, OP_NOT, OP_NOT         !(a <= b)     ->  OP_GREATER
+//   OP_SET_LOCAL a, OP_POP             a = ...;      ->  OP_SET_LOCAL_POP a
+//   OP_SET_LOCAL a, OP_POP, OP_GET_LOCAL a           ->  OP_SET_LOCAL a
+//   OP_LESS, OP_POP_JUMP_IF_FALSE      (after and)   ->  OP_LESS_JUMP_IF_FALSE
+//   OP_JUMP_IF_FALSE, OP_POP   (and)  when the jump lands on an
+//                                     OP_POP_JUMP_IF_FALSE  ->  jump straight to its target
+//   OP_JUMP to an OP_JUMP / OP_LOOP   ->  jump to where that one goes
+//   OP_JUMP over nothing (if without else), code after a jump or return
+//                                     ->  removed
+//
+// A sequence is only rewritten if no jump lands inside it.  The chunk is then
+// compacted: the jump offsets (OP_SET_CROSS_SECTION's and OP_ARRAY_KERNEL's too) and the lines
+// array are moved to the new offsets.
+// What was removed is added up in vm.peepholeInstructions / vm.peepholeBytes.
+
+void peepholeChunk(Chunk* chunk);
+
+#endif
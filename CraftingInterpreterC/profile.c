@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "profile.h"
+#include "debug.h"
+
+// pairs fit in a flat table, triples go in a small open addressing hash
+#define TRIPLE_TABLE_SIZE 65536
+
+typedef struct {
+    uint32_t key;       // op1 << 16 | op2 << 8 | op3, plus 1 so zero means empty
+    long long count;
+} TripleCount;
+
+typedef struct {
+    uint32_t key;
+    long long count;
+} NGram;
+
+static long long singleCounts[UINT8_COUNT];
+static long long pairCounts[UINT8_COUNT][UINT8_COUNT];
+static TripleCount tripleCounts[TRIPLE_TABLE_SIZE];
+static long long totalDispatches;
+
+// the two previously dispatched opcodes
+static int previous1 = -1;
+static int previous2 = -1;
+
+static void countTriple(uint32_t key) {
+    key++;
+    uint32_t index = (key * 2654435761u) & (TRIPLE_TABLE_SIZE - 1);
+    for (int probes = 0; probes < TRIPLE_TABLE_SIZE; probes++) {
+        TripleCount* entry = &tripleCounts[index];
+        if (entry->key == key || entry->key == 0) {
+            entry->key = key;
+            entry->count++;
+            return;
+        }
+        index = (index + 1) & (TRIPLE_TABLE_SIZE - 1);
+    }
+    // table full - just lose this sample
+}
+
+void profileOpcode(uint8_t instruction) {
+    totalDispatches++;
+    singleCounts[instruction]++;
+    if (previous1 != -1) {
+        pairCounts[previous1][instruction]++;
+        if (previous2 != -1) {
+            countTriple((uint32_t)previous2 << 16 | (uint32_t)previous1 << 8 | instruction);
+        }
+    }
+    previous2 = previous1;
+    previous1 = instruction;
+}
+
+static int compareNGrams(const void* a, const void* b) {
+    long long countA = ((const NGram*)a)->count;
+    long long countB = ((const NGram*)b)->count;
+    return (countA < countB) - (countA > countB);  // descending
+}
+
+static void printTop(NGram* grams, int count, int topN, int length) {
+    qsort(grams, count, sizeof(NGram), compareNGrams);
+    for (int i = 0; i < count && i < topN; i++) {
+        printf("%12lld %5.1f%%  ", grams[i].count,
+            100.0 * grams[i].count / (double)totalDispatches);
+        for (int shift = (length - 1) * 8; shift >= 0; shift -= 8) {
+            printf(" %s", opcodeName((uint8_t)(grams[i].key >> shift)));
+        }
+        printf("\n");
+    }
+}
+
+void printOpcodeProfile(int topN) {
+    printf("\n** Opcode profile: %lld dispatches\n", totalDispatches);
+    if (totalDispatches == 0) return;
+
+    NGram* grams = malloc(sizeof(NGram) * UINT8_COUNT * UINT8_COUNT);
+    if (grams == NULL) return;
+
+    int count = 0;
+    for (int op = 0; op < UINT8_COUNT; op++) {
+        if (singleCounts[op] != 0) {
+            grams[count++] = (NGram){ (uint32_t)op, singleCounts[op] };
+        }
+    }
+    printf("Opcodes:\n");
+    printTop(grams, count, topN, 1);
+
+    count = 0;
+    for (int op1 = 0; op1 < UINT8_COUNT; op1++) {
+        for (int op2 = 0; op2 < UINT8_COUNT; op2++) {
+            if (pairCounts[op1][op2] != 0) {
+                grams[count++] = (NGram){ (uint32_t)(op1 << 8 | op2), pairCounts[op1][op2] };
+            }
+        }
+    }
+    printf("Pairs:\n");
+    printTop(grams, count, topN, 2);
+
+    count = 0;
+    for (int i = 0; i < TRIPLE_TABLE_SIZE; i++) {
+        if (tripleCounts[i].key != 0) {
+            grams[count++] = (NGram){ tripleCounts[i].key - 1, tripleCounts[i].count };
+        }
+    }
+    printf("Triples:\n");
+    printTop(grams, count, topN, 3);
+
+    free(grams);
+}
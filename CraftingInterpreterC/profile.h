@@ -0,0 +1,14 @@
+#pragma once
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+
+// Opcode n-gram profiling - turn on with PROFILE_OPCODES in common.h
+// Counts every dispatched opcode plus the pairs and triples it forms with
+// the opcodes dispatched just before it.  Used to pick superinstructions.
+
+void profileOpcode(uint8_t instruction);
+void printOpcodeProfile(int topN);
+
+#endif
@@ -0,0 +1,569 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "regvm.h"
+
+// Stack bytecode -> register code (see regvm.h)
+//
+// Walks the finished stack bytecode once, keeping a model of the VM stack
+// at compile time.  Stack position p is register p.  A value is only
+// written to its register when something needs it there - GET_LOCAL and
+// CONSTANT just remember where the value can be found (a pending operand),
+// and the instruction that uses them reads the local or the constant
+// directly.  Everything pending is written out ("flushed") before a jump,
+// at a jump target and before a call, so every path into a label sees the
+// same registers.
+
+typedef enum {
+	OPERAND_REG,	// value is in its own register
+	OPERAND_LOCAL,	// not written yet - same value as register 'index'
+	OPERAND_CONST	// not written yet - constant 'index'
+} OperandKind;
+
+typedef struct {
+	OperandKind kind;
+	uint8_t index;
+} Operand;
+
+typedef struct {
+	int codeOffset;		// where the 16 bit offset goes in the register code
+	int target;			// stack bytecode offset it jumps to
+	bool isLoop;
+} JumpPatch;
+
+typedef struct {
+	Chunk* in;
+	Chunk* out;
+	Operand stack[UINT8_COUNT];
+	int depth;
+	int maxDepth;
+	int line;
+	int lastDestOffset;	// register code offset of the A operand of the last instruction, -1 if none
+	bool failed;
+
+	int* targetDepth;	// stack depth at each jump target, -1 if not a target
+	int* codeOffsets;	// stack bytecode offset -> register code offset
+	JumpPatch* patches;
+	int patchCount;
+} RegCompiler;
+
+static void fail(RegCompiler* rc) {
+	rc->failed = true;
+}
+
+static void emit(RegCompiler* rc, uint8_t byte) {
+	writeChunk(rc->out, byte, rc->line);
+}
+
+static void emitOp(RegCompiler* rc, RegOpCode op) {
+	rc->lastDestOffset = -1;
+	emit(rc, op);
+}
+
+// destination register - remembered so a SET_LOCAL right after can retarget it
+static void emitDest(RegCompiler* rc, int reg) {
+	rc->lastDestOffset = rc->out->count;
+	emit(rc, (uint8_t)reg);
+}
+
+static void noteRegister(RegCompiler* rc, int reg) {
+	if (reg >= UINT8_MAX) fail(rc);
+	if (reg + 1 > rc->maxDepth) rc->maxDepth = reg + 1;
+}
+
+static void pushOperand(RegCompiler* rc, OperandKind kind, int index) {
+	if (rc->depth >= UINT8_MAX) {
+		fail(rc);
+		return;
+	}
+	noteRegister(rc, rc->depth);
+	rc->stack[rc->depth].kind = kind;
+	rc->stack[rc->depth].index = (uint8_t)index;
+	rc->depth++;
+}
+
+// write a pending operand into its own register
+static void materialize(RegCompiler* rc, int pos) {
+	Operand* operand = &rc->stack[pos];
+	if (operand->kind == OPERAND_LOCAL) {
+		emitOp(rc, R_MOVE);
+		emitDest(rc, pos);
+		emit(rc, operand->index);
+	}
+	else if (operand->kind == OPERAND_CONST) {
+		emitOp(rc, R_LOADK);
+		emitDest(rc, pos);
+		emit(rc, operand->index);
+	}
+	noteRegister(rc, pos);
+	operand->kind = OPERAND_REG;
+}
+
+static void flushAll(RegCompiler* rc) {
+	for (int i = 0; i < rc->depth; i++) {
+		materialize(rc, i);
+	}
+}
+
+// the register is about to be overwritten - anything still pointing at it gets its own copy
+static void flushLocal(RegCompiler* rc, int reg) {
+	for (int i = 0; i < rc->depth; i++) {
+		if (rc->stack[i].kind == OPERAND_LOCAL && rc->stack[i].index == reg) {
+			materialize(rc, i);
+		}
+	}
+}
+
+static bool hasPendingCopy(RegCompiler* rc, int reg) {
+	for (int i = 0; i < rc->depth; i++) {
+		if (rc->stack[i].kind == OPERAND_LOCAL && rc->stack[i].index == reg) return true;
+	}
+	return false;
+}
+
+// register holding the value at stack position pos
+static uint8_t readOperand(RegCompiler* rc, int pos) {
+	Operand* operand = &rc->stack[pos];
+	if (operand->kind == OPERAND_LOCAL) return operand->index;
+	if (operand->kind == OPERAND_CONST) materialize(rc, pos);
+	return (uint8_t)pos;
+}
+
+static bool isConstant(RegCompiler* rc, int pos) {
+	return rc->stack[pos].kind == OPERAND_CONST;
+}
+
+// three address op on the top two stack positions, result replaces the lower one
+static void binaryOp(RegCompiler* rc, RegOpCode op) {
+	if (rc->depth < 2) {
+		fail(rc);
+		return;
+	}
+	int dest = rc->depth - 2;
+	uint8_t b = readOperand(rc, rc->depth - 2);
+	uint8_t c = readOperand(rc, rc->depth - 1);
+	emitOp(rc, op);
+	emitDest(rc, dest);
+	emit(rc, b);
+	emit(rc, c);
+	rc->depth--;
+	rc->stack[dest].kind = OPERAND_REG;
+}
+
+// binary op with a constant right hand side (R_ADDK, R_SUBK)
+static void binaryConstOp(RegCompiler* rc, RegOpCode op, uint8_t constant) {
+	int dest = rc->depth - 1;
+	uint8_t b = readOperand(rc, dest);
+	emitOp(rc, op);
+	emitDest(rc, dest);
+	emit(rc, b);
+	emit(rc, constant);
+	rc->stack[dest].kind = OPERAND_REG;
+}
+
+static void unaryOp(RegCompiler* rc, RegOpCode op) {
+	int dest = rc->depth - 1;
+	uint8_t b = readOperand(rc, dest);
+	emitOp(rc, op);
+	emitDest(rc, dest);
+	emit(rc, b);
+	rc->stack[dest].kind = OPERAND_REG;
+}
+
+static void loadOp(RegCompiler* rc, RegOpCode op) {
+	pushOperand(rc, OPERAND_REG, 0);
+	emitOp(rc, op);
+	emitDest(rc, rc->depth - 1);
+}
+
+// the jump offset is patched once every stack offset has a register code offset
+static void emitJumpTo(RegCompiler* rc, int target, bool isLoop) {
+	rc->patches[rc->patchCount].codeOffset = rc->out->count;
+	rc->patches[rc->patchCount].target = target;
+	rc->patches[rc->patchCount].isLoop = isLoop;
+	rc->patchCount++;
+	emit(rc, 0xff);
+	emit(rc, 0xff);
+
+	// the depth has to match at the target - a loop target has been seen already
+	if (rc->targetDepth[target] >= 0 && rc->targetDepth[target] != rc->depth) fail(rc);
+	if (!isLoop) rc->targetDepth[target] = rc->depth;
+}
+
+static void setLocal(RegCompiler* rc, uint8_t slot) {
+	int top = rc->depth - 1;
+	if (top < 0 || slot > top) {
+		fail(rc);
+		return;
+	}
+	Operand* value = &rc->stack[top];
+
+	if (value->kind == OPERAND_REG && rc->lastDestOffset != -1 &&
+		rc->out->code[rc->lastDestOffset] == top && !hasPendingCopy(rc, slot)) {
+		// the instruction that just computed the value can write the local directly
+		rc->out->code[rc->lastDestOffset] = slot;
+		value->kind = OPERAND_LOCAL;
+		value->index = slot;
+	}
+	else {
+		flushLocal(rc, slot);
+		if (value->kind == OPERAND_CONST) {
+			emitOp(rc, R_LOADK);
+			emitDest(rc, slot);
+			emit(rc, value->index);
+		}
+		else {
+			uint8_t source = readOperand(rc, top);
+			if (source != slot) {
+				emitOp(rc, R_MOVE);
+				emitDest(rc, slot);
+				emit(rc, source);
+			}
+		}
+	}
+	rc->stack[slot].kind = OPERAND_REG;
+	rc->lastDestOffset = -1;
+}
+
+static uint16_t readShort(Chunk* chunk, int offset) {
+	return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// length of a stack instruction, 0 if the register backend can't handle it
+static int instructionLength(uint8_t instruction) {
+	switch (instruction) {
+	case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_POP:
+	case OP_EQUAL: case OP_NOT_EQUAL: case OP_GREATER: case OP_LESS:
+	case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY: case OP_DIVIDE: case OP_RANDOM:
+	case OP_NOT: case OP_NEGATE: case OP_PRINT: case OP_RETURN:
+	case OP_NOT_LESS: case OP_NOT_GREATER:
+		return 1;
+	case OP_CONSTANT: case OP_GET_LOCAL: case OP_SET_LOCAL: case OP_SET_LOCAL_POP:
+	case OP_ADD_CONST: case OP_CALL:
+		return 2;
+	case OP_GET_LOCAL2:
+	case OP_GET_GLOBAL_SLOT: case OP_SET_GLOBAL_SLOT: case OP_DEFINE_GLOBAL_SLOT:
+	case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE: case OP_LOOP:
+	case OP_LESS_JUMP_IF_FALSE: case OP_GREATER_JUMP_IF_FALSE:
+	case OP_DEFINE_GLOBAL:
+		return 3;
+	case OP_GET_GLOBAL: case OP_SET_GLOBAL:
+		return 5;
+	default:	// the wide forms (OP_CONSTANT_LONG, the *_LONG jumps) too - a chunk that big stays on the stack VM
+		return 0;
+	}
+}
+
+// first pass - find the jump targets so we know where to flush
+static bool findJumpTargets(RegCompiler* rc) {
+	Chunk* in = rc->in;
+	for (int offset = 0; offset < in->count;) {
+		uint8_t instruction = in->code[offset];
+		int length = instructionLength(instruction);
+		if (length == 0) return false;
+
+		int target = -1;
+		switch (instruction) {
+		case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_POP_JUMP_IF_FALSE:
+		case OP_LESS_JUMP_IF_FALSE: case OP_GREATER_JUMP_IF_FALSE:
+			target = offset + 3 + readShort(in, offset + 1);
+			break;
+		case OP_LOOP:
+			target = offset + 3 - readShort(in, offset + 1);
+			break;
+		}
+		if (target != -1) {
+			if (target < 0 || target > in->count) return false;
+			rc->targetDepth[target] = -2;  // a target, depth not known yet
+		}
+		offset += length;
+	}
+	return true;
+}
+
+static void translateInstruction(RegCompiler* rc, int offset) {
+	Chunk* in = rc->in;
+	uint8_t instruction = in->code[offset];
+	uint8_t arg = in->code[offset + 1 < in->count ? offset + 1 : offset];
+	int top = rc->depth - 1;
+
+	switch (instruction) {
+	case OP_CONSTANT:	pushOperand(rc, OPERAND_CONST, arg); break;
+	case OP_NIL:		loadOp(rc, R_LOADNIL); break;
+	case OP_TRUE:		loadOp(rc, R_LOADTRUE); break;
+	case OP_FALSE:		loadOp(rc, R_LOADFALSE); break;
+	case OP_POP:		rc->depth--; break;  // no code at all
+
+	case OP_GET_LOCAL2:
+		if (arg >= rc->depth) {
+			fail(rc);
+			break;
+		}
+		if (rc->stack[arg].kind != OPERAND_REG) materialize(rc, arg);
+		pushOperand(rc, OPERAND_LOCAL, arg);
+		arg = in->code[offset + 2];
+		/* fallthrough */  // for the second one
+	case OP_GET_LOCAL:
+		if (arg >= rc->depth) {
+			fail(rc);
+			break;
+		}
+		if (rc->stack[arg].kind != OPERAND_REG) materialize(rc, arg);
+		pushOperand(rc, OPERAND_LOCAL, arg);
+		break;
+
+	case OP_SET_LOCAL:	setLocal(rc, arg); break;
+	case OP_SET_LOCAL_POP:
+		setLocal(rc, arg);
+		rc->depth--;
+		break;
+
+	// the inline cache index is carried over - the caches stay in function->chunk
+	// the name constant is 2 bytes in the stack code, 1 in the register code
+	case OP_GET_GLOBAL:
+		if (readShort(in, offset + 1) > UINT8_MAX) {
+			fail(rc);
+			break;
+		}
+		pushOperand(rc, OPERAND_REG, 0);
+		emitOp(rc, R_GET_GLOBAL);
+		emitDest(rc, rc->depth - 1);
+		emit(rc, in->code[offset + 2]);
+		emit(rc, in->code[offset + 3]);
+		emit(rc, in->code[offset + 4]);
+		break;
+
+	case OP_SET_GLOBAL: {
+		if (readShort(in, offset + 1) > UINT8_MAX) {
+			fail(rc);
+			break;
+		}
+		uint8_t source = readOperand(rc, top);
+		emitOp(rc, R_SET_GLOBAL);
+		emit(rc, in->code[offset + 2]);
+		emit(rc, in->code[offset + 3]);
+		emit(rc, in->code[offset + 4]);
+		emit(rc, source);
+		break;
+	}
+
+	case OP_DEFINE_GLOBAL: {
+		if (readShort(in, offset + 1) > UINT8_MAX) {
+			fail(rc);
+			break;
+		}
+		uint8_t source = readOperand(rc, top);
+		emitOp(rc, R_DEFINE_GLOBAL);
+		emit(rc, in->code[offset + 2]);
+		emit(rc, source);
+		rc->depth--;
+		break;
+	}
+
+	case OP_GET_GLOBAL_SLOT:
+		pushOperand(rc, OPERAND_REG, 0);
+		emitOp(rc, R_GET_GLOBAL_SLOT);
+		emitDest(rc, rc->depth - 1);
+		emit(rc, arg);
+		emit(rc, in->code[offset + 2]);
+		break;
+
+	case OP_SET_GLOBAL_SLOT:
+	case OP_DEFINE_GLOBAL_SLOT: {
+		uint8_t source = readOperand(rc, top);
+		emitOp(rc, instruction == OP_SET_GLOBAL_SLOT ? R_SET_GLOBAL_SLOT : R_DEFINE_GLOBAL_SLOT);
+		emit(rc, arg);
+		emit(rc, in->code[offset + 2]);
+		emit(rc, source);
+		if (instruction == OP_DEFINE_GLOBAL_SLOT) rc->depth--;
+		break;
+	}
+
+	case OP_ADD:
+		if (top >= 1 && isConstant(rc, top)) {
+			rc->depth--;
+			binaryConstOp(rc, R_ADDK, rc->stack[top].index);
+		}
+		else binaryOp(rc, R_ADD);
+		break;
+	case OP_SUBTRACT:
+		if (top >= 1 && isConstant(rc, top)) {
+			rc->depth--;
+			binaryConstOp(rc, R_SUBK, rc->stack[top].index);
+		}
+		else binaryOp(rc, R_SUBTRACT);
+		break;
+	case OP_ADD_CONST:	binaryConstOp(rc, R_ADDK, arg); break;
+	case OP_MULTIPLY:	binaryOp(rc, R_MULTIPLY); break;
+	case OP_DIVIDE:		binaryOp(rc, R_DIVIDE); break;
+	case OP_RANDOM:		binaryOp(rc, R_RANDOM); break;
+	case OP_EQUAL:		binaryOp(rc, R_EQUAL); break;
+	case OP_NOT_EQUAL:	binaryOp(rc, R_NOT_EQUAL); break;
+	case OP_GREATER:	binaryOp(rc, R_GREATER); break;
+	case OP_LESS:		binaryOp(rc, R_LESS); break;
+	case OP_NOT_LESS:
+		binaryOp(rc, R_LESS);
+		unaryOp(rc, R_NOT);
+		break;
+	case OP_NOT_GREATER:
+		binaryOp(rc, R_GREATER);
+		unaryOp(rc, R_NOT);
+		break;
+	case OP_NOT:		unaryOp(rc, R_NOT); break;
+	case OP_NEGATE:		unaryOp(rc, R_NEGATE); break;
+
+	case OP_PRINT: {
+		uint8_t source = readOperand(rc, top);
+		emitOp(rc, R_PRINT);
+		emit(rc, source);
+		rc->depth--;
+		break;
+	}
+
+	case OP_JUMP:
+	case OP_LOOP: {
+		bool isLoop = instruction == OP_LOOP;
+		int target = isLoop ? offset + 3 - readShort(in, offset + 1)
+			: offset + 3 + readShort(in, offset + 1);
+		flushAll(rc);
+		emitOp(rc, isLoop ? R_LOOP : R_JUMP);
+		emitJumpTo(rc, target, isLoop);
+		break;
+	}
+
+	case OP_JUMP_IF_FALSE:		// and / or - the value stays on the stack
+		flushAll(rc);
+		emitOp(rc, R_JUMP_IF_FALSE);
+		emit(rc, (uint8_t)top);
+		emitJumpTo(rc, offset + 3 + readShort(in, offset + 1), false);
+		break;
+
+	case OP_POP_JUMP_IF_FALSE: {
+		uint8_t condition = readOperand(rc, top);
+		rc->depth--;
+		flushAll(rc);
+		emitOp(rc, R_JUMP_IF_FALSE);
+		emit(rc, condition);
+		emitJumpTo(rc, offset + 3 + readShort(in, offset + 1), false);
+		break;
+	}
+
+	case OP_LESS_JUMP_IF_FALSE:
+	case OP_GREATER_JUMP_IF_FALSE: {
+		bool less = instruction == OP_LESS_JUMP_IF_FALSE;
+		bool constant = isConstant(rc, top);
+		uint8_t b = readOperand(rc, top - 1);
+		uint8_t c = constant ? rc->stack[top].index : readOperand(rc, top);
+		rc->depth -= 2;
+		flushAll(rc);
+		if (constant) emitOp(rc, less ? R_LESSK_JUMP_IF_FALSE : R_GREATERK_JUMP_IF_FALSE);
+		else emitOp(rc, less ? R_LESS_JUMP_IF_FALSE : R_GREATER_JUMP_IF_FALSE);
+		emit(rc, b);
+		emit(rc, c);
+		emitJumpTo(rc, offset + 3 + readShort(in, offset + 1), false);
+		break;
+	}
+
+	case OP_CALL: {
+		int callee = rc->depth - 1 - arg;
+		if (callee < 0) {
+			fail(rc);
+			break;
+		}
+		flushAll(rc);
+		emitOp(rc, R_CALL);
+		emit(rc, (uint8_t)callee);
+		emit(rc, arg);
+		rc->depth = callee + 1;
+		// the callee's frame is above the callee register
+		noteRegister(rc, callee + arg + 1);
+		break;
+	}
+
+	case OP_RETURN: {
+		uint8_t source = readOperand(rc, top);
+		emitOp(rc, R_RETURN);
+		emit(rc, source);
+		rc->depth--;
+		break;
+	}
+
+	default:
+		fail(rc);
+		break;
+	}
+
+	if (rc->depth < 0) fail(rc);
+}
+
+bool compileRegisterCode(ObjFunction* function) {
+	Chunk* in = &function->chunk;
+	freeChunk(&function->registerChunk);
+
+	RegCompiler rc;
+	rc.in = in;
+	rc.out = &function->registerChunk;
+	rc.depth = 0;
+	rc.maxDepth = 0;
+	rc.line = 0;
+	rc.lastDestOffset = -1;
+	rc.failed = false;
+	rc.patchCount = 0;
+	rc.targetDepth = ALLOCATE(int, in->count + 1);
+	rc.codeOffsets = ALLOCATE(int, in->count + 1);
+	rc.patches = ALLOCATE(JumpPatch, in->count + 1);
+	for (int i = 0; i <= in->count; i++) {
+		rc.targetDepth[i] = -1;
+		rc.codeOffsets[i] = -1;
+	}
+
+	// slot zero is the function itself, then the parameters
+	for (int i = 0; i <= function->arity; i++) {
+		pushOperand(&rc, OPERAND_REG, 0);
+	}
+
+	if (!findJumpTargets(&rc)) fail(&rc);
+
+	for (int offset = 0; offset < in->count && !rc.failed;) {
+		rc.line = in->lines[offset];
+		if (rc.targetDepth[offset] != -1) {
+			// a label - every path into it must have the same registers
+			flushAll(&rc);
+			rc.lastDestOffset = -1;
+			if (rc.targetDepth[offset] >= 0 && rc.targetDepth[offset] != rc.depth) fail(&rc);
+			rc.targetDepth[offset] = rc.depth;
+		}
+		rc.codeOffsets[offset] = rc.out->count;
+		translateInstruction(&rc, offset);
+		offset += instructionLength(in->code[offset]);
+	}
+	rc.codeOffsets[in->count] = rc.out->count;
+
+	for (int i = 0; i < rc.patchCount && !rc.failed; i++) {
+		JumpPatch* patch = &rc.patches[i];
+		int target = rc.codeOffsets[patch->target];
+		int jump = patch->isLoop ? patch->codeOffset + 2 - target
+			: target - (patch->codeOffset + 2);
+		if (target == -1 || jump < 0 || jump > UINT16_MAX) {
+			fail(&rc);
+			break;
+		}
+		rc.out->code[patch->codeOffset] = (jump >> 8) & 0xff;
+		rc.out->code[patch->codeOffset + 1] = jump & 0xff;
+	}
+
+	FREE_ARRAY(int, rc.targetDepth, in->count + 1);
+	FREE_ARRAY(int, rc.codeOffsets, in->count + 1);
+	FREE_ARRAY(JumpPatch, rc.patches, in->count + 1);
+
+	if (rc.failed) {
+		freeChunk(&function->registerChunk);
+		return false;
+	}
+	function->registerCount = rc.maxDepth;
+	return true;
+}
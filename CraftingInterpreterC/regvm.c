@@ -0,0 +1,479 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "regvm.h"
+#include "vm.h"
+
+// Interpreter loop for the register backend - see regvm.h
+// Same frames and value stack as the stack VM, but nothing is pushed or
+// popped: every operand is read straight out of frame->slots.
+
+static bool isFalsey(Value value) {
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+bool registerCodeReady(ObjFunction* function) {
+	if (function->registerChunk.count == 0) return false;
+
+	ValueArray* constants = &function->chunk.constants;
+	for (int i = 0; i < constants->count; i++) {
+		if (IS_FUNCTION(constants->values[i]) &&
+			!registerCodeReady(AS_FUNCTION(constants->values[i]))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// same report as runtimeError in vm.c, the lines come from the register code
+static void registerRuntimeError(const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputs("\n", stderr);
+
+	for (int i = vm.frameCount - 1; i >= 0; i--) {
+		CallFrame* frame = &vm.frames[i];
+		ObjFunction* function = frame->function;
+		size_t instruction = frame->ip - function->registerChunk.code - 1;
+		fprintf(stderr, "[line %d] in ",
+			function->registerChunk.lines[instruction]);
+		if (function->name == NULL) {
+			fprintf(stderr, "script\n");
+		}
+		else {
+			fprintf(stderr, "%s()\n", function->name->chars);
+		}
+	}
+
+	vm.stackTop = vm.stack;
+	vm.frameCount = 0;
+}
+
+// ip and slots are kept in locals - write ip back before anything that can
+// look at the frame (a call or an error report)
+#define READ_BYTE()		(*ip++)
+#define READ_SHORT()	(ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define R(n)			(slots[n])
+#define K(n)			(constants[n])
+
+#define LOAD_FRAME() \
+	do { \
+		ip = frame->ip; \
+		slots = frame->slots; \
+		constants = frame->function->chunk.constants.values; \
+	} while (false)
+
+#define RUNTIME_ERROR(...) \
+	do { \
+		frame->ip = ip; \
+		registerRuntimeError(__VA_ARGS__); \
+		return INTERPRET_RUNTIME_ERROR; \
+	} while (false)
+
+#define NUMBER_OP(valueType, op, b, c, message) \
+	do { \
+		Value vb = (b); \
+		Value vc = (c); \
+		if (!IS_NUMBER(vb) || !IS_NUMBER(vc)) RUNTIME_ERROR(message); \
+		R(a) = valueType(AS_NUMBER(vb) op AS_NUMBER(vc)); \
+	} while (false)
+
+#define COMPARE_JUMP(op, b, c, message) \
+	do { \
+		Value vb = (b); \
+		Value vc = (c); \
+		uint16_t offset = READ_SHORT(); \
+		if (!IS_NUMBER(vb) || !IS_NUMBER(vc)) RUNTIME_ERROR(message); \
+		if (!(AS_NUMBER(vb) op AS_NUMBER(vc))) ip += offset; \
+	} while (false)
+
+#ifdef COMPUTED_GOTO
+#define REG_SWITCH(op)	goto *dispatchTable[op];
+#define REG_CASE(op)	op_##op
+#define REG_DEFAULT		op_UNKNOWN
+#define REG_NEXT() \
+	do { \
+		vm.instructionCount++; \
+		goto *dispatchTable[instruction = READ_BYTE()]; \
+	} while (false)
+#else
+#define REG_SWITCH(op)	switch (op)
+#define REG_CASE(op)	case op
+#define REG_DEFAULT		default
+#define REG_NEXT()		continue
+#endif
+
+InterpretResult runRegisterCode(CallFrame* frame) {
+#ifdef COMPUTED_GOTO
+	// opcodes not listed are left NULL and pointed at op_UNKNOWN on the
+	// first call, so no entry is initialized twice
+	static void* dispatchTable[UINT8_COUNT] = {
+		[R_MOVE] = &&op_R_MOVE,
+		[R_LOADK] = &&op_R_LOADK,
+		[R_LOADNIL] = &&op_R_LOADNIL,
+		[R_LOADTRUE] = &&op_R_LOADTRUE,
+		[R_LOADFALSE] = &&op_R_LOADFALSE,
+		[R_GET_GLOBAL] = &&op_R_GET_GLOBAL,
+		[R_SET_GLOBAL] = &&op_R_SET_GLOBAL,
+		[R_DEFINE_GLOBAL] = &&op_R_DEFINE_GLOBAL,
+		[R_GET_GLOBAL_SLOT] = &&op_R_GET_GLOBAL_SLOT,
+		[R_SET_GLOBAL_SLOT] = &&op_R_SET_GLOBAL_SLOT,
+		[R_DEFINE_GLOBAL_SLOT] = &&op_R_DEFINE_GLOBAL_SLOT,
+		[R_ADD] = &&op_R_ADD,
+		[R_ADDK] = &&op_R_ADDK,
+		[R_SUBTRACT] = &&op_R_SUBTRACT,
+		[R_SUBK] = &&op_R_SUBK,
+		[R_MULTIPLY] = &&op_R_MULTIPLY,
+		[R_DIVIDE] = &&op_R_DIVIDE,
+		[R_RANDOM] = &&op_R_RANDOM,
+		[R_EQUAL] = &&op_R_EQUAL,
+		[R_NOT_EQUAL] = &&op_R_NOT_EQUAL,
+		[R_GREATER] = &&op_R_GREATER,
+		[R_LESS] = &&op_R_LESS,
+		[R_NOT] = &&op_R_NOT,
+		[R_NEGATE] = &&op_R_NEGATE,
+		[R_PRINT] = &&op_R_PRINT,
+		[R_JUMP] = &&op_R_JUMP,
+		[R_LOOP] = &&op_R_LOOP,
+		[R_JUMP_IF_FALSE] = &&op_R_JUMP_IF_FALSE,
+		[R_LESS_JUMP_IF_FALSE] = &&op_R_LESS_JUMP_IF_FALSE,
+		[R_LESSK_JUMP_IF_FALSE] = &&op_R_LESSK_JUMP_IF_FALSE,
+		[R_GREATER_JUMP_IF_FALSE] = &&op_R_GREATER_JUMP_IF_FALSE,
+		[R_GREATERK_JUMP_IF_FALSE] = &&op_R_GREATERK_JUMP_IF_FALSE,
+		[R_CALL] = &&op_R_CALL,
+		[R_RETURN] = &&op_R_RETURN,
+	};
+	static bool dispatchFilled = false;
+	if (!dispatchFilled) {
+		for (int i = 0; i < UINT8_COUNT; i++) {
+			if (dispatchTable[i] == NULL) dispatchTable[i] = &&op_UNKNOWN;
+		}
+		dispatchFilled = true;
+	}
+#endif
+
+	uint8_t* ip;
+	Value* slots;
+	Value* constants;
+	uint8_t instruction;
+	LOAD_FRAME();
+	vm.stackTop = slots + frame->function->registerCount;
+
+	for (;;) {
+		vm.instructionCount++;
+		instruction = READ_BYTE();
+		REG_SWITCH(instruction) {
+
+		REG_CASE(R_MOVE): {
+			uint8_t a = READ_BYTE();
+			R(a) = R(READ_BYTE());
+			REG_NEXT();
+		}
+
+		REG_CASE(R_LOADK): {
+			uint8_t a = READ_BYTE();
+			R(a) = K(READ_BYTE());
+			REG_NEXT();
+		}
+
+		REG_CASE(R_LOADNIL):	R(READ_BYTE()) = NIL_VAL; REG_NEXT();
+		REG_CASE(R_LOADTRUE):	R(READ_BYTE()) = BOOL_VAL(true); REG_NEXT();
+		REG_CASE(R_LOADFALSE):	R(READ_BYTE()) = BOOL_VAL(false); REG_NEXT();
+
+		REG_CASE(R_GET_GLOBAL): {
+			uint8_t a = READ_BYTE();
+			ObjString* name = AS_STRING(K(READ_BYTE()));
+			Value* value = cachedGlobal(&frame->function->chunk.caches[READ_SHORT()], name);
+			if (value == NULL) RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+			R(a) = *value;
+			REG_NEXT();
+		}
+
+		REG_CASE(R_SET_GLOBAL): {
+			ObjString* name = AS_STRING(K(READ_BYTE()));
+			Value* value = cachedGlobal(&frame->function->chunk.caches[READ_SHORT()], name);
+			if (value == NULL) RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+			*value = R(READ_BYTE());
+			globalWriteBarrier((int)(value - vm.globalValues.values), *value);
+			REG_NEXT();
+		}
+
+		REG_CASE(R_DEFINE_GLOBAL): {
+			ObjString* name = AS_STRING(K(READ_BYTE()));
+			int slot = globalSlot(name);
+			vm.globalValues.values[slot] = R(READ_BYTE());
+			globalWriteBarrier(slot, vm.globalValues.values[slot]);
+			REG_NEXT();
+		}
+
+		REG_CASE(R_GET_GLOBAL_SLOT): {
+			uint8_t a = READ_BYTE();
+			uint16_t slot = READ_SHORT();
+			Value value = vm.globalValues.values[slot];
+			if (IS_UNDEFINED(value)) {
+				RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+			}
+			R(a) = value;
+			REG_NEXT();
+		}
+
+		REG_CASE(R_SET_GLOBAL_SLOT): {
+			uint16_t slot = READ_SHORT();
+			uint8_t b = READ_BYTE();
+			if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+				RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+			}
+			vm.globalValues.values[slot] = R(b);
+			globalWriteBarrier(slot, R(b));
+			REG_NEXT();
+		}
+
+		REG_CASE(R_DEFINE_GLOBAL_SLOT): {
+			uint16_t slot = READ_SHORT();
+			vm.globalValues.values[slot] = R(READ_BYTE());
+			globalWriteBarrier(slot, vm.globalValues.values[slot]);
+			REG_NEXT();
+		}
+
+		REG_CASE(R_ADD): {
+			uint8_t a = READ_BYTE();
+			uint8_t rb = READ_BYTE();
+			uint8_t rc = READ_BYTE();
+			Value b = R(rb);
+			Value c = R(rc);
+			if (IS_NUMBER(b) && IS_NUMBER(c)) {
+				R(a) = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+			}
+			else if (IS_ANY_STRING(b) && IS_ANY_STRING(c)) {
+				R(a) = addStrings(&R(rb), &R(rc));  // can move the strings in the registers
+			}
+			else {
+				RUNTIME_ERROR("Operands must be two numbers or two strings.");
+			}
+			REG_NEXT();
+		}
+
+		REG_CASE(R_ADDK): {
+			uint8_t a = READ_BYTE();
+			uint8_t rb = READ_BYTE();
+			Value b = R(rb);
+			Value c = K(READ_BYTE());  // constants are never young
+			if (IS_NUMBER(b) && IS_NUMBER(c)) {
+				R(a) = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+			}
+			else if (IS_ANY_STRING(b) && IS_STRING(c)) {
+				R(a) = addStrings(&R(rb), &c);
+			}
+			else {
+				RUNTIME_ERROR("Operands must be two numbers or two strings.");
+			}
+			REG_NEXT();
+		}
+
+		REG_CASE(R_SUBTRACT): {
+			uint8_t a = READ_BYTE();
+			uint8_t b = READ_BYTE();
+			NUMBER_OP(NUMBER_VAL, -, R(b), R(READ_BYTE()), "Operands for subtract must be two numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_SUBK): {
+			uint8_t a = READ_BYTE();
+			uint8_t b = READ_BYTE();
+			NUMBER_OP(NUMBER_VAL, -, R(b), K(READ_BYTE()), "Operands for subtract must be two numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_MULTIPLY): {
+			uint8_t a = READ_BYTE();
+			uint8_t b = READ_BYTE();
+			NUMBER_OP(NUMBER_VAL, *, R(b), R(READ_BYTE()), "Operands must be numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_DIVIDE): {
+			uint8_t a = READ_BYTE();
+			uint8_t b = READ_BYTE();
+			NUMBER_OP(NUMBER_VAL, /, R(b), R(READ_BYTE()), "Operands must be numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_RANDOM): {
+			uint8_t a = READ_BYTE();
+			Value b = R(READ_BYTE());
+			Value c = R(READ_BYTE());
+			if (!IS_NUMBER(b) || !IS_NUMBER(c)) {
+				RUNTIME_ERROR("Operands for random must be two numbers.");
+			}
+			R(a) = NUMBER_VAL(randomNumber(AS_NUMBER(b), AS_NUMBER(c)));
+			REG_NEXT();
+		}
+
+		REG_CASE(R_EQUAL): {
+			uint8_t a = READ_BYTE();
+			Value b = R(READ_BYTE());
+			R(a) = BOOL_VAL(valuesEqual(b, R(READ_BYTE())));
+			REG_NEXT();
+		}
+
+		REG_CASE(R_NOT_EQUAL): {
+			uint8_t a = READ_BYTE();
+			Value b = R(READ_BYTE());
+			R(a) = BOOL_VAL(!valuesEqual(b, R(READ_BYTE())));
+			REG_NEXT();
+		}
+
+		REG_CASE(R_GREATER): {
+			uint8_t a = READ_BYTE();
+			uint8_t b = READ_BYTE();
+			NUMBER_OP(BOOL_VAL, >, R(b), R(READ_BYTE()), "Operands for greater than must be two numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_LESS): {
+			uint8_t a = READ_BYTE();
+			uint8_t b = READ_BYTE();
+			NUMBER_OP(BOOL_VAL, <, R(b), R(READ_BYTE()), "Operands for less than must be two numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_NOT): {
+			uint8_t a = READ_BYTE();
+			R(a) = BOOL_VAL(isFalsey(R(READ_BYTE())));
+			REG_NEXT();
+		}
+
+		REG_CASE(R_NEGATE): {
+			uint8_t a = READ_BYTE();
+			Value b = R(READ_BYTE());
+			if (!IS_NUMBER(b)) RUNTIME_ERROR("Operand must be a number.");
+			R(a) = NUMBER_VAL(-AS_NUMBER(b));
+			REG_NEXT();
+		}
+
+		REG_CASE(R_PRINT):
+			printValue(R(READ_BYTE()));
+			printf("\n");
+			REG_NEXT();
+
+		REG_CASE(R_JUMP): {
+			uint16_t offset = READ_SHORT();
+			ip += offset;
+			REG_NEXT();
+		}
+
+		REG_CASE(R_LOOP): {
+			uint16_t offset = READ_SHORT();
+			ip -= offset;
+			REG_NEXT();
+		}
+
+		REG_CASE(R_JUMP_IF_FALSE): {
+			Value b = R(READ_BYTE());
+			uint16_t offset = READ_SHORT();
+			if (isFalsey(b)) ip += offset;
+			REG_NEXT();
+		}
+
+		REG_CASE(R_LESS_JUMP_IF_FALSE): {
+			uint8_t b = READ_BYTE();
+			uint8_t c = READ_BYTE();
+			COMPARE_JUMP(<, R(b), R(c), "Operands for less than must be two numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_LESSK_JUMP_IF_FALSE): {
+			uint8_t b = READ_BYTE();
+			uint8_t c = READ_BYTE();
+			COMPARE_JUMP(<, R(b), K(c), "Operands for less than must be two numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_GREATER_JUMP_IF_FALSE): {
+			uint8_t b = READ_BYTE();
+			uint8_t c = READ_BYTE();
+			COMPARE_JUMP(>, R(b), R(c), "Operands for greater than must be two numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_GREATERK_JUMP_IF_FALSE): {
+			uint8_t b = READ_BYTE();
+			uint8_t c = READ_BYTE();
+			COMPARE_JUMP(>, R(b), K(c), "Operands for greater than must be two numbers.");
+			REG_NEXT();
+		}
+
+		REG_CASE(R_CALL): {
+			uint8_t a = READ_BYTE();
+			int argCount = READ_BYTE();
+			Value callee = R(a);
+			frame->ip = ip;
+
+			if (IS_NATIVE(callee)) {
+				R(a) = AS_NATIVE(callee)(argCount, &R(a + 1));
+				REG_NEXT();
+			}
+			if (!IS_FUNCTION(callee)) {
+				RUNTIME_ERROR("Can only call functions and classes.");
+			}
+
+			ObjFunction* function = AS_FUNCTION(callee);
+			if (argCount != function->arity) {
+				RUNTIME_ERROR("Expected %d arguments but got %d.", function->arity, argCount);
+			}
+			if (vm.frameCount == FRAMES_MAX) {
+				RUNTIME_ERROR("Stack overflow.");
+			}
+
+			// the callee's registers start at the callee register - R(0) is the function, then the args
+			frame = &vm.frames[vm.frameCount++];
+			frame->function = function;
+			frame->ip = function->registerChunk.code;
+			frame->start_ip = function->registerChunk.code;
+			frame->slots = &R(a);
+			LOAD_FRAME();
+			vm.stackTop = slots + function->registerCount;
+			REG_NEXT();
+		}
+
+		REG_CASE(R_RETURN): {
+			Value result = R(READ_BYTE());
+			vm.frameCount--;
+			if (vm.frameCount == 0) {
+				vm.stackTop = vm.stack;
+				return INTERPRET_OK;
+			}
+			// the caller finds the result in the register that held the callee
+			slots[0] = result;
+			frame = &vm.frames[vm.frameCount - 1];
+			LOAD_FRAME();
+			vm.stackTop = slots + frame->function->registerCount;
+			REG_NEXT();
+		}
+
+		REG_DEFAULT:
+			printf(" ** FATAL ERROR UNKNOWN REGISTER OPCODE %d **\n", instruction);
+			return INTERPRET_RUNTIME_ERROR;
+		}
+	}
+}
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef R
+#undef K
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef NUMBER_OP
+#undef COMPARE_JUMP
+#undef REG_SWITCH
+#undef REG_CASE
+#undef REG_DEFAULT
+#undef REG_NEXT
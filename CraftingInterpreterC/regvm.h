@@ -0,0 +1,76 @@
+#pragma once
+#ifndef clox_regvm_h
+#define clox_regvm_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// Register based backend - run with  clox --registers file.lox
+//
+// The stack VM moves every operand through vm.stackTop.  Here each
+// instruction names its operands as registers, and a register is just a
+// slot in the call frame: R(n) is frame->slots[n].  The locals already live
+// in those slots, and a temporary lives in the slot the stack VM would have
+// pushed it to, so  i = i + 1;  becomes a single R_ADDK i i k  instead of
+// GET_LOCAL, ADD_CONST, SET_LOCAL, POP.
+//
+// The register code is built from the finished stack bytecode at the end
+// of each function compile (see regcompiler.c) and is kept next to it in
+// ObjFunction.registerChunk, sharing the constants of function->chunk.
+// If any function uses an opcode the translator does not know (arrays for
+// now) the whole program runs on the stack VM instead.
+//
+// Operands are one byte each: A is the destination register, B and C are
+// source registers, K is a constant index, jumps have a 16 bit offset.
+
+typedef enum {
+	R_INVALID,
+	R_MOVE,				// A B        R(A) = R(B)
+	R_LOADK,			// A K        R(A) = K
+	R_LOADNIL,			// A
+	R_LOADTRUE,			// A
+	R_LOADFALSE,		// A
+	R_GET_GLOBAL,		// A K cache16    R(A) = globals[K]
+	R_SET_GLOBAL,		// K cache16 B    globals[K] = R(B)
+	R_DEFINE_GLOBAL,	// K B
+	R_GET_GLOBAL_SLOT,		// A slot16    R(A) = vm.globalValues[slot]
+	R_SET_GLOBAL_SLOT,		// slot16 B
+	R_DEFINE_GLOBAL_SLOT,	// slot16 B
+
+	R_ADD,				// A B C      R(A) = R(B) + R(C)
+	R_ADDK,				// A B K      R(A) = R(B) + K
+	R_SUBTRACT,			// A B C
+	R_SUBK,				// A B K
+	R_MULTIPLY,			// A B C
+	R_DIVIDE,			// A B C
+	R_RANDOM,			// A B C
+	R_EQUAL,			// A B C
+	R_NOT_EQUAL,		// A B C
+	R_GREATER,			// A B C
+	R_LESS,				// A B C
+	R_NOT,				// A B
+	R_NEGATE,			// A B
+
+	R_PRINT,			// B
+	R_JUMP,				// offset
+	R_LOOP,				// offset (backwards)
+	R_JUMP_IF_FALSE,	// B offset
+	R_LESS_JUMP_IF_FALSE,		// B C offset   jump unless R(B) < R(C)
+	R_LESSK_JUMP_IF_FALSE,		// B K offset
+	R_GREATER_JUMP_IF_FALSE,	// B C offset
+	R_GREATERK_JUMP_IF_FALSE,	// B K offset
+	R_CALL,				// A argCount  callee in R(A), args in R(A+1) ...  result back in R(A)
+	R_RETURN			// B
+} RegOpCode;
+
+// regcompiler.c - translate function->chunk into function->registerChunk
+// returns false (and leaves registerChunk empty) if it can't
+bool compileRegisterCode(ObjFunction* function);
+
+// regvm.c
+// true if the function and every function it defines have register code
+bool registerCodeReady(ObjFunction* function);
+InterpretResult runRegisterCode(CallFrame* frame);
+
+#endif
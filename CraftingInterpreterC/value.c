@@ -8,21 +8,43 @@
 void printValueType(Value value) {
     // printf("%g", value); // ch 17
     //printf("%g", AS_NUMBER(value)); // ch 18
-    switch (value.type) {
-    case VAL_BOOL: printf("BOOL"); break;
-    case VAL_NIL: printf("nil"); break;
-    case VAL_NUMBER: printf("NUMBER"); break;
-    case VAL_OBJ: printf("OBJECT"); break;
-    case VAL_ARRAY_REF: printf(" *array ref ** "); break;
-    case VAL_ARRAY_STAR: printf("*"); break;
-    default:
-        printf("UNKNOWN!!");
-    }
+    // tested with the IS_ macros so this works with or without NAN_BOXING
+    if (IS_BOOL(value)) printf("BOOL");
+    else if (IS_NIL(value)) printf("nil");
+    else if (IS_NUMBER(value)) printf("NUMBER");
+    else if (IS_OBJ(value)) printf("OBJECT");
+    else if (IS_ARRAY_REF(value)) printf(" *array ref ** ");
+    else if (IS_ARRAY_STAR(value)) printf("*");
+    else if (IS_RANGE(value)) printf("RANGE");
+    else printf("UNKNOWN!!");
 }
 
 void printValue(Value value) {
     // printf("%g", value); // ch 17
     //printf("%g", AS_NUMBER(value)); // ch 18
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    }
+    else if (IS_NIL(value)) {
+        printf("nil");
+    }
+    else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    }
+    else if (IS_OBJ(value)) {
+        printObject(value);
+    }
+    else if (IS_ARRAY_REF(value)) {
+        printf(" *array ref ** ");
+    }
+    else if (IS_ARRAY_STAR(value)) {
+        printf("*");
+    }
+    else if (IS_RANGE(value)) {
+        printf("%d:%d", RANGE_LO(value), RANGE_HI(value));
+    }
+#else
     switch (value.type) {
         case VAL_BOOL:
             printf(AS_BOOL(value) ? "true" : "false");
@@ -32,10 +54,22 @@ void printValue(Value value) {
         case VAL_OBJ: printObject(value); break;
         case VAL_ARRAY_REF: printf(" *array ref ** "); break;
         case VAL_ARRAY_STAR: printf("*"); break;
+        case VAL_RANGE: printf("%d:%d", RANGE_LO(value), RANGE_HI(value)); break;
     }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) { // added ch 18.4.2 page 339
+#ifdef NAN_BOXING
+    // a NaN is never equal to itself so compare numbers as doubles
+    // everything else (interned strings included) is equal when the bits are,
+    // except a string builder
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (a == b) return true;
+    return (IS_BUILDER(a) || IS_BUILDER(b)) && builderEquals(a, b);
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
@@ -50,9 +84,15 @@ bool valuesEqual(Value a, Value b) { // added ch 18.4.2 page 339
                     aString->length) == 0;
         }         */
         // TODO as of end of Ch 20 this seems to break expression "x" == "x"
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);  // optimization using interning - Ch20.5 pg 380
+        case VAL_OBJ:    // optimization using interning - Ch20.5 pg 380
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            return (IS_BUILDER(a) || IS_BUILDER(b)) && builderEquals(a, b);
+        case VAL_ARRAY_REF: return AS_ARRAY_REF(a) == AS_ARRAY_REF(b);
+        case VAL_ARRAY_STAR: return true;
+        case VAL_RANGE:  return RANGE_LO(a) == RANGE_LO(b) && RANGE_HI(a) == RANGE_HI(b);
         default:         return false; // Unreachable.
     }
+#endif
 }
 
 void initValueArray(ValueArray* array) {
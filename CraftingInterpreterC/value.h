@@ -18,64 +18,53 @@ struct ObjString {
 
 typedef struct ObjString ObjString;
 
+// Array variables are not GC objects - a Value can refer to one directly (see array.h)
+typedef struct ArrayVariable ArrayVariable;
+
 #ifdef NAN_BOXING
+// Ch 30.3 Optimization - a Value is 8 bytes
+// any double that is not a quiet NaN is a number
+// otherwise the quiet NaN bits plus a tag (or a pointer) give the other types
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
 #define QNAN     ((uint64_t)0x7ffc000000000000)
 
-#define TAG_NIL   1 // 01.
-#define TAG_FALSE 2 // 10.
-#define TAG_TRUE  3 // 11.
+#define TAG_NIL        1 // 001.
+#define TAG_FALSE      2 // 010.
+#define TAG_TRUE       3 // 011.
+#define TAG_ARRAY_STAR 4 // 100.  * as Array subscript = All values
+#define TAG_UNDEFINED  5 // 101.  global slot that has no definition yet
 
-typedef enum {
-    VAL_BOOL,
-    VAL_NIL, 
-    VAL_NUMBER,
-    VAL_OBJ,
-    VAL_ARRAY_REF,  // refer to Array variable
-    VAL_ARRAY_STAR  // * as Array subscript = All values
-} ValueType;
-
-
-// typedef double Value; // ch 17
-// Value is 16 bytes. 
-
-/* CH 18 */
-typedef struct {
-    ValueType type;
-    union {
-        bool boolean;
-        double number;
-        Obj* obj;
-        // TODO Array* arrayVar;
-    } as;
-} Value;
+// Obj pointers have the sign bit set and use the low 48 bits for the address
+// refs to an Array variable also set bit 48 so they never look like an Obj
+#define TAG_ARRAY_REF ((uint64_t)0x0001000000000000)
 
-/*
-typedef struct {
-    ValueType type;  // likely 4 bytes (enum stored as int) uint8_t  ??
-    union {
-        bool boolean;  // 1 byte
-        double number; // 8 bytes
-        Obj* obj;      // 8 bytes on 64-bit systems
-    } as;
-} Value;
-*/
+// lo:hi as an array subscript - bit 48 without the sign bit, and both bounds
+// in 24 bits (see RANGE_MIN), so making one is never an allocation
+#define TAG_RANGE ((uint64_t)0x0001000000000000)
 
-// typedef uint64_t Value;
-//> is-number
+typedef uint64_t Value;
 
-
-/*  version  NAN_BOXING
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) \
-    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+    (((value) & (QNAN | SIGN_BIT | TAG_ARRAY_REF)) == (QNAN | SIGN_BIT))
+#define IS_ARRAY_REF(value) \
+    (((value) & (QNAN | SIGN_BIT | TAG_ARRAY_REF)) == \
+        (QNAN | SIGN_BIT | TAG_ARRAY_REF))
+#define IS_ARRAY_STAR(value) ((value) == ARRAY_STAR_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_RANGE(value) \
+    (((value) & (QNAN | SIGN_BIT | TAG_RANGE)) == (QNAN | TAG_RANGE))
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
 #define AS_NUMBER(value)    valueToNum(value)
 #define AS_OBJ(value) \
     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_ARRAY_REF(value) \
+    ((ArrayVariable*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN | TAG_ARRAY_REF)))
+#define RANGE_LO(value)     ((int32_t)((uint32_t)((value) >> 24) << 8) >> 8)
+#define RANGE_HI(value)     ((int32_t)((uint32_t)(value) << 8) >> 8)
 
 #define BOOL_VAL(b)     ((b) ? TRUE_VAL : FALSE_VAL)
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
@@ -84,23 +73,12 @@ typedef struct {
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
-*/
-
-#define IS_BOOL(value)    ((value).type == VAL_BOOL)
-#define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
-#define IS_OBJ(value)     ((value).type == VAL_OBJ)
-
-#define AS_OBJ(value)     ((value).as.obj)
-#define AS_BOOL(value)    ((value).as.boolean)
-#define AS_NUMBER(value)  ((value).as.number)
-
-#define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
-#define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
-#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
-#define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
-
-#define ARRAY_STAR_VAL           ((Value){VAL_ARRAY_STAR})
+#define ARRAY_REF_VAL(arrayVar) \
+    (Value)(SIGN_BIT | QNAN | TAG_ARRAY_REF | (uint64_t)(uintptr_t)(arrayVar))
+#define ARRAY_STAR_VAL  ((Value)(uint64_t)(QNAN | TAG_ARRAY_STAR))
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define RANGE_VAL(lo, hi) \
+    ((Value)(QNAN | TAG_RANGE | ((uint64_t)((lo) & 0xffffff) << 24) | (uint64_t)((hi) & 0xffffff)))
 
 static inline double valueToNum(Value value) {
     double num;
@@ -122,7 +100,11 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL, // [user-types]
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_ARRAY_REF,  // refer to Array variable
+    VAL_ARRAY_STAR, // * as Array subscript = All values
+    VAL_UNDEFINED,  // global slot that has no definition yet - never on the stack
+    VAL_RANGE       // lo:hi as Array subscript
 } ValueType;
 
 //< Types of Values value-type
@@ -130,14 +112,15 @@ typedef enum {
 typedef double Value;
 */
 
+// CH 18 - Value is 16 bytes
 typedef struct {
     ValueType type;
     union {
         bool boolean;
         double number;
-        //> Strings union-object
-        // llm future Obj* obj;
-        //< Strings union-object
+        Obj* obj;
+        ArrayVariable* arrayVar;
+        struct { int lo; int hi; } range;
     } as; 
 } Value;
 
@@ -147,18 +130,34 @@ typedef struct {
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_ARRAY_REF(value)  ((value).type == VAL_ARRAY_REF)
+#define IS_ARRAY_STAR(value) ((value).type == VAL_ARRAY_STAR)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define IS_RANGE(value)   ((value).type == VAL_RANGE)
 
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
+#define AS_ARRAY_REF(value) ((value).as.arrayVar)
+#define RANGE_LO(value)   ((value).as.range.lo)
+#define RANGE_HI(value)   ((value).as.range.hi)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define ARRAY_REF_VAL(arrayVariable) \
+    ((Value){VAL_ARRAY_REF, {.arrayVar = arrayVariable}})
+#define ARRAY_STAR_VAL    ((Value){VAL_ARRAY_STAR, {.number = 0}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
+#define RANGE_VAL(lo, hi) ((Value){VAL_RANGE, {.range = {lo, hi}}})
 
 #endif
 
+// the bounds a range can have - what fits the NAN_BOXING form, in both builds
+#define RANGE_MIN (-0x800000)
+#define RANGE_MAX 0x7fffff
+
 typedef struct {
     int capacity;
     int count;
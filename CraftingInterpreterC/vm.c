@@ -12,12 +12,19 @@
 #include "vm.h"
 #include "native.h"
 #include "array.h"
+#include "profile.h"
+#include "regvm.h"
+#include "jit.h"
+#include "arraykernel.h"
 
 VM vm; // [one]
 
 static void resetStack() {
 	vm.stackTop = vm.stack;
 	vm.frameCount = 0;  // added Ch 24
+	vm.crossSection = -1;
+	vm.crossSectionValues.count = 0;
+	releaseLocalArrays(&vm.localArrays, 0);
 	// vm.openUpvalues = NULL;
 }
 
@@ -65,7 +72,8 @@ static void runtimeError(const char* format, ...) {
 static void defineNative(const char* name, NativeFn function) {
 	push(OBJ_VAL(copyString(name, (int)strlen(name))));
 	push(OBJ_VAL(newNative(function)));
-	tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+	int slot = globalSlot(AS_STRING(vm.stack[0]));  // may grow globalValues
+	vm.globalValues.values[slot] = vm.stack[1];
 	pop();
 	pop();
 }
@@ -74,21 +82,61 @@ void initVM() {
 	////> call-reset-stack
 	resetStack();
 	vm.objects = NULL; // Ch 19.5 page 353
+	vm.bytesAllocated = 0;
+	vm.nextGC = GC_FIRST_COLLECTION;
+	vm.gcGrowFactor = GC_HEAP_GROW_FACTOR;
+	vm.grayCount = 0;
+	vm.grayCapacity = 0;
+	vm.grayStack = NULL;
+	vm.gcCount = 0;
+	vm.gcFreed = 0;
+	vm.gcPhase = GC_IDLE;
+	vm.gcSliceBudget = 0;
+	vm.gcSlices = 0;
+	for (int i = 0; i < GC_PAUSE_BUCKETS; i++) vm.gcPauses[i] = 0;
+	vm.gcLongestPause = 0;
+	vm.nursery = (uint8_t*)allocate(NURSERY_SIZE);
+	vm.nurseryTop = vm.nursery;
+	vm.rememberedSlots = NULL;
+	vm.rememberedCount = 0;
+	vm.rememberedCapacity = 0;
+	vm.rememberedGlobals = NULL;
+	vm.rememberedGlobalCount = 0;
+	vm.rememberedGlobalCapacity = 0;
+	vm.minorCollecting = false;
+	vm.minorCount = 0;
+	vm.promotedCount = 0;
+	vm.slabCount = 0;
+	vm.slabsReleased = 0;
 	
 	// vm.strings is for string interning - a unique place for each string so we can compare equality by a simple pointer compare
 	// this table is more of a hashset - the entries themselves are not used
 	initTable(&vm.strings); // Ch 20.5 used for String interning - unique place for each string so we can compare equality
 
 	initTable(&vm.globals); // ch 21.2 for global vars pg 390
+	initValueArray(&vm.globalValues);
+	initValueArray(&vm.globalNames);
 	initTable(&vm.globalArrayVars); 
+	initValueArray(&vm.crossSectionValues);
+	initLocalArrays(&vm.localArrays);
 	
-	vm.arrayVarList.arrayVarCount = 0;
+	initArrayVariables(&vm.arrayVarList);
 	
 	defineNative("clock", clockNative);
 
 	vm.instructionCount = 0;
 	vm.pushCount = 0;
 	vm.popCount = 0;
+	vm.registerBackend = false;
+	vm.peephole = true;
+	vm.peepholeInstructions = 0;
+	vm.peepholeBytes = 0;
+	vm.jit = false;
+	vm.jitFunctionCount = 0;
+#ifdef JIT_X64
+	vm.jitThreshold = JIT_HOT_CALLS;
+	vm.jitLoopThreshold = JIT_HOT_LOOPS;
+#endif
 
 	srand((unsigned int)time(NULL)); // seed rng
 }
@@ -100,9 +148,45 @@ void freeVM() {
 	printf("\n");
 	freeTable(&vm.strings); // Ch 20.5
 	freeTable(&vm.globals); // ch 21.2
+	freeValueArray(&vm.globalValues);
+	freeValueArray(&vm.globalNames);
 	freeTable(&vm.globalArrayVars);
+	freeValueArray(&vm.crossSectionValues);
 	freeObjects();  // Ch 19.5 
+	free(vm.grayStack);
+	vm.grayStack = NULL;
+	vm.grayCapacity = 0;
+	free(vm.nursery);
+	vm.nursery = vm.nurseryTop = NULL;
+	free(vm.rememberedSlots);
+	vm.rememberedSlots = NULL;
+	vm.rememberedCapacity = 0;
+	free(vm.rememberedGlobals);
+	vm.rememberedGlobals = NULL;
+	vm.rememberedGlobalCapacity = 0;
+	freeArrayVariables(&vm.arrayVarList);  // after the slices that point into it
+	freeLocalArrays(&vm.localArrays);
+
+#ifdef PROFILE_OPCODES
+	printOpcodeProfile(20);
+#endif
+
+}
 
+// Globals get a slot the first time the compiler sees the name, so the VM
+// indexes vm.globalValues instead of hashing the name on every access.
+// vm.globals keeps name -> slot, so REPL lines compiled later get the same slots
+// and a function can use a global that is only defined further down.
+int globalSlot(ObjString* name) {
+	Value slot;
+	if (tableGet(&vm.globals, name, &slot)) return (int)AS_NUMBER(slot);
+
+	push(OBJ_VAL(name));  // the compiler may have just made it - keep it through a collection
+	writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+	writeValueArray(&vm.globalNames, OBJ_VAL(name));
+	tableSet(&vm.globals, name, NUMBER_VAL(vm.globalValues.count - 1));
+	pop();
+	return vm.globalValues.count - 1;
 }
 
 // added in Ch 15.2.1
@@ -134,12 +218,6 @@ Value pop() {
 	return *vm.stackTop;
 }
 
-static Value* peek_ptr(int distance) {
-	return &vm.stackTop[-1 - distance];
-}
-
-
-
 static Value peek(int distance) {
 	return vm.stackTop[-1 - distance];
 }
@@ -168,6 +246,15 @@ static bool call(ObjFunction* function, int argCount) {
 
 	// line up arguments on the stack - in effect binding them
 	frame->slots = vm.stackTop - argCount - 1;
+	frame->arrayMark = vm.localArrays.count;
+
+#ifdef JIT_X64
+	// hot - compile it now, OP_CALL runs the native code for this call already
+	// (not the top level script, it only gets called once)
+	if (vm.jit && function->name != NULL && ++function->callCount == vm.jitThreshold) {
+		jitCompile(function);
+	}
+#endif
 	return true;
 }
 
@@ -178,6 +265,9 @@ static bool callValue(Value callee, int argCount) {
 			return call(AS_FUNCTION(callee), argCount);
 		case OBJ_NATIVE: {
 			NativeFn native = AS_NATIVE(callee);
+			for (Value* arg = vm.stackTop - argCount; arg < vm.stackTop; arg++) {
+				if (IS_BUILDER(*arg)) *arg = OBJ_VAL(flattenString(AS_BUILDER(*arg)));
+			}
 			Value result = native(argCount, vm.stackTop - argCount);
 			vm.stackTop -= argCount + 1;
 			push(result);
@@ -198,30 +288,17 @@ static bool isFalsey(Value value) {
 
 // ch 19.4.1 pg 350
 static void concatenate() {
-	ObjString* b = AS_STRING(pop());
-	ObjString* a = AS_STRING(pop());
-	
 	//> Garbage Collection concatenate-peek
-	// LLM ObjString* b = AS_STRING(peek(0));
-	// LLM  ObjString* a = AS_STRING(peek(1));
+	// left on the stack until the result is made, in case that collects
+	// or the nursery moves them
+	Value result = addStrings(&vm.stackTop[-2], &vm.stackTop[-1]);
 	//< Garbage Collection concatenate-peek
-
-	int length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
-
-	ObjString* result = takeString(chars, length);
-	
-	/* LLM 
 	
 	//> Garbage Collection concatenate-pop
 	pop();
 	pop();
 	//< Garbage Collection concatenate-pop
-	*/
-	push(OBJ_VAL(result));  // cH 19.4.1
+	push(result);  // cH 19.4.1
 }
 
 /* for debugging can add this to macro
@@ -266,6 +343,145 @@ double randomNumber(double a, double b) {
 	return (double)randNum;
 }
 
+// the array operand of an array instruction (see ARRAY_LOCAL) - a global array,
+// or the view of a slice in a variable.  NULL if there isn't one
+static ArrayVariable* findArray(CallFrame* frame, uint16_t operand) {
+	Value value;
+	if (operand & ARRAY_LOCAL) {
+		value = frame->slots[operand & ~ARRAY_LOCAL];
+		if (IS_ARRAY_REF(value)) return AS_ARRAY_REF(value);  // a local array
+	}
+	else {
+		ObjString* name = AS_STRING(frame->function->chunk.constants.values[operand]);
+		if (tableGet(&vm.globalArrayVars, name, &value)) return AS_ARRAY_REF(value);
+		Entry* entry = tableGetEntry(&vm.globals, name);
+		if (entry == NULL) return NULL;
+		value = vm.globalValues.values[(int)AS_NUMBER(entry->value)];
+	}
+	return IS_SLICE(value) ? &AS_SLICE(value)->view : NULL;
+}
+
+// findArray for the element ops - a global array comes out of the op's inline
+// cache, so only a local or a slice in a global variable is looked for
+static inline ArrayVariable* cachedArray(CallFrame* frame, uint16_t operand, GlobalCache* cache) {
+	if (!(operand & ARRAY_LOCAL)) {
+		if (cache->entry == NULL || cache->version != vm.globalArrayVars.version) {
+			ObjString* name = AS_STRING(frame->function->chunk.constants.values[operand]);
+			cache->entry = tableGetEntry(&vm.globalArrayVars, name);
+			cache->version = vm.globalArrayVars.version;
+		}
+		if (cache->entry != NULL) return AS_ARRAY_REF(cache->entry->value);
+	}
+	return findArray(frame, operand);
+}
+
+// element of an array the compiler proved the subscripts are in bounds for
+static inline Value* uncheckedElement(ArrayVariable* varDefn, Value subscripts[]) {
+	int index = -varDefn->offset;
+	for (int i = 0; i < varDefn->dimensions; i++) {
+		index += (int)AS_NUMBER(subscripts[i]) * varDefn->strides[i];
+	}
+	return &varDefn->arrayValues[index];
+}
+
+// the bounds the compiler saw for a global array are the ones it has
+static bool sameBounds(ArrayVariable* varDefn, int subscriptCount, ArrayBound bounds[]) {
+	if (varDefn->dimensions != subscriptCount) return false;
+	for (int i = 0; i < subscriptCount; i++) {
+		if (varDefn->bounds[i].lBound != bounds[i].lBound || varDefn->bounds[i].uBound != bounds[i].uBound) return false;
+	}
+	return true;
+}
+
+// findArray (cachedArray with a cache), or NULL after the runtime error
+static ArrayVariable* arrayOperand(CallFrame* frame, uint16_t operand, GlobalCache* cache) {
+	ArrayVariable* varDefn = cache != NULL ? cachedArray(frame, operand, cache) : findArray(frame, operand);
+	if (varDefn != NULL && arrayReleased(&vm.localArrays, varDefn)) {
+		runtimeError("Slice of a local array that no longer exists.");
+		return NULL;
+	}
+	if (varDefn == NULL) {
+		if (operand & ARRAY_LOCAL) {
+			runtimeError("Can only subscript arrays and slices.");
+		}
+		else {
+			ObjString* name = AS_STRING(frame->function->chunk.constants.values[operand]);
+			Entry* entry = tableGetEntry(&vm.globals, name);
+			if (entry == NULL || IS_UNDEFINED(vm.globalValues.values[(int)AS_NUMBER(entry->value)])) {
+				runtimeError("Undefined variable '%s'.", name->chars);
+			}
+			else {
+				runtimeError("'%s' is not an array or a slice.", name->chars);
+			}
+		}
+	}
+	return varDefn;
+}
+
+// a(*) = ..., b(*) in its right hand side and slices - the array, with the
+// subscripts the right number and in bounds, or NULL after the runtime error
+static ArrayVariable* crossSectionArray(CallFrame* frame, uint16_t operand, int subscriptCount) {
+	ArrayVariable* varDefn = arrayOperand(frame, operand, NULL);
+	if (varDefn == NULL) return NULL;
+	if (subscriptCount != varDefn->dimensions) {
+		runtimeError("array subscripts do not match array dimensions");
+		return NULL;
+	}
+
+	char err_buffer[200];
+	if (!checkCrossSection(varDefn, vm.stackTop - subscriptCount, err_buffer, sizeof(err_buffer))) {
+		runtimeError(err_buffer);
+		return NULL;
+	}
+	return varDefn;
+}
+
+// b(*) as an operand of a bulk kernel - all of b, which has to have the stars
+// dimensions and count elements like the loop would check.  A slice that
+// overlaps dest without being dest is left to the loop: element at a time it
+// reads what was written before, a kernel (memmove, SIMD) wouldn't
+static bool kernelOperand(CallFrame* frame, int stars, uint16_t index, int count, Value* dest,
+	KernelOperand* operand) {
+	if (stars == 0) {
+		operand->values = NULL;
+		operand->constant = frame->function->chunk.constants.values[index];
+		return true;
+	}
+
+	ArrayVariable* varDefn = findArray(frame, index);
+	if (varDefn == NULL || arrayReleased(&vm.localArrays, varDefn)) return false;
+	Value all[MAXARRAYDIMENSIONS] = { ARRAY_STAR_VAL, ARRAY_STAR_VAL, ARRAY_STAR_VAL };
+	if (varDefn->dimensions != stars || crossSectionCount(varDefn, all) != count) return false;
+	operand->values = crossSectionSpan(varDefn, all);
+	operand->constant = NUMBER_VAL(0);
+	if (operand->values == NULL) return false;
+	return operand->values == dest ||
+		operand->values + count <= dest || dest + count <= operand->values;
+}
+
+// OP_ARRAY_KERNEL - the stack is the one the loop starts with: subscripts, array,
+// element count, saved vm.crossSection, cursor.  true if the kernel did the
+// whole cross section, and then the stack is left the way OP_SET_CROSS_SECTION leaves it
+static bool runArrayKernel(CallFrame* frame, uint8_t kernel, uint16_t b, uint16_t c) {
+	ArrayVariable* varDefn = AS_ARRAY_REF(vm.stackTop[-4]);
+	Value* subscripts = vm.stackTop - 4 - varDefn->dimensions;
+	int count = (int)AS_NUMBER(vm.stackTop[-3]);
+	Value* dest = crossSectionSpan(varDefn, subscripts);
+
+	KernelOperand bOperand, cOperand;
+	if (dest == NULL ||
+		!kernelOperand(frame, KERNEL_B_STARS(kernel), b, count, dest, &bOperand) ||
+		!kernelOperand(frame, KERNEL_C_STARS(kernel), c, count, dest, &cOperand) ||
+		!arrayKernel(KERNEL_OP(kernel), dest, count, bOperand, cOperand)) {
+		return false;
+	}
+
+	vm.crossSection = (int)AS_NUMBER(vm.stackTop[-2]);
+	vm.stackTop = subscripts;
+	push(dest[count - 1]);
+	return true;
+}
+
 static Value valueMemoize;
 
 #define READ_BYTE() (*frame->ip++)
@@ -274,14 +490,82 @@ static Value valueMemoize;
 #define READ_SHORT() \
     (frame->ip += 2, \
     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_INT() \
+    (frame->ip += 4, \
+    (int)(((uint32_t)frame->ip[-4] << 24) | (frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+
+// the wide forms - see OP_CONSTANT_LONG and the *_LONG jumps in chunk.h
+#define READ_CONSTANT_LONG() \
+    (frame->ip += 3, \
+    frame->function->chunk.constants.values[(frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]])
+#define READ_LONG_JUMP() (frame->function->chunk.longJumps[READ_SHORT()])
 
 
+// the cache16 of an array element op - a local array has none
+#define READ_ARRAY_CACHE(operand) \
+    (frame->ip += 2, \
+    ((operand) & ARRAY_LOCAL) ? NULL : &frame->function->chunk.caches[(frame->ip[-2] << 8) | frame->ip[-1]])
+
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_NAME() AS_STRING(frame->function->chunk.constants.values[READ_SHORT()])
+
+// Opcode dispatch.  With COMPUTED_GOTO each handler ends with its own
+// indirect jump through dispatchTable (threaded code) so the branch predictor
+// gets a separate history per opcode instead of one shared switch branch.
+// Otherwise VM_NEXT() just goes around the for loop to the switch again.
+#ifdef COMPUTED_GOTO
+#define VM_SWITCH(op)	goto *dispatchTable[op];
+#define VM_CASE(op)		op_##op
+#define VM_DEFAULT		op_UNKNOWN
+#define VM_NEXT() \
+	do { \
+		if (!infiniteLoop && frame->ip >= end_ip_ptr) goto end_of_range; \
+		vm.instructionCount++; \
+		goto *dispatchTable[instruction = READ_BYTE()]; \
+	} while (false)
+#else
+#define VM_SWITCH(op)	switch (op)
+#define VM_CASE(op)		case op
+#define VM_DEFAULT		default
+#define VM_NEXT()		continue
+#endif
 
-Value* get_value_for_set_array(ValueContext* ctx) {
-	interpret_bytecode_loop(ctx->frame, ctx->start, ctx->end, false);
-	return peek_ptr(0);
+// Quickening - rewrite the opcode we are executing (frame->ip is already past it)
+#define QUICKEN(op)		(frame->ip[-1] = (uint8_t)(op))
+// undo a quickened opcode and run the generic one in its place
+// (a plain block, not do/while, since VM_NEXT() is a continue for the switch)
+#define DEOPTIMIZE(genericOp) \
+	{ \
+		frame->ip[-1] = (uint8_t)(genericOp); \
+		frame->ip--; \
+		VM_NEXT(); \
+	}
+
+static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, int endIp, bool infiniteLoop);
+
+#ifdef JIT_X64
+// OP_CALL made from JIT code - runs the callee to the end, native or not,
+// and leaves its result on the stack
+InterpretResult jitCall(int argCount) {
+	int frameCount = vm.frameCount;
+	if (!callValue(peek(argCount), argCount)) return INTERPRET_RUNTIME_ERROR;
+	if (vm.frameCount == frameCount) return INTERPRET_OK;  // a native function, already done
+
+	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	if (frame->function->jitCode != NULL) return runJitCode(frame);
+	return interpret_bytecode_loop(frame, 0, 0, true);
+}
+
+// the JIT leaves an instruction (or a failed fast path) to the interpreter
+InterpretResult jitInterpret(CallFrame* frame, int startIp, int endIp) {
+	return interpret_bytecode_loop(frame, startIp, endIp, false);
+}
+
+// OP_RETURN of a function that declares arrays
+void jitReleaseArrays(CallFrame* frame) {
+	releaseLocalArrays(&vm.localArrays, frame->arrayMark);
 }
+#endif
 
 static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, int endIp, bool infiniteLoop) {
 	// normal case is a forever loop - ends on OP_RETURN
@@ -290,6 +574,7 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 
 	uint8_t* saved_ip;
 	uint8_t* end_ip_ptr = NULL;
+	int baseFrameCount = vm.frameCount;  // OP_RETURN from this frame leaves the loop
 
 	if (!infiniteLoop) {
 		// we are running a subset of the code
@@ -299,6 +584,88 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 		end_ip_ptr = frame->start_ip + endIp;
 	}
 
+#ifdef COMPUTED_GOTO
+	// labels-as-values (GCC / Clang) - must have an entry for every opcode the VM handles;
+	// the rest are left NULL and pointed at op_UNKNOWN on the first call
+	static void* dispatchTable[UINT8_COUNT] = {
+		[OP_INVALID] = &&op_OP_INVALID,
+		[OP_CONSTANT] = &&op_OP_CONSTANT,
+		[OP_NIL] = &&op_OP_NIL,
+		[OP_TRUE] = &&op_OP_TRUE,
+		[OP_FALSE] = &&op_OP_FALSE,
+		[OP_POP] = &&op_OP_POP,
+		[OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+		[OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+		[OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+		[OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+		[OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+		[OP_GET_GLOBAL_ARRAY] = &&op_OP_GET_GLOBAL_ARRAY,
+		[OP_SET_GLOBAL_ARRAY] = &&op_OP_SET_GLOBAL_ARRAY,
+		[OP_DEFINE_GLOBAL_ARRAY] = &&op_OP_DEFINE_GLOBAL_ARRAY,
+		[OP_EQUAL] = &&op_OP_EQUAL,
+		[OP_GREATER] = &&op_OP_GREATER,
+		[OP_LESS] = &&op_OP_LESS,
+		[OP_ADD] = &&op_OP_ADD,
+		[OP_SUBTRACT] = &&op_OP_SUBTRACT,
+		[OP_MULTIPLY] = &&op_OP_MULTIPLY,
+		[OP_DIVIDE] = &&op_OP_DIVIDE,
+		[OP_NOT] = &&op_OP_NOT,
+		[OP_NEGATE] = &&op_OP_NEGATE,
+		[OP_PRINT] = &&op_OP_PRINT,
+		[OP_JUMP] = &&op_OP_JUMP,
+		[OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+		[OP_LOOP] = &&op_OP_LOOP,
+		[OP_CALL] = &&op_OP_CALL,
+		[OP_RETURN] = &&op_OP_RETURN,
+		[OP_RANDOM] = &&op_OP_RANDOM,
+		[OP_ADD_NUM] = &&op_OP_ADD_NUM,
+		[OP_ADD_STR] = &&op_OP_ADD_STR,
+		[OP_SUBTRACT_NUM] = &&op_OP_SUBTRACT_NUM,
+		[OP_GREATER_NUM] = &&op_OP_GREATER_NUM,
+		[OP_LESS_NUM] = &&op_OP_LESS_NUM,
+		[OP_ADD_MIXED] = &&op_OP_ADD_MIXED,
+		[OP_GET_LOCAL2] = &&op_OP_GET_LOCAL2,
+		[OP_ADD_CONST] = &&op_OP_ADD_CONST,
+		[OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+		[OP_POP_JUMP_IF_FALSE] = &&op_OP_POP_JUMP_IF_FALSE,
+		[OP_LESS_JUMP_IF_FALSE] = &&op_OP_LESS_JUMP_IF_FALSE,
+		[OP_GREATER_JUMP_IF_FALSE] = &&op_OP_GREATER_JUMP_IF_FALSE,
+		[OP_GET_GLOBAL_SLOT] = &&op_OP_GET_GLOBAL_SLOT,
+		[OP_SET_GLOBAL_SLOT] = &&op_OP_SET_GLOBAL_SLOT,
+		[OP_DEFINE_GLOBAL_SLOT] = &&op_OP_DEFINE_GLOBAL_SLOT,
+		[OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+		[OP_NOT_LESS] = &&op_OP_NOT_LESS,
+		[OP_NOT_GREATER] = &&op_OP_NOT_GREATER,
+		[OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+		[OP_JUMP_LONG] = &&op_OP_JUMP_LONG,
+		[OP_JUMP_IF_FALSE_LONG] = &&op_OP_JUMP_IF_FALSE_LONG,
+		[OP_POP_JUMP_IF_FALSE_LONG] = &&op_OP_POP_JUMP_IF_FALSE_LONG,
+		[OP_LESS_JUMP_IF_FALSE_LONG] = &&op_OP_LESS_JUMP_IF_FALSE_LONG,
+		[OP_GREATER_JUMP_IF_FALSE_LONG] = &&op_OP_GREATER_JUMP_IF_FALSE_LONG,
+		[OP_LOOP_LONG] = &&op_OP_LOOP_LONG,
+		[OP_CROSS_SECTION] = &&op_OP_CROSS_SECTION,
+		[OP_SET_CROSS_SECTION] = &&op_OP_SET_CROSS_SECTION,
+		[OP_GET_CROSS_SECTION] = &&op_OP_GET_CROSS_SECTION,
+		[OP_ARRAY_KERNEL] = &&op_OP_ARRAY_KERNEL,
+		[OP_RANGE] = &&op_OP_RANGE,
+		[OP_SLICE] = &&op_OP_SLICE,
+		[OP_DEFINE_LOCAL_ARRAY] = &&op_OP_DEFINE_LOCAL_ARRAY,
+		[OP_RELEASE_ARRAYS] = &&op_OP_RELEASE_ARRAYS,
+		[OP_GET_ARRAY_UNCHECKED] = &&op_OP_GET_ARRAY_UNCHECKED,
+		[OP_SET_ARRAY_UNCHECKED] = &&op_OP_SET_ARRAY_UNCHECKED,
+	};
+	static bool dispatchFilled = false;
+	if (!dispatchFilled) {
+		for (int i = 0; i < UINT8_COUNT; i++) {
+			if (dispatchTable[i] == NULL) dispatchTable[i] = &&op_UNKNOWN;
+		}
+		dispatchFilled = true;
+	}
+#endif
+
+	uint8_t instruction;
+	int jumpOffset;  // the *_LONG jumps read it from chunk->longJumps and share the code below
+
 	// the interpreter loop  - normally this is infinite and will end with the OP_RETURN opcode
 	for (; infiniteLoop || frame->ip < end_ip_ptr;) {
 		vm.instructionCount++;
@@ -317,47 +684,92 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 		disassembleInstruction(&frame->function->chunk,
 			(int)(frame->ip - frame->function->chunk.code));
 #endif
-		uint8_t instruction;
-		switch (instruction = READ_BYTE()) {
+		instruction = READ_BYTE();
+#ifdef PROFILE_OPCODES
+		profileOpcode(instruction);
+#endif
+		VM_SWITCH(instruction) {
 
 
-		case OP_INVALID:
+		VM_CASE(OP_INVALID):
 			printf(" ** FATAL ERROR BAD BYTECODE **\n");
 			return INTERPRET_RUNTIME_ERROR;
 
 			// Ch 23.1.1 pg 418 (jump forward)
-		case OP_JUMP: {
-			uint16_t offset = READ_SHORT();
+		VM_CASE(OP_JUMP_LONG):
+			jumpOffset = READ_LONG_JUMP();
+			goto jump;
+		VM_CASE(OP_JUMP): {
+			jumpOffset = READ_SHORT();
+		jump:
 			//vm.ip += offset;
-			frame->ip += offset;
-			break;
+			frame->ip += jumpOffset;
+			VM_NEXT();
 		}
 
 					// Ch 23.1 pg 416
-		case OP_JUMP_IF_FALSE: {
-			uint16_t offset = READ_SHORT();
+		VM_CASE(OP_JUMP_IF_FALSE_LONG):
+			jumpOffset = READ_LONG_JUMP();
+			goto jumpIfFalse;
+		VM_CASE(OP_JUMP_IF_FALSE): {
+			jumpOffset = READ_SHORT();
+		jumpIfFalse:
 			//if (isFalsey(peek(0))) vm.ip += offset;
-			if (isFalsey(peek(0))) frame->ip += offset;
-			break;
+			if (isFalsey(peek(0))) frame->ip += jumpOffset;
+			VM_NEXT();
 		}
 
 							 // ch 23.3 pg 423 for while (loop backwards)
-		case OP_LOOP: {
-			uint16_t offset = READ_SHORT();
+		VM_CASE(OP_LOOP_LONG):
+			jumpOffset = READ_LONG_JUMP();
+			goto loop;
+		VM_CASE(OP_LOOP): {
+			jumpOffset = READ_SHORT();
+		loop:
 			//vm.ip -= offset;
-			frame->ip -= offset;
-			break;
+			frame->ip -= jumpOffset;
+#ifdef JIT_X64
+			// back edge counter - a hot loop carries on in native code from the
+			// loop header (on-stack replacement, see jit.h)
+			if (vm.jit && infiniteLoop) {
+				ObjFunction* function = frame->function;
+				if (function->jitCode == NULL && ++function->loopCount == vm.jitLoopThreshold) {
+					jitCompile(function);
+				}
+				if (function->jitCode != NULL && function->jitOffsets[frame->ip - function->chunk.code] >= 0) {
+					if (runJitCodeAt(frame) != INTERPRET_OK) return INTERPRET_RUNTIME_ERROR;
+					// the native code ran the rest of the function, OP_RETURN included
+					if (vm.frameCount == 0) {
+						pop();	// the script, as in OP_RETURN
+						return INTERPRET_OK;
+					}
+					if (vm.frameCount < baseFrameCount) return INTERPRET_OK;
+					frame = &vm.frames[vm.frameCount - 1];
+				}
+			}
+#endif
+			VM_NEXT();
 		}
 
-		case OP_CALL: {
+		VM_CASE(OP_CALL): {
 			// function call pg 452
 			int argCount = READ_BYTE();
+#ifdef JIT_X64
+			int frameCount = vm.frameCount;
+#endif
 			if (!callValue(peek(argCount), argCount)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			// Next VM instruction will start running the function 
 			frame = &vm.frames[vm.frameCount - 1];
-			break;
+#ifdef JIT_X64
+			// compiled by the JIT - the native code runs the whole call
+			if (vm.frameCount > frameCount && frame->function->jitCode != NULL) {
+				if (runJitCode(frame) != INTERPRET_OK) return INTERPRET_RUNTIME_ERROR;
+				frame = &vm.frames[vm.frameCount - 1];
+			}
+#endif
+			VM_NEXT();
 		}
 
 					/* removed on ch 21 pg 384
@@ -369,13 +781,14 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 
 					// Les 11/8/25 - needed to include OP_RETURN around page 385 to avoid issues
 					// see also https://github.com/munificent/craftinginterpreters/issues/877
-		case OP_RETURN: {
+		VM_CASE(OP_RETURN): {
 			// return INTERPRET_OK; // prior to Ch 24
 
 			// New logic on pg 456 24.5.4
 			// pop the function's result so we can hold onto it
 			Value result = pop();
 			// closeUpvalues(frame->slots);
+			releaseLocalArrays(&vm.localArrays, frame->arrayMark);
 			vm.frameCount--;
 			if (vm.frameCount == 0) {
 				pop();
@@ -385,20 +798,26 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 			vm.stackTop = frame->slots;
 			// function return now goes to top of stack
 			push(result);
+			// the call was made from JIT code (jitCall) - back to it
+			if (vm.frameCount < baseFrameCount) return INTERPRET_OK;
 			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			VM_NEXT();
 		}
 
 					  // case OP_NEGATE:   push(-pop()); break; // ch17
-		case OP_NEGATE:
+		VM_CASE(OP_NEGATE):
 			if (!IS_NUMBER(peek(0))) {
 				runtimeError("Operand must be a number.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			push(NUMBER_VAL(-AS_NUMBER(pop())));
-			break;
+			VM_NEXT();
+
+		VM_CASE(OP_CONSTANT_LONG):
+			push(READ_CONSTANT_LONG());
+			VM_NEXT();
 
-		case OP_CONSTANT: { // Added in ch 18.4
+		VM_CASE(OP_CONSTANT): { // Added in ch 18.4
 			Value constant = READ_CONSTANT();
 			/*printf("Debug: Got constant: ");
 			printValue(constant);
@@ -411,7 +830,7 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 			//> push-constant
 			push(constant);
 			//< push-constant
-			break;
+			VM_NEXT();
 		}
 
 						/* CH 17 version
@@ -423,20 +842,19 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 
 						// case OP_ADD:		BINARY_OP(NUMBER_VAL, +); break; // ch 18 version page 333
 						// ch 19.4.1 pg 351 string concat
-		case OP_ADD: {
+		VM_CASE(OP_ADD): {
 			// printf("OP ADD\n");
-			if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-				concatenate();
-			}
-			else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+			// numbers are by far the common case so test them first
+			if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+				QUICKEN(OP_ADD_NUM);
 				/* Unoptimized version
 				double b = AS_NUMBER(pop());
 				double a = AS_NUMBER(pop());
 				push(NUMBER_VAL(a + b));*/
 
 				/* optimized version eliminates 2 stack movements - LLM 11/11/25 */
-				double b = ((peek(0)).as.number);
-				double a = ((peek(1)).as.number);
+				double b = AS_NUMBER(peek(0));
+				double a = AS_NUMBER(peek(1));
 
 				// first optimization approach puts a Value back on stack without popping the two operands
 
@@ -449,47 +867,52 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 				// second optimization leverages that that slot is already a number, so we just overlay the LH operand number in place!
 				discardMultipleItemsFromStack(1);  // a is now top of stack; will overlay it's value
 				//				double bPrime = ((peek(0)).as.number);
-				(*(vm.stackTop - 1)).as.number = a + b;  // should really create a new stack operation for this - overlayTopStackNumberValue
+				vm.stackTop[-1] = NUMBER_VAL(a + b);  // should really create a new stack operation for this - overlayTopStackNumberValue
 				//				double bPrime2 = ((peek(0)).as.number);
 								// printf("done");
 
 			}
+			else if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+				QUICKEN(OP_ADD_STR);
+				concatenate();
+			}
 			else {
 				runtimeError(
 					"Operands must be two numbers or two strings.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			VM_NEXT();
 		}
 
 				   // case OP_SUBTRACT:	BINARY_OP(NUMBER_VAL, -); break;  unoptimized
-		case OP_SUBTRACT: {
+		VM_CASE(OP_SUBTRACT): {
 			if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-				double b = ((peek(0)).as.number);
-				double a = ((peek(1)).as.number);
+				QUICKEN(OP_SUBTRACT_NUM);
+				double b = AS_NUMBER(peek(0));
+				double a = AS_NUMBER(peek(1));
 				discardMultipleItemsFromStack(1);
-				(*(vm.stackTop - 1)).as.number = a - b;
+				vm.stackTop[-1] = NUMBER_VAL(a - b);
 			}
 			else {
 				runtimeError(
 					"Operands for subtract must be two numbers.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			VM_NEXT();
 		}
 
-		case OP_MULTIPLY:	BINARY_OP(NUMBER_VAL, *); break;
+		VM_CASE(OP_MULTIPLY):	BINARY_OP(NUMBER_VAL, *); VM_NEXT();
 
 
-		case OP_DIVIDE:		BINARY_OP(NUMBER_VAL, / ); break;
+		VM_CASE(OP_DIVIDE):		BINARY_OP(NUMBER_VAL, / ); VM_NEXT();
 
 			// new ch 18.4.1 pg 336
-		case OP_NOT:
+		VM_CASE(OP_NOT):
 			push(BOOL_VAL(isFalsey(pop())));
-			break;
+			VM_NEXT();
 
 			// new ch 21.1.1 pg 384
-		case OP_PRINT: {
+		VM_CASE(OP_PRINT): {
 
 			// very fast for benchmarking
 			/* for (int i = 0; i < 10000000; i++) {
@@ -503,60 +926,85 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 
 			printValue(pop());
 			printf("\n");
-			break;
+			VM_NEXT();
 		}
 
 					 // new ch 18.4 pg 335
-		case OP_NIL:		push(NIL_VAL); break;
-		case OP_TRUE:		push(BOOL_VAL(true)); break;
-		case OP_FALSE:		push(BOOL_VAL(false)); break;
+		VM_CASE(OP_NIL):		push(NIL_VAL); VM_NEXT();
+		VM_CASE(OP_TRUE):		push(BOOL_VAL(true)); VM_NEXT();
+		VM_CASE(OP_FALSE):		push(BOOL_VAL(false)); VM_NEXT();
 
-		case OP_POP: pop(); break;  // ch 21.1.2 pg 386
+		VM_CASE(OP_POP): pop(); VM_NEXT();  // ch 21.1.2 pg 386
 
-		case OP_GET_GLOBAL: { // ch 21.3
-			ObjString* name = READ_STRING();
+		VM_CASE(OP_GET_GLOBAL): { // ch 21.3
+			ObjString* name = READ_NAME();
+			GlobalCache* cache = &frame->function->chunk.caches[READ_SHORT()];
 			
 			// printf("get global for %s\n", name->chars);
-			Value value;
-			if (!tableGet(&vm.globals, name, &value)) {
+			Value* value = cachedGlobal(cache, name);
+			if (value == NULL) {
 				runtimeError("Undefined variable '%s'.", name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			push(value);
-			break;
+			push(*value);
+			VM_NEXT();
 
 		}
 
-		case OP_SET_GLOBAL: { // Ch 21.4 pg 393
-			ObjString* name = READ_STRING();
-			if (tableSet(&vm.globals, name, peek(0))) {
-				// if the global variable was not defined, remove it from the globals for REPL session, and report error
-				tableDelete(&vm.globals, name); // [delete]
+		VM_CASE(OP_SET_GLOBAL): { // Ch 21.4 pg 393
+			ObjString* name = READ_NAME();
+			GlobalCache* cache = &frame->function->chunk.caches[READ_SHORT()];
+			Value* value = cachedGlobal(cache, name);
+			if (value == NULL) {
+				// assignment does not define a global
 				runtimeError("Undefined variable '%s'.", name->chars);
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			*value = peek(0);
+			globalWriteBarrier((int)(value - vm.globalValues.values), *value);
+			VM_NEXT();
 		}
-		case OP_GET_GLOBAL_ARRAY: { // get a value or set of values from an Array element based on subscripts
-			ObjString* name = READ_STRING();
-			Value value = NIL_VAL;
 
-			// printf("get global array for %s\n", name->chars);
-			if (!tableGet(&vm.globalArrayVars, name, &value)) {
-				runtimeError("Undefined variable '%s'.", name->chars);
+		// globals resolved by the compiler - 2 byte slot in vm.globalValues
+		VM_CASE(OP_GET_GLOBAL_SLOT): {
+			uint16_t slot = READ_SHORT();
+			Value value = vm.globalValues.values[slot];
+			if (IS_UNDEFINED(value)) {
+				runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			push(value);
+			VM_NEXT();
+		}
 
-			ArrayVariable* varDefn;
-			// Value arrayDefinition = { VAL_ARRAY_REF , .as.obj = varDefn };
-			varDefn = (ArrayVariable*)value.as.obj;
-			int dimensions = varDefn->dimensions;
+		VM_CASE(OP_SET_GLOBAL_SLOT): {
+			uint16_t slot = READ_SHORT();
+			if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+				runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			vm.globalValues.values[slot] = peek(0);
+			globalWriteBarrier(slot, peek(0));
+			VM_NEXT();
+		}
 
-			// int idOfArrayVar = READ_BYTE();
+		VM_CASE(OP_DEFINE_GLOBAL_SLOT): {
+			uint16_t slot = READ_SHORT();
+			vm.globalValues.values[slot] = peek(0);
+			globalWriteBarrier(slot, peek(0));
+			pop();
+			VM_NEXT();
+		}
+		VM_CASE(OP_GET_GLOBAL_ARRAY): { // get a value or set of values from an Array element based on subscripts
+			// an array, or a slice in a variable
+			uint16_t operand = READ_SHORT();
 			int subscriptCount = READ_BYTE();
+			GlobalCache* cache = READ_ARRAY_CACHE(operand);
+			ArrayVariable* varDefn = arrayOperand(frame, operand, cache);
+			if (varDefn == NULL) return INTERPRET_RUNTIME_ERROR;
+			int dimensions = varDefn->dimensions;
 
-			// TODO the subscript can be * (partially supported)
-			//      or a range such as 5:10
+			// (b(*) and b(5:10) are OP_GET_CROSS_SECTION or OP_SLICE)
 
 			if (subscriptCount == 0) {
 				runtimeError("array var ref without any subscripts");
@@ -568,20 +1016,8 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			Value subscripts[MAXARRAYDIMENSIONS];
-
-			for (int i = 0; i < subscriptCount; i++) {
-				Value temp = peek(i - i);
-				subscripts[i] = peek(i - i);
-				// printf("Subscript % d is ", i);
-				// printValue(subscripts[i]);
-			}
-			// printf("\n");
-
-			// TODO optimize so we just do the pops no peeks
-			for (int i = 0; i < subscriptCount; i++) {
-				pop();
-			}
+			// the first subscript is deepest in the stack
+			Value* subscripts = vm.stackTop - subscriptCount;
 
 			// varDefn->arrayValues[2] = fake;
 
@@ -592,18 +1028,16 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 			// getArrayValue(ArrayVariable* varDefn, Value subscripts[], char* errbuf, size_t errbuf_size);
 			char err_buffer[200];
 			Value* valuePtr;
-			valuePtr = getArrayValue(varDefn, &subscripts, err_buffer, sizeof(err_buffer));
+			valuePtr = getArrayValue(varDefn, subscripts, err_buffer, sizeof(err_buffer));
 			if (valuePtr == NULL) {
 				runtimeError(err_buffer);
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			vm.stackTop = subscripts;
 			push(*valuePtr);
 
 
 
-			// TODO the bounds are offsets so subtract 1
-			// TODO multiple dimensions?
-			// TODO * get would need to return an array slice
 
 
 
@@ -615,129 +1049,181 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 			//	return INTERPRET_RUNTIME_ERROR;
 			//}
 
-			break;
+			VM_NEXT();
 
 		}
 
-		case OP_SET_GLOBAL_ARRAY: { // Ch 21.4 pg 393
+		VM_CASE(OP_SET_GLOBAL_ARRAY): { // Ch 21.4 pg 393
 			// 0004    | OP_SET_GLOBAL_ARRAY    1 Subscripts=1
 
-			// (frame->function->chunk.constants.values[READ_BYTE()])
-
 			// for globalArrayVars the Value will not be the scalar value
 			//  instead it is a Object that points into our Array struct
-
-			//  READ_STRING  ((ObjString*)(((frame->function->chunk.constants.values[(*frame->ip++)])).as.obj))
-			uint8_t* frame_ip = frame->ip;
-			ObjString* name = READ_STRING();
-			Value value = NIL_VAL;
-
-			// printf("set global array for %s\n", name->chars);
 			Value rhs = peek(0);
 
 			// For regular globals, the vm.globals is a dynamic lookup to an entry, and we simply set its Value to the rhs contents
-			// For array globals, we could  have a rhs that is in itself an array, such as B(1:5) or B(*)
-			// 
-			// Initial logic
-			//   globalArrayVars when being defined takes a Value object that is what defines the bounds of the array and the pointer to its storage location as an array of Values
-			//   here in SET (or in GET) we need to pull out the definition, apply index logic, and locate the actual Value(s)
-
-			//if (tableSet(&vm.globalArrayVars, name, peek(0))) {
-			//	tableDelete(&vm.globalArrayVars, name); 
-			//	runtimeError("Undefined global array variable '%s'.", name->chars);
-			//	return INTERPRET_RUNTIME_ERROR;
-			//}
-
-			if (!tableGet(&vm.globalArrayVars, name, &value)) {
-				runtimeError("Undefined global array variable '%s'.", name->chars);
-				return INTERPRET_RUNTIME_ERROR;
-			}
-
-			ArrayVariable* varDefn = (ArrayVariable*)value.as.obj;
-			int dimensions = varDefn->dimensions;
-
-			uint8_t start_rhs_ip = READ_BYTE(); // new so we can handle star assigment e.g. var a(10); a(*) = 1?100;
+			// For array globals we pull out the definition, apply index logic, and locate the actual Value
+			// (a slice is a view, so this sets the element of the array it is a view of)
+			// a(*) = ... never gets here - the compiler makes that a loop (OP_CROSS_SECTION)
+			uint16_t operand = READ_SHORT();
 			int subscriptCount = READ_BYTE();
+			GlobalCache* cache = READ_ARRAY_CACHE(operand);
+			ArrayVariable* varDefn = arrayOperand(frame, operand, cache);
+			if (varDefn == NULL) return INTERPRET_RUNTIME_ERROR;
+			int dimensions = varDefn->dimensions;
 
 			if (subscriptCount == 0) {
 				runtimeError("array var ref without any subscripts");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			// printf("there are %d subscripts.  Rhs ip start is %d\n", subscriptCount, start_rhs_ip);
-
-
 			if (subscriptCount != dimensions) {
 				runtimeError("array subscripts do not match array dimensions");
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			Value subscripts[MAXARRAYDIMENSIONS];
+			// the subscripts are under the rhs
+			Value* subscripts = vm.stackTop - 1 - subscriptCount;
 
-			for (int i = 0; i < subscriptCount; i++) {
-				subscripts[i] = peek(subscriptCount - i);
-				//printf("Subscript % d is ", i); printValue(subscripts[i]); printf("\n");
-			}
-			for (int i = 0; i < subscriptCount; i++) {
-				pop();
+			char err_buffer[200];
+			if (!setArrayValue(varDefn, rhs, subscripts, err_buffer, sizeof(err_buffer))) {
+				runtimeError(err_buffer);
+				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			int currentInstruction = frame_ip - frame->start_ip - 1; // this should be the OP_SET_GLOBAL_ARRAY opcode
-
-			ValueContext ctx = {
-				.frame = frame,
-				.start = start_rhs_ip,
-				.end = currentInstruction
-			};
-
+			// leave the rhs as the value of the assignment
+			vm.stackTop = subscripts;
+			push(rhs);
+			VM_NEXT();
+		}
 
-			//varDefn->arrayValues[(int)(subscripts[0].as.number - 1)] = rhs;  // test - hardcoded to first subscript
-			char err_buffer[200];
-			// bool success = setArrayValue(varDefn, &rhs, &subscripts, &err_buffer, sizeof(err_buffer));
-			uint8_t* saved_ip = frame->ip;
-			
-			bool success = setArrayValue(varDefn, get_value_for_set_array, &ctx, &subscripts, &err_buffer, sizeof(err_buffer));
-			
+		// a(*) = ... - compiled as a loop around the right hand side, see crossSectionAssignment() in compiler.c
+		VM_CASE(OP_CROSS_SECTION): {
+			uint16_t array = READ_SHORT();
+			int subscriptCount = READ_BYTE();
+			ArrayVariable* varDefn = crossSectionArray(frame, array, subscriptCount);
+			if (varDefn == NULL) return INTERPRET_RUNTIME_ERROR;
+
+			push(ARRAY_REF_VAL(varDefn));	// the array - not looked up again for each element
+			push(NUMBER_VAL(crossSectionCount(varDefn, vm.stackTop - 1 - subscriptCount)));
+			push(NUMBER_VAL(vm.crossSection));	// put back at the end - the right hand side can call a function with its own
+			push(NUMBER_VAL(0));	// the cursor - next element to set
+			vm.crossSection = (int)(vm.stackTop - vm.stack) - 1;
+			VM_NEXT();
+		}
 
-			saved_ip = frame->ip = saved_ip;  // resume bytecode interpretation
+		// stack is subscripts, array, element count, saved vm.crossSection, cursor, rhs
+		VM_CASE(OP_SET_CROSS_SECTION): {
+			uint16_t offset = READ_SHORT();
+			int subscriptCount = READ_BYTE();
+			Value rhs = vm.stackTop[-1];
+			int cursor = (int)AS_NUMBER(vm.stackTop[-2]);
+			int count = (int)AS_NUMBER(vm.stackTop[-4]);
+			Value* subscripts = vm.stackTop - 5 - subscriptCount;
+
+			// nothing is stored until the right hand side is done - it can read
+			// the elements being set (a(2:5) = a(1:4), r(*) = r(5:1)).  A nested
+			// a(*) = ... in a function it calls is over by then, so ours are on top
+			writeValueArray(&vm.crossSectionValues, rhs);
+			if (++cursor < count) {
+				vm.stackTop[-2] = NUMBER_VAL(cursor);
+				vm.stackTop--;
+				frame->ip -= offset;	// the right hand side again
+			}
+			else {
+				ArrayVariable* varDefn = AS_ARRAY_REF(vm.stackTop[-5]);
+				Value* values = vm.crossSectionValues.values + vm.crossSectionValues.count - count;
+				for (int i = 0; i < count; i++) {
+					Value* element = crossSectionElement(varDefn, subscripts, i);
+					*element = values[i];
+					writeBarrier(element, values[i]);
+				}
+				vm.crossSectionValues.count -= count;
+				vm.crossSection = (int)AS_NUMBER(vm.stackTop[-3]);
+				vm.stackTop = subscripts;
+				push(rhs);	// the last value is the value of the assignment
+			}
+			VM_NEXT();
+		}
 
-			if (!success) {
-				runtimeError(err_buffer);
+		// b(*) - the element of b at the cursor of the a(*) = ... it is in
+		VM_CASE(OP_GET_CROSS_SECTION): {
+			uint16_t array = READ_SHORT();
+			int subscriptCount = READ_BYTE();
+			ArrayVariable* varDefn = crossSectionArray(frame, array, subscriptCount);
+			if (varDefn == NULL) return INTERPRET_RUNTIME_ERROR;
+
+			Value* cursor = &vm.stack[vm.crossSection];
+			Value* subscripts = vm.stackTop - subscriptCount;
+			int count = crossSectionCount(varDefn, subscripts);
+			if (count != (int)AS_NUMBER(cursor[-2])) {
+				runtimeError("Cross section sizes do not match: %d and %d elements.", (int)AS_NUMBER(cursor[-2]), count);
 				return INTERPRET_RUNTIME_ERROR;
 			}
+			Value element = *crossSectionElement(varDefn, subscripts, (int)AS_NUMBER(*cursor));
+			vm.stackTop = subscripts;
+			push(element);
+			VM_NEXT();
+		}
 
-			// TEST RERUN the rhs !!!
-			//interpret_bytecode_loop(frame, start_rhs_ip, currentInstruction, false);
-			//Value newRhs = peek(0);
-
+		// lo:hi as a subscript
+		VM_CASE(OP_RANGE): {
+			Value hi = pop();
+			Value lo = pop();
+			if (!IS_NUMBER(lo) || !IS_NUMBER(hi)) {
+				runtimeError("Range bounds must be numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			if (AS_NUMBER(lo) < RANGE_MIN || AS_NUMBER(lo) > RANGE_MAX || AS_NUMBER(hi) < RANGE_MIN || AS_NUMBER(hi) > RANGE_MAX) {
+				runtimeError("Range bounds must be between %d and %d.", RANGE_MIN, RANGE_MAX);
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			push(RANGE_VAL((int)AS_NUMBER(lo), (int)AS_NUMBER(hi)));
+			VM_NEXT();
+		}
 
-			// the long term correct logic needs to instead generate a loop at Compiler time
-			//    to process the cross-sectioning
-			//    var x(5); x(*) = 10?100; 
-			//    should generate ==> for (int compilerTemp = 0; compilerTemp < 5; compilerTemp++) {x(compilerTemp) = 10?100;}
+		// b(2:5), b(*) ... outside a(*) = ... - a view of b, nothing is copied
+		VM_CASE(OP_SLICE): {
+			uint16_t array = READ_SHORT();
+			int subscriptCount = READ_BYTE();
+			ArrayVariable* varDefn = crossSectionArray(frame, array, subscriptCount);
+			if (varDefn == NULL) return INTERPRET_RUNTIME_ERROR;
+
+			Value* subscripts = vm.stackTop - subscriptCount;
+			ObjSlice* slice = newSlice(varDefn, subscripts);
+			vm.stackTop = subscripts;
+			push(OBJ_VAL(slice));
+			VM_NEXT();
+		}
 
-			break;
+		// in front of the loop for a(*) = b(*) + c(*) and the like - see arraykernel.h
+		VM_CASE(OP_ARRAY_KERNEL): {
+			uint16_t offset = READ_SHORT();
+			uint8_t kernel = READ_BYTE();
+			uint16_t b = READ_SHORT();
+			uint16_t c = READ_SHORT();
+			if (runArrayKernel(frame, kernel, b, c)) frame->ip += offset;	// over the loop
+			VM_NEXT();
 		}
 
 
 
-		case OP_DEFINE_GLOBAL: { // ch 21.2
-			ObjString* name = READ_STRING();
+		VM_CASE(OP_DEFINE_GLOBAL): { // ch 21.2
+			ObjString* name = READ_NAME();
 			Value rhs = peek(0);  // will be NIL if there is no assignment
-			tableSet(&vm.globals, name, peek(0));
+			int slot = globalSlot(name);  // may grow globalValues
+			vm.globalValues.values[slot] = peek(0);
+			globalWriteBarrier(slot, peek(0));
 			pop();
-			break;
+			VM_NEXT();
 		}
 
-		case OP_DEFINE_GLOBAL_ARRAY: {
-			ObjString* name = READ_STRING();
+		VM_CASE(OP_DEFINE_GLOBAL_ARRAY): {
+			ObjString* name = READ_NAME();
 			// Initializer not present set each Array element to nil?
 			Value rhs = peek(0); // TODO handle an initializer on an array.  
 
-			if (vm.arrayVarList.arrayVarCount > MAXARRAYVARIABLES) error("Too many global array variables");
-
 			int subscriptCount = READ_BYTE();
-			int varCount = READ_SHORT(); // TODO support larger arrays
+			int varCount = READ_INT();
 			printf("Global var %s with subscript count %d total variable count %d\n", name->chars, subscriptCount, varCount);
 
 
@@ -747,20 +1233,28 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 			//ArrayVariable* varDefn = allocateArrayVar(bounds);
 			//vm.arrayVarList.arrayVars[vm.arrayVarList.arrayVarCount] = varDefn;
 
-			ArrayVariable* varDefn = allocateNewArrayVar(&vm.arrayVarList, subscriptCount, varCount);
+			ArrayVariable* varDefn = allocateNewArrayVar(&vm.arrayVarList, varCount);
 			varDefn->variableName = name->chars;
 			varDefn->dimensions = subscriptCount;
 			for (int i = 0; i < subscriptCount; i++) {
-				short lbound = READ_SHORT();
-				short ubound = READ_SHORT();
+				int lbound = READ_INT();
+				int ubound = READ_INT();
 				printf("Definition for subscript %d is %d:%d\n", i, lbound, ubound);
 				varDefn->bounds[i].lBound = lbound;
 				varDefn->bounds[i].uBound = ubound;
 			}
+			setArrayLayout(varDefn);
+
+			// declared again - code compiled against the old bounds may have left its checks out
+			Value previous;
+			if (tableGet(&vm.globalArrayVars, name, &previous)) {
+				ArrayVariable* old = AS_ARRAY_REF(previous);
+				varDefn->boundsVersion = old->boundsVersion + !sameBounds(old, subscriptCount, varDefn->bounds);
+			}
 
 
 
-			Value arrayDefinition = { VAL_ARRAY_REF , .as.obj = varDefn };
+			Value arrayDefinition = ARRAY_REF_VAL(varDefn);
 			// the lookup of the global variable name for the array will get us a pointer back to the definition
 			tableSet(&vm.globalArrayVars, name, arrayDefinition);
 
@@ -772,22 +1266,85 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 			*/ 
 			
 			pop();
-			break;
+			VM_NEXT();
+		}
+
+		// var t(10); in a function or block - the local's slot (the nil on top of
+		// the stack) gets the array, which is released with the scope
+		VM_CASE(OP_DEFINE_LOCAL_ARRAY): {
+			READ_SHORT();	// the name, for the disassembler
+			int subscriptCount = READ_BYTE();
+			int varCount = READ_INT();
+			ArrayVariable* varDefn = allocateLocalArrayVar(&vm.localArrays, varCount);
+			varDefn->variableName = "local";
+			varDefn->dimensions = subscriptCount;
+			for (int i = 0; i < subscriptCount; i++) {
+				varDefn->bounds[i].lBound = READ_INT();
+				varDefn->bounds[i].uBound = READ_INT();
+			}
+			setArrayLayout(varDefn);
+			vm.stackTop[-1] = ARRAY_REF_VAL(varDefn);
+			VM_NEXT();
+		}
+
+		// end of a block that declared arrays - keep the first n the function declared
+		VM_CASE(OP_RELEASE_ARRAYS): {
+			releaseLocalArrays(&vm.localArrays, frame->arrayMark + READ_BYTE());
+			VM_NEXT();
+		}
+
+		// a(i) inside for (var i = 1; i <= 10; ...) for a declared a(10) - the compiler
+		// has done the bounds check.  Still an array with that many subscripts and the
+		// bounds of its first declaration (the only ones the compiler leaves checks out
+		// for), or back to the checked op at this site (which gives the error).  A global array comes out of the
+		// inline cache, so an access is no table lookup either
+		VM_CASE(OP_GET_ARRAY_UNCHECKED): {
+			uint16_t operand = (uint16_t)((frame->ip[0] << 8) | frame->ip[1]);
+			int subscriptCount = frame->ip[2];
+			ArrayVariable* varDefn = (operand & ARRAY_LOCAL) ? findArray(frame, operand)
+				: cachedArray(frame, operand, &frame->function->chunk.caches[(frame->ip[3] << 8) | frame->ip[4]]);
+			if (varDefn == NULL || varDefn->dimensions != subscriptCount || varDefn->boundsVersion != 0) DEOPTIMIZE(OP_GET_GLOBAL_ARRAY);
+			frame->ip += 5;
+
+			Value* subscripts = vm.stackTop - subscriptCount;
+			Value value = *uncheckedElement(varDefn, subscripts);
+			vm.stackTop = subscripts;
+			push(value);
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_SET_ARRAY_UNCHECKED): {
+			uint16_t operand = (uint16_t)((frame->ip[0] << 8) | frame->ip[1]);
+			int subscriptCount = frame->ip[2];
+			ArrayVariable* varDefn = (operand & ARRAY_LOCAL) ? findArray(frame, operand)
+				: cachedArray(frame, operand, &frame->function->chunk.caches[(frame->ip[3] << 8) | frame->ip[4]]);
+			if (varDefn == NULL || varDefn->dimensions != subscriptCount || varDefn->boundsVersion != 0) DEOPTIMIZE(OP_SET_GLOBAL_ARRAY);
+			frame->ip += 5;
+
+			// the subscripts are under the rhs, which is left as the value of the assignment
+			Value rhs = vm.stackTop[-1];
+			Value* subscripts = vm.stackTop - 1 - subscriptCount;
+			Value* element = uncheckedElement(varDefn, subscripts);
+			*element = rhs;
+			writeBarrier(element, rhs);
+			vm.stackTop = subscripts;
+			push(rhs);
+			VM_NEXT();
 		}
 
 
 
 
 								   // Ch 22.4.1 pg 409 
-		case OP_GET_LOCAL: {
+		VM_CASE(OP_GET_LOCAL): {
 			uint8_t slot = READ_BYTE();
 			//push(vm.stack[slot]); // copy the variable from deeper in the stack onto the top for use
 			// printf("getting local var from slot %d and putting it at top of stack.  Type is %d\n", slot, frame->slots[slot].type);
 			push(frame->slots[slot]);
-			break;
+			VM_NEXT();
 		}
 
-		case OP_SET_LOCAL: {
+		VM_CASE(OP_SET_LOCAL): {
 			// Every assignment is also an Expression.  
 			// Every expression produces a value.
 			uint8_t slot = READ_BYTE();
@@ -795,74 +1352,259 @@ static InterpretResult interpret_bytecode_loop(CallFrame* frame, int startIp, in
 			frame->slots[slot] = peek(0);
 			// printf("set local var from top of stack back into slot %d. Type is %d\n", slot, frame->slots[slot].type);
 
-			break;
+			VM_NEXT();
 		}
 
 						 // new ch 18.4.2 pg 338
-		case OP_EQUAL: {
+		VM_CASE(OP_EQUAL): {
 			Value b = pop();
 			Value a = pop();
 			push(BOOL_VAL(valuesEqual(a, b)));
-			break;
+			VM_NEXT();
 		}
 		// case OP_GREATER:  BINARY_OP(BOOL_VAL, > ); break; // unoptimized
-		case OP_GREATER: {
+		VM_CASE(OP_GREATER): {
 			if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-				double b = ((peek(0)).as.number);
-				double a = ((peek(1)).as.number);
+				QUICKEN(OP_GREATER_NUM);
+				double b = AS_NUMBER(peek(0));
+				double a = AS_NUMBER(peek(1));
 				discardMultipleItemsFromStack(1);
-				(*(vm.stackTop - 1)).as.boolean = a > b;
-				(*(vm.stackTop - 1)).type = VAL_BOOL;  // turn the number on the stack into a Bool in place
+				vm.stackTop[-1] = BOOL_VAL(a > b);  // turn the number on the stack into a Bool in place
 			}
 			else {
 				runtimeError(
 					"Operands for greater than must be two numbers.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			VM_NEXT();
 		}
 		
 
 		//case OP_LESS:     BINARY_OP(BOOL_VAL, < ); break; // unoptimized
-		case OP_LESS: {
+		VM_CASE(OP_LESS): {
 			if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-				double b = ((peek(0)).as.number);
-				double a = ((peek(1)).as.number);
+				QUICKEN(OP_LESS_NUM);
+				double b = AS_NUMBER(peek(0));
+				double a = AS_NUMBER(peek(1));
 				discardMultipleItemsFromStack(1);
-				(*(vm.stackTop - 1)).as.boolean = a < b;
-				(*(vm.stackTop - 1)).type = VAL_BOOL;  // turn the number on the stack into a Bool in place
+				vm.stackTop[-1] = BOOL_VAL(a < b);  // turn the number on the stack into a Bool in place
 			}
 			else {
 				runtimeError(
 					"Operands for less than must be two numbers.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			VM_NEXT();
+		}
+		// Quickened opcodes - the generic opcode rewrites itself into one of these
+		// the first time it runs.  Each one has a single guard on its type guess;
+		// if the guess is wrong it rewrites itself back to the generic opcode and reruns it.
+		// An add that misses becomes OP_ADD_MIXED for good, so a site that sees numbers
+		// and strings in turn isn't rewritten every time.  The others only take numbers -
+		// their generic opcode gives the runtime error
+		VM_CASE(OP_ADD_NUM): {
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEOPTIMIZE(OP_ADD_MIXED);
+			double b = AS_NUMBER(peek(0));
+			double a = AS_NUMBER(peek(1));
+			discardMultipleItemsFromStack(1);
+			vm.stackTop[-1] = NUMBER_VAL(a + b);
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_ADD_STR): {
+			if (!IS_ANY_STRING(peek(0)) || !IS_ANY_STRING(peek(1))) DEOPTIMIZE(OP_ADD_MIXED);
+			concatenate();
+			VM_NEXT();
 		}
-		case OP_RANDOM: {
+
+		VM_CASE(OP_ADD_MIXED): {
 			if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-				double b = ((peek(0)).as.number);
-				double a = ((peek(1)).as.number);
+				double b = AS_NUMBER(peek(0));
+				double a = AS_NUMBER(peek(1));
 				discardMultipleItemsFromStack(1);
-				(*(vm.stackTop - 1)).as.number = randomNumber(a, b);
+				vm.stackTop[-1] = NUMBER_VAL(a + b);
+			}
+			else if (IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))) {
+				concatenate();
+			}
+			else {
+				runtimeError(
+					"Operands must be two numbers or two strings.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_SUBTRACT_NUM): {
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEOPTIMIZE(OP_SUBTRACT);
+			double b = AS_NUMBER(peek(0));
+			double a = AS_NUMBER(peek(1));
+			discardMultipleItemsFromStack(1);
+			vm.stackTop[-1] = NUMBER_VAL(a - b);
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_GREATER_NUM): {
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEOPTIMIZE(OP_GREATER);
+			double b = AS_NUMBER(peek(0));
+			double a = AS_NUMBER(peek(1));
+			discardMultipleItemsFromStack(1);
+			vm.stackTop[-1] = BOOL_VAL(a > b);
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_LESS_NUM): {
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DEOPTIMIZE(OP_LESS);
+			double b = AS_NUMBER(peek(0));
+			double a = AS_NUMBER(peek(1));
+			discardMultipleItemsFromStack(1);
+			vm.stackTop[-1] = BOOL_VAL(a < b);
+			VM_NEXT();
+		}
+
+		// Superinstructions - fused by the compiler, see emitConditionJump and emitGetLocal
+		VM_CASE(OP_GET_LOCAL2): {
+			uint8_t slotA = READ_BYTE();
+			uint8_t slotB = READ_BYTE();
+			push(frame->slots[slotA]);
+			push(frame->slots[slotB]);
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_ADD_CONST): {
+			Value b = READ_CONSTANT();
+			if (IS_NUMBER(peek(0)) && IS_NUMBER(b)) {
+				vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(peek(0)) + AS_NUMBER(b));
+			}
+			else if (IS_ANY_STRING(peek(0)) && IS_STRING(b)) {
+				push(b);
+				concatenate();
+			}
+			else {
+				runtimeError(
+					"Operands must be two numbers or two strings.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_NOT_EQUAL): {
+			Value b = pop();
+			Value a = pop();
+			push(BOOL_VAL(!valuesEqual(a, b)));
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_POP_JUMP_IF_FALSE_LONG):
+			jumpOffset = READ_LONG_JUMP();
+			goto popJumpIfFalse;
+		VM_CASE(OP_POP_JUMP_IF_FALSE): {
+			jumpOffset = READ_SHORT();
+		popJumpIfFalse:
+			if (isFalsey(pop())) frame->ip += jumpOffset;
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_LESS_JUMP_IF_FALSE_LONG):
+			jumpOffset = READ_LONG_JUMP();
+			goto lessJumpIfFalse;
+		VM_CASE(OP_LESS_JUMP_IF_FALSE): {
+			jumpOffset = READ_SHORT();
+		lessJumpIfFalse:
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+				runtimeError(
+					"Operands for less than must be two numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			double b = AS_NUMBER(peek(0));
+			double a = AS_NUMBER(peek(1));
+			discardMultipleItemsFromStack(2);  // the comparison result never goes on the stack
+			if (!(a < b)) frame->ip += jumpOffset;
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_GREATER_JUMP_IF_FALSE_LONG):
+			jumpOffset = READ_LONG_JUMP();
+			goto greaterJumpIfFalse;
+		VM_CASE(OP_GREATER_JUMP_IF_FALSE): {
+			jumpOffset = READ_SHORT();
+		greaterJumpIfFalse:
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+				runtimeError(
+					"Operands for greater than must be two numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			double b = AS_NUMBER(peek(0));
+			double a = AS_NUMBER(peek(1));
+			discardMultipleItemsFromStack(2);
+			if (!(a > b)) frame->ip += jumpOffset;
+			VM_NEXT();
+		}
+
+		// made by the peephole pass - see peephole.c
+		VM_CASE(OP_SET_LOCAL_POP): {
+			uint8_t slot = READ_BYTE();
+			frame->slots[slot] = pop();
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_NOT_LESS): {
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+				runtimeError(
+					"Operands for less than must be two numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			double b = AS_NUMBER(peek(0));
+			double a = AS_NUMBER(peek(1));
+			discardMultipleItemsFromStack(1);
+			vm.stackTop[-1] = BOOL_VAL(!(a < b));
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_NOT_GREATER): {
+			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+				runtimeError(
+					"Operands for greater than must be two numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			double b = AS_NUMBER(peek(0));
+			double a = AS_NUMBER(peek(1));
+			discardMultipleItemsFromStack(1);
+			vm.stackTop[-1] = BOOL_VAL(!(a > b));
+			VM_NEXT();
+		}
+
+		VM_CASE(OP_RANDOM): {
+			if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+				double b = AS_NUMBER(peek(0));
+				double a = AS_NUMBER(peek(1));
+				discardMultipleItemsFromStack(1);
+				vm.stackTop[-1] = NUMBER_VAL(randomNumber(a, b));
 			}
 			else {
 				runtimeError(
 					"Operands for random must be two numbers.");
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			break;
+			VM_NEXT();
 		}
 
+		VM_DEFAULT:
+			printf(" ** FATAL ERROR UNKNOWN OPCODE %d **\n", instruction);
+			return INTERPRET_RUNTIME_ERROR;
 
 		}
 	} // end for loop
 
+#ifdef COMPUTED_GOTO
+end_of_range:
+#endif
+	return INTERPRET_OK;
 }
 
-static InterpretResult main_run() {
+static InterpretResult main_run(bool useRegisters) {
 	
-	valueMemoize.type = VAL_NIL;
+	valueMemoize = NIL_VAL;
 
 	CallFrame* frame = &vm.frames[vm.frameCount - 1];  // Added Ch 24 
 
@@ -872,6 +1614,11 @@ static InterpretResult main_run() {
 	debugPrintTable(&vm.globals, "Globals", false);
 	printf("\n");
 
+	if (useRegisters) {
+		frame->ip = frame->start_ip = frame->function->registerChunk.code;
+		return runRegisterCode(frame);
+	}
+
 	//interpret_bytecode_loop(CallFrame * frame, int startIp, int endIp, bool infiniteLoop) {
 	return interpret_bytecode_loop(frame, 0, 0, true);  // run the interpreter
 
@@ -892,6 +1639,9 @@ InterpretResult interpret(const char* source) {
 	//compile(source);
 	//return INTERPRET_OK;
 
+	// the compiler's strings are old - it mustn't find a young one interned
+	collectNursery();
+
 	ObjFunction* function = compile(source);
 	if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
@@ -902,13 +1652,36 @@ InterpretResult interpret(const char* source) {
 
 	call(function, 0);  // pg 453 - set up first frame for top-level code.  Needed to remove code from pg 445
 
+	// the register backend needs register code for every function - otherwise run it all on the stack VM
+	bool useRegisters = vm.registerBackend && registerCodeReady(function);
+	if (vm.registerBackend && !useRegisters) {
+		printf("register backend can't run this script - using the stack VM\n");
+	}
+
+	long long startCount = vm.instructionCount;
 	clock_t start_time = clock();
-	InterpretResult r = main_run();
+	InterpretResult r = main_run(useRegisters);
 	clock_t end_time = clock();
 
 	double elapsed = (double)(end_time - start_time) / CLOCKS_PER_SEC;
 
 	printf("\n EXECUTION TIME %-9.3f SECONDS\n", elapsed);
+	printf(" %s backend: %lld instructions\n", useRegisters ? "register" : "stack",
+		vm.instructionCount - startCount);
+	if (vm.jit) printf(" jit: %d functions compiled\n", vm.jitFunctionCount);
+	if (vm.peephole) printf(" peephole: %d instructions (%d bytes) removed\n",
+		vm.peepholeInstructions, vm.peepholeBytes);
+	if (vm.gcCount > 0) printf(" gc: %d collections, %zu bytes freed, %zu bytes in use\n",
+		vm.gcCount, vm.gcFreed, vm.bytesAllocated);
+	if (vm.minorCount > 0) printf(" nursery: %d minor collections, %lld strings promoted\n",
+		vm.minorCount, vm.promotedCount);
+	if (vm.slabCount > 0 || vm.slabsReleased > 0) printf(" slabs: %d (%d KB), %d empty ones released\n",
+		vm.slabCount, vm.slabCount * (SLAB_SIZE / 1024), vm.slabsReleased);
+	if (vm.gcSlices > 0) printf(" gc: %d incremental slices of %d\n", vm.gcSlices, vm.gcSliceBudget);
+	if (vm.gcCount > 0 || vm.minorCount > 0) printGCPauses();
+	if (vm.arrayVarList.arrayVarCount > 0) printf(" arrays: %d (%zu bytes) in %d blocks + %d large, %zu bytes reserved\n",
+		vm.arrayVarList.arrayVarCount, vm.arrayVarList.bytesAllocated,
+		vm.arrayVarList.blockCount, vm.arrayVarList.largeCount, vm.arrayVarList.bytesReserved);
 
 	return r;
 
@@ -948,5 +1721,15 @@ InterpretResult interpret(const char* source) {
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
+#undef READ_INT
+#undef READ_CONSTANT_LONG
+#undef READ_LONG_JUMP
 #undef READ_STRING
-#undef BINARY_OP////////////////////////////////
\ No newline at end of file
+#undef READ_NAME
+#undef BINARY_OP
+#undef VM_SWITCH
+#undef VM_CASE
+#undef VM_DEFAULT
+#undef VM_NEXT
+#undef QUICKEN
+#undef DEOPTIMIZE////////////////////////////////
\ No newline at end of file
@@ -23,8 +23,18 @@ typedef struct CallFrame  {
 	uint8_t* ip;
 	uint8_t* start_ip; // TODO added but is this needed?  same as frame->function->chunk.code ?
 	Value* slots;
+	int arrayMark;  // vm.localArrays.count when it was called - back to that on return
 } CallFrame;
 
+// an incremental collection (clox --gc-slice n) stays GC_MARKING between its slices
+typedef enum {
+	GC_IDLE,
+	GC_MARKING
+} GCPhase;
+
+// pause times < 10us, < 100us ... < 100ms, longer
+#define GC_PAUSE_BUCKETS 6
+
 typedef struct {
 	CallFrame frames[FRAMES_MAX];
 	int frameCount;
@@ -36,15 +46,64 @@ typedef struct {
 	Value* stackTop;
 	
 	Table strings; // added Ch 20.5 pg 377 for string interning - hashset of unique strings 
-	Table globals; // added Ch 21.2 pg 390 for global vars
+	Table globals; // added Ch 21.2 pg 390 for global vars - now maps the name to its slot in globalValues
+	ValueArray globalValues; // global variables by slot - the compiler resolves the names (UNDEFINED_VAL until defined)
+	ValueArray globalNames;  // name of each slot, for the undefined variable error
 	Table globalArrayVars; // Dynamically bound - used to lookup the array definition
 	Obj* objects; //  added in Ch 19.5 page 352 as starting point for eventual GC implementation
 
+	// Garbage Collection Ch 26 - see memory.h
+	size_t bytesAllocated;  // everything that went through reallocate
+	size_t nextGC;          // collect when bytesAllocated gets past this
+	double gcGrowFactor;    // GC_HEAP_GROW_FACTOR unless clox --gc-grow
+	int grayCount;          // marked objects not traced yet
+	int grayCapacity;
+	Obj** grayStack;        // plain realloc - growing it must not start a collection
+	int gcCount;            // collections so far
+	size_t gcFreed;         // bytes they gave back
+	GCPhase gcPhase;
+	int gcSliceBudget;      // marking work per slice, 0 marks it all at once
+	int gcGlobalCursor;     // how far marking has got in globalValues
+	ArrayCursor gcArrayCursor;  // and in the arrays
+	int gcSlices;           // incremental slices so far
+	int gcPauses[GC_PAUSE_BUCKETS];  // every pause, slices and minor collections too
+	double gcLongestPause;  // seconds
+
+	// Generational nursery - see memory.h
+	uint8_t* nursery;          // NURSERY_SIZE bytes of young ObjStrings
+	uint8_t* nurseryTop;       // bump pointer
+	Value** rememberedSlots;   // array elements a young string was stored in
+	int rememberedCount;
+	int rememberedCapacity;
+	int* rememberedGlobals;    // the same for vm.globalValues slots
+	int rememberedGlobalCount;
+	int rememberedGlobalCapacity;
+	bool minorCollecting;      // reallocate must not start a major collection meanwhile
+	int minorCount;            // minor collections so far
+	long long promotedCount;   // strings copied out of the nursery
+
+	int slabCount;          // slabs the small objects are in now (memory.h)
+	int slabsReleased;      // empty ones given back after a sweep
+
 	long long instructionCount;
 	long long pushCount;
 	long long popCount;
 
 	ArrayVariables arrayVarList;
+	LocalArrays localArrays;  // the arrays declared in functions and blocks
+	int crossSection;  // stack index of the cursor of the a(*) = ... being run, for b(*) (OP_GET_CROSS_SECTION)
+	ValueArray crossSectionValues;  // the right hand side values of the a(*) = ... being run, stored at the end
+
+	bool registerBackend;  // run the register code (regvm.c) instead of the stack VM - clox --registers
+
+	bool peephole;             // tidy up each chunk after it is compiled (peephole.c) - off with clox --no-peephole
+	int peepholeInstructions;  // removed by the peephole pass, all functions
+	int peepholeBytes;
+
+	bool jit;              // compile hot functions to native code (jit.c) - clox --jit
+	int jitThreshold;      // calls before a function is compiled
+	int jitLoopThreshold;  // loop back edges before a running function is compiled and entered mid-loop
+	int jitFunctionCount;  // functions compiled so far
 	
 } VM;
 
@@ -67,4 +126,22 @@ extern VM vm;
 void push(Value value);
 Value pop();
 
+double randomNumber(double a, double b);
+
+// global variables - see OP_GET_GLOBAL_SLOT
+int globalSlot(ObjString* name);
+
+// lookup by name (OP_GET_GLOBAL, OP_SET_GLOBAL) - NULL if the global is not defined
+// only probes vm.globals when the inline cache is empty or the table has changed shape
+static inline Value* cachedGlobal(GlobalCache* cache, ObjString* name) {
+	if (cache->entry == NULL || cache->version != vm.globals.version) {
+		Entry* entry = tableGetEntry(&vm.globals, name);
+		if (entry == NULL) return NULL;
+		cache->entry = entry;
+		cache->version = vm.globals.version;
+	}
+	Value* value = &vm.globalValues.values[(int)AS_NUMBER(cache->entry->value)];
+	return IS_UNDEFINED(*value) ? NULL : value;
+}
+
 #endif
\ No newline at end of file